@@ -601,6 +601,11 @@ void *malloc(int size)
                 best_fit_chunk = fh;
                 bsize = fh->size;
             }
+
+            /* chunks span whole pages, none can be smaller than this one */
+            if (best_fit_chunk)
+                if (bsize == __align_up(size))
+                    break;
         }
 
         /* a suitable chunk has been found */
@@ -689,10 +694,18 @@ void free(void *ptr)
     if (!ptr)
         return;
 
-    /* FIXME: it takes long time to search in chuncks */
+    /* FIXME: it takes long time to search in chuncks. Search from both ends,
+     * since chunks tend to be released either early or soon after allocation.
+     */
     chunk_t *cur = __alloc_head;
+    chunk_t *last = __alloc_tail;
     while (cur->ptr != ptr) {
+        if (last->ptr == ptr) {
+            cur = last;
+            break;
+        }
         cur = cur->next;
+        last = last->prev;
         if (!cur) {
             printf("free(): double free detected\n");
             abort();
@@ -9,68 +9,79 @@
 
 #include "arm.c"
 
-void update_elf_offset(ph2_ir_t *ph2_ir)
+/* Branch merged by if-conversion which the instructions emitted belong to,
+ * or NEXT. They are executed if the condition set by OP_predicate holds.
+ */
+bb_connection_type_t arm_pred;
+
+arm_cond_t arm_pred_cond()
+{
+    if (arm_pred == THEN)
+        return __NE;
+    return __EQ;
+}
+
+/* Condition on which the branch 'ph2_ir' goes to its 'then_bb' */
+arm_cond_t arm_branch_cond(ph2_ir_t *ph2_ir)
+{
+    if (ph2_ir->is_branch_inverted)
+        return __EQ;
+    return __NE;
+}
+
+/* The constants which neither fit an immediate nor a movw are loaded from a
+ * literal pool following the function, each held once whatever its uses.
+ * A load must be within 4 KiB of its constant, so that the constants loaded
+ * farther from the end of the function are built with movw and movt. The
+ * pool is only used in the functions encoded as ARM code.
+ */
+int arm_pool[MAX_LITERALS];
+int arm_pool_size;
+int arm_pool_ofs; /* where the pool is laid out, -1 if it is not yet */
+bool arm_pooling;
+
+/* Whether building 'imm' takes more than one instruction without a pool */
+bool arm_needs_pool(int imm)
+{
+    if (arm_imm(imm) >= 0)
+        return false;
+    if (arm_imm(~imm) >= 0)
+        return false;
+    return (imm < 0) | (imm > 65535);
+}
+
+/* The slot of 'imm' in the pool, added if needed, or -1 if it is full */
+int arm_pool_slot(int imm)
+{
+    for (int i = 0; i < arm_pool_size; i++) {
+        if (arm_pool[i] == imm)
+            return i;
+    }
+    if (arm_pool_size == MAX_LITERALS)
+        return -1;
+    arm_pool[arm_pool_size] = imm;
+    return arm_pool_size++;
+}
+
+#include "thumb-codegen.c"
+
+/* The instructions emitted as predicable use the flags of OP_predicate only,
+ * and neither set them nor branch.
+ */
+bool is_predicable(ph2_ir_t *ph2_ir)
 {
     switch (ph2_ir->op) {
     case OP_load_constant:
-        /* ARMv7 uses 12 bits to encode immediate value, but the higher 4 bits
-         * are for rotation. See A5.2.4 "Modified immediate constants in ARM
-         * instructions" in ARMv7-A manual.
-         */
-        if (ph2_ir->src0 < 0)
-            elf_offset += 12;
-        else if (ph2_ir->src0 > 255)
-            elf_offset += 8;
-        else
-            elf_offset += 4;
-        return;
+    case OP_load_data_address:
     case OP_address_of:
     case OP_global_address_of:
-        /* ARMv7 uses 12 bits to encode immediate value, but the higher 4 bits
-         * are for rotation. See A5.2.4 "Modified immediate constants in ARM
-         * instructions" in ARMv7-A manual.
-         */
-        if (ph2_ir->src0 > 255)
-            elf_offset += 12;
-        else if (ph2_ir->src0 >= 0)
-            elf_offset += 4;
-        else
-            abort();
-        return;
     case OP_assign:
-        if (ph2_ir->dest != ph2_ir->src0)
-            elf_offset += 4;
-        return;
     case OP_load:
-    case OP_global_load:
-        /* ARMv7 straight uses 12 bits to encode the offset of load instruction
-         * (no rotation).
-         */
-        if (ph2_ir->src0 > 4095)
-            elf_offset += 16;
-        else if (ph2_ir->src0 >= 0)
-            elf_offset += 4;
-        else
-            abort();
-        return;
     case OP_store:
+    case OP_global_load:
     case OP_global_store:
-        /* ARMv7 straight uses 12 bits to encode the offset of store instruction
-         * (no rotation).
-         */
-        if (ph2_ir->src1 > 4095)
-            elf_offset += 16;
-        else if (ph2_ir->src1 >= 0)
-            elf_offset += 4;
-        else
-            abort();
-        return;
     case OP_read:
     case OP_write:
-    case OP_jump:
-    case OP_call:
-    case OP_load_func:
-    case OP_indirect:
     case OP_add:
     case OP_sub:
     case OP_mul:
@@ -79,110 +90,132 @@ void update_elf_offset(ph2_ir_t *ph2_ir)
     case OP_bit_and:
     case OP_bit_or:
     case OP_bit_xor:
+    case OP_bit_not:
     case OP_negate:
     case OP_log_and:
-    case OP_bit_not:
-        elf_offset += 4;
-        return;
-    case OP_div:
-        if (hard_mul_div) {
-            elf_offset += 4;
-        } else {
-            elf_offset += 104;
-        }
-        return;
-    case OP_mod:
-        if (hard_mul_div) {
-            elf_offset += 12;
-        } else {
-            elf_offset += 104;
-        }
-        return;
-    case OP_load_data_address:
-        elf_offset += 8;
-        return;
-    case OP_address_of_func:
-    case OP_eq:
-    case OP_neq:
-    case OP_gt:
-    case OP_lt:
-    case OP_geq:
-    case OP_leq:
-    case OP_log_not:
-    case OP_log_or:
-        elf_offset += 12;
-        return;
-    case OP_branch:
-        if (ph2_ir->is_branch_detached)
-            elf_offset += 12;
-        else
-            elf_offset += 8;
-        return;
-    case OP_return:
-        elf_offset += 24;
-        return;
+        return true;
     default:
-        printf("Unknown opcode\n");
-        abort();
+        return false;
     }
 }
 
-void cfg_flatten()
+/* Result latencies of an in-order core like the Cortex-A7, in cycles */
+int insn_latency(ph2_ir_t *ph2_ir)
 {
-    func_t *func = find_func("__syscall");
-    func->fn->bbs->elf_offset = 44; /* offset of start + exit in codegen */
-
-    elf_offset = 80; /* offset of start + exit + syscall in codegen */
-    GLOBAL_FUNC.fn->bbs->elf_offset = elf_offset;
-
-    for (ph2_ir_t *ph2_ir = GLOBAL_FUNC.fn->bbs->ph2_ir_list.head; ph2_ir;
-         ph2_ir = ph2_ir->next) {
-        update_elf_offset(ph2_ir);
+    switch (ph2_ir->op) {
+    case OP_load:
+    case OP_global_load:
+    case OP_read:
+    case OP_read_inc:
+        return 3;
+    case OP_mul:
+        return 3;
+    case OP_load_constant:
+        /* loaded from the literal pool */
+        if (!thumb & arm_needs_pool(ph2_ir->src0))
+            return 3;
+        return 1;
+    default:
+        return 1;
     }
+}
 
-    /* prepare 'argc' and 'argv', then proceed to 'main' function */
-    elf_offset += 24;
-
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        ph2_ir_t *flatten_ir;
-
-        /* reserve stack */
-        flatten_ir = add_ph2_ir(OP_define);
-        flatten_ir->src0 = fn->func->stack_size;
+/* Merge the loads or the stores from 'insn' on, which transfer registers in
+ * ascending order to adjacent slots of the stack, into 'merged', a single
+ * ldm/stm, when it saves instructions. The spills and the reloads around
+ * calls and at the ends of the blocks are often laid out so. Return the
+ * number of merged instructions, or 0.
+ */
+int arm_merge_transfers(ph2_ir_t *insn, ph2_ir_t *merged)
+{
+    opcode_t op = insn->op;
+    bb_connection_type_t pred = insn->pred;
+    int first, reg, ofs;
+    int last = -1;
+    int list = 0;
+    int n = 0;
 
-        for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
-            bb->elf_offset = elf_offset;
+    if (thumb)
+        return 0;
+    if (op == OP_load)
+        first = insn->src0;
+    else if (op == OP_store)
+        first = insn->src1;
+    else
+        return 0;
 
-            if (bb == fn->bbs) {
-                /* save ra, sp */
-                elf_offset += 16;
-            }
+    for (; insn; insn = insn->next) {
+        if ((insn->op != op) | (insn->pred != pred))
+            break;
+        if (op == OP_load) {
+            reg = insn->dest;
+            ofs = insn->src0;
+        } else {
+            reg = insn->src0;
+            ofs = insn->src1;
+        }
+        if ((reg <= last) | (ofs != first + n * 4))
+            break;
+        list += 1 << reg;
+        last = reg;
+        n++;
+    }
 
-            for (ph2_ir_t *insn = bb->ph2_ir_list.head; insn;
-                 insn = insn->next) {
-                flatten_ir = add_ph2_ir(OP_generic);
-                memcpy(flatten_ir, insn, sizeof(ph2_ir_t));
+    /* the first slot, at sp + 4, is reached with ldmib/stmib, the others
+     * need the address in r8 beforehand
+     */
+    if (first == 4) {
+        if (n < 2)
+            return 0;
+    } else if ((n < 3) | (first > 255))
+        return 0;
 
-                if (insn->op == OP_return) {
-                    /* restore sp */
-                    flatten_ir->src1 = bb->belong_to->func->stack_size;
-                }
+    if (op == OP_load)
+        merged->op = OP_load_multiple;
+    else
+        merged->op = OP_store_multiple;
+    merged->src0 = list;
+    merged->src1 = first;
+    return n;
+}
 
-                if (insn->op == OP_branch) {
-                    /* In SSA, we index 'else_bb' first, and then 'then_bb' */
-                    if (insn->else_bb != bb->rpo_next)
-                        flatten_ir->is_branch_detached = true;
-                }
+void emit(int code)
+{
+    if (arm_pred != NEXT) {
+        if (((code >> 28) & 15) == __AL)
+            code = (code & 0x0FFFFFFF) + (arm_pred_cond() << 28);
+    }
+    elf_write_code_int(code);
+}
 
-                update_elf_offset(flatten_ir);
-            }
-        }
+/* Build the constant 'imm' in 'rd', with mov, mvn or movw if it fits */
+void arm_load_imm(arm_reg rd, int imm)
+{
+    if (arm_imm(imm) >= 0)
+        emit(__mov_i(__AL, rd, imm));
+    else if (arm_imm(~imm) >= 0)
+        emit(__mvn_i(__AL, rd, ~imm));
+    else {
+        emit(__movw(__AL, rd, imm));
+        if ((imm < 0) | (imm > 65535))
+            emit(__movt(__AL, rd, imm));
     }
 }
 
-void emit(int code)
+/* Move sp by 'ofs', the size of a stack frame, negated to reserve it */
+void arm_move_sp(int ofs)
 {
-    elf_write_code_int(code);
+    if (!ofs)
+        return;
+    int imm = ofs;
+    if (imm < 0)
+        imm = 0 - imm;
+    if (arm_imm(imm) >= 0)
+        emit(__add_i(__AL, __sp, __sp, ofs));
+    else {
+        arm_load_imm(__r8, ofs);
+        emit(__add_r(__AL, __sp, __sp, __r8));
+    }
 }
 
 void emit_ph2_ir(ph2_ir_t *ph2_ir)
@@ -193,42 +226,63 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
     int rm = ph2_ir->src1;
     int ofs;
 
+    if (ph2_ir->pred != arm_pred) {
+        arm_pred = ph2_ir->pred;
+        emit_ph2_ir(ph2_ir);
+        arm_pred = NEXT;
+        return;
+    }
+
+    if (thumb) {
+        thumb_emit_ph2_ir(ph2_ir);
+        return;
+    }
+
     switch (ph2_ir->op) {
     case OP_define:
-        emit(__sw(__AL, __lr, __sp, -4));
-        emit(__movw(__AL, __r8, ph2_ir->src0 + 4));
-        emit(__movt(__AL, __r8, ph2_ir->src0 + 4));
-        emit(__sub_r(__AL, __sp, __sp, __r8));
+        /* a leaf function keeps its return address in lr */
+        if (ph2_ir->dest)
+            arm_move_sp(-ph2_ir->src0);
+        else {
+            emit(__push(__AL, 1 << __lr));
+            arm_move_sp(4 - ph2_ir->src0);
+        }
         return;
     case OP_load_constant:
-        if (ph2_ir->src0 < 0) {
-            emit(__movw(__AL, __r8, -ph2_ir->src0));
-            emit(__movt(__AL, __r8, -ph2_ir->src0));
-            emit(__rsb_i(__AL, rd, 0, __r8));
-        } else if (ph2_ir->src0 > 255) {
-            emit(__movw(__AL, rd, ph2_ir->src0));
-            emit(__movt(__AL, rd, ph2_ir->src0));
-        } else
-            emit(__mov_i(__AL, rd, ph2_ir->src0));
+        if (arm_pooling & !ph2_ir->is_far & arm_needs_pool(ph2_ir->src0)) {
+            if (arm_pool_ofs < 0) {
+                /* the pool is laid out at the end of the function */
+                ofs = arm_pool_slot(ph2_ir->src0);
+                if (ofs >= 0) {
+                    add_bb_fixup(ph2_ir);
+                    emit(__lw(__AL, rd, __pc, 0));
+                    return;
+                }
+            } else {
+                ofs = arm_pool_ofs + arm_pool_slot(ph2_ir->src0) * 4;
+                emit(__lw(__AL, rd, __pc, ofs - elf_code_idx - 8));
+                return;
+            }
+        }
+        arm_load_imm(rd, ph2_ir->src0);
         return;
     case OP_address_of:
-        if (ph2_ir->src0 > 255) {
-            emit(__movw(__AL, __r8, ph2_ir->src0));
-            emit(__movt(__AL, __r8, ph2_ir->src0));
+        if (arm_imm(ph2_ir->src0) < 0) {
+            arm_load_imm(__r8, ph2_ir->src0);
             emit(__add_r(__AL, rd, __sp, __r8));
         } else
             emit(__add_i(__AL, rd, __sp, ph2_ir->src0));
         return;
     case OP_global_address_of:
-        if (ph2_ir->src0 > 255) {
-            emit(__movw(__AL, __r8, ph2_ir->src0));
-            emit(__movt(__AL, __r8, ph2_ir->src0));
+        if (arm_imm(ph2_ir->src0) < 0) {
+            arm_load_imm(__r8, ph2_ir->src0);
             emit(__add_r(__AL, rd, __r12, __r8));
         } else
             emit(__add_i(__AL, rd, __r12, ph2_ir->src0));
         return;
     case OP_assign:
-        emit(__mov_r(__AL, rd, rn));
+        if (rd != rn)
+            emit(__mov_r(__AL, rd, rn));
         return;
     case OP_load:
         if (ph2_ir->src0 > 4095) {
@@ -248,6 +302,22 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         } else
             emit(__sw(__AL, rn, __sp, ph2_ir->src1));
         return;
+    case OP_load_multiple:
+        if (ph2_ir->src1 == 4)
+            emit(__ldmib(__AL, __sp, ph2_ir->src0));
+        else {
+            emit(__add_i(__AL, __r8, __sp, ph2_ir->src1));
+            emit(__ldm(__AL, __r8, ph2_ir->src0));
+        }
+        return;
+    case OP_store_multiple:
+        if (ph2_ir->src1 == 4)
+            emit(__stmib(__AL, __sp, ph2_ir->src0));
+        else {
+            emit(__add_i(__AL, __r8, __sp, ph2_ir->src1));
+            emit(__stm(__AL, __r8, ph2_ir->src0));
+        }
+        return;
     case OP_global_load:
         if (ph2_ir->src0 > 4095) {
             emit(__movw(__AL, __r8, ph2_ir->src0));
@@ -274,6 +344,14 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         else
             abort();
         return;
+    case OP_read_inc:
+        if (ph2_ir->src1 == 1)
+            emit(__lb_post(__AL, rd, rn, 1));
+        else if (ph2_ir->src1 == 4)
+            emit(__lw_post(__AL, rd, rn, 4));
+        else
+            abort();
+        return;
     case OP_write:
         if (ph2_ir->dest == 1)
             emit(__sb(__AL, rm, rn, 0));
@@ -284,18 +362,24 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         return;
     case OP_branch:
         emit(__teq(rn));
-        if (ph2_ir->is_branch_detached) {
-            emit(__b(__NE, 8));
+        emit(__b(arm_branch_cond(ph2_ir),
+                 ph2_ir->then_bb->elf_offset - elf_code_idx));
+        if (ph2_ir->is_branch_detached)
             emit(__b(__AL, ph2_ir->else_bb->elf_offset - elf_code_idx));
-        } else
-            emit(__b(__NE, ph2_ir->then_bb->elf_offset - elf_code_idx));
         return;
     case OP_jump:
         emit(__b(__AL, ph2_ir->next_bb->elf_offset - elf_code_idx));
         return;
+    case OP_predicate:
+        emit(__teq(rn));
+        return;
     case OP_call:
+        /* the callee may not be laid out yet, see is_laid_out() */
         func = find_func(ph2_ir->func_name);
-        emit(__bl(__AL, func->fn->bbs->elf_offset - elf_code_idx));
+        ofs = 0;
+        if (func->fn)
+            ofs = func->fn->elf_offset;
+        emit(__bl(__AL, ofs - elf_code_idx));
         return;
     case OP_load_data_address:
         emit(__movw(__AL, rd, ph2_ir->src0 + elf_data_start));
@@ -303,7 +387,9 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         return;
     case OP_address_of_func:
         func = find_func(ph2_ir->func_name);
-        ofs = elf_code_start + func->fn->bbs->elf_offset;
+        ofs = elf_code_start;
+        if (func->fn)
+            ofs += func->fn->elf_offset;
         emit(__movw(__AL, __r8, ofs));
         emit(__movt(__AL, __r8, ofs));
         emit(__sw(__AL, __r8, rn, 0));
@@ -315,15 +401,28 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         emit(__blx(__AL, __r8));
         return;
     case OP_return:
-        if (ph2_ir->src0 == -1)
-            emit(__mov_r(__AL, __r0, __r0));
-        else
+        if ((ph2_ir->src0 != -1) & (rn != __r0))
             emit(__mov_r(__AL, __r0, rn));
-        emit(__movw(__AL, __r8, ph2_ir->src1 + 4));
-        emit(__movt(__AL, __r8, ph2_ir->src1 + 4));
-        emit(__add_r(__AL, __sp, __sp, __r8));
-        emit(__lw(__AL, __lr, __sp, -4));
-        emit(__blx(__AL, __lr));
+        if (ph2_ir->dest) {
+            arm_move_sp(ph2_ir->src1);
+            emit(__bx(__AL, __lr));
+        } else {
+            arm_move_sp(ph2_ir->src1 - 4);
+            emit(__pop(__AL, 1 << __pc));
+        }
+        return;
+    case OP_tail_call:
+        if (ph2_ir->dest)
+            arm_move_sp(ph2_ir->src1);
+        else {
+            arm_move_sp(ph2_ir->src1 - 4);
+            emit(__pop(__AL, 1 << __lr));
+        }
+        func = find_func(ph2_ir->func_name);
+        ofs = 0;
+        if (func->fn)
+            ofs = func->fn->elf_offset;
+        emit(__b(__AL, ofs - elf_code_idx));
         return;
     case OP_add:
         emit(__add_r(__AL, rd, rn, rm));
@@ -457,16 +556,22 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
     }
 }
 
-void code_generate()
+/* The code preceding the functions, encoded again once the global
+ * initialization is laid out
+ */
+void emit_start()
 {
-    elf_data_start = elf_code_start + elf_offset;
+    func_t *func = find_func("__syscall");
 
     /* start */
     emit(__movw(__AL, __r8, GLOBAL_FUNC.stack_size));
     emit(__movt(__AL, __r8, GLOBAL_FUNC.stack_size));
     emit(__sub_r(__AL, __sp, __sp, __r8));
     emit(__mov_r(__AL, __r12, __sp));
-    emit(__bl(__AL, GLOBAL_FUNC.fn->bbs->elf_offset - elf_code_idx));
+    if (thumb)
+        emit(__blx_i(GLOBAL_FUNC.fn->bbs->elf_offset - elf_code_idx));
+    else
+        emit(__bl(__AL, GLOBAL_FUNC.fn->bbs->elf_offset - elf_code_idx));
 
     /* exit */
     emit(__movw(__AL, __r8, GLOBAL_FUNC.stack_size));
@@ -477,6 +582,7 @@ void code_generate()
     emit(__svc());
 
     /* syscall */
+    func->fn->elf_offset = elf_code_idx;
     emit(__mov_r(__AL, __r7, __r0));
     emit(__mov_r(__AL, __r0, __r1));
     emit(__mov_r(__AL, __r1, __r2));
@@ -485,23 +591,121 @@ void code_generate()
     emit(__mov_r(__AL, __r4, __r5));
     emit(__mov_r(__AL, __r5, __r6));
     emit(__svc());
-    emit(__mov_r(__AL, __pc, __lr));
+    if (thumb)
+        emit(__bx(__AL, __lr));
+    else
+        emit(__mov_r(__AL, __pc, __lr));
+}
 
+void emit_global()
+{
+    func_t *func = find_func("main");
     ph2_ir_t *ph2_ir;
+    thumb_pad();
+    GLOBAL_FUNC.fn->bbs->elf_offset = elf_code_idx;
     for (ph2_ir = GLOBAL_FUNC.fn->bbs->ph2_ir_list.head; ph2_ir;
          ph2_ir = ph2_ir->next)
-        emit_ph2_ir(ph2_ir);
+        emit_insn(ph2_ir);
 
     /* prepare 'argc' and 'argv', then proceed to 'main' function */
+    if (thumb) {
+        thumb_call_main();
+        thumb_pad();
+        return;
+    }
     emit(__movw(__AL, __r8, GLOBAL_FUNC.stack_size));
     emit(__movt(__AL, __r8, GLOBAL_FUNC.stack_size));
     emit(__add_r(__AL, __r8, __r12, __r8));
     emit(__lw(__AL, __r0, __r8, 0));
     emit(__add_i(__AL, __r1, __r8, 4));
-    emit(__b(__AL, MAIN_BB->elf_offset - elf_code_idx));
+    emit(__b(__AL, func->fn->elf_offset - elf_code_idx));
+}
 
-    for (int i = 0; i < ph2_ir_idx; i++) {
-        ph2_ir = &PH2_IR[i];
-        emit_ph2_ir(ph2_ir);
+/* Lay out the blocks of 'fn' followed by its literal pool. Returns whether
+ * the constants loaded from the pool are all within reach, or have been
+ * turned into movw and movt to lay 'fn' out again.
+ */
+bool fn_layout(fn_t *fn)
+{
+    ph2_ir_t define_ir;
+    ph2_ir_t merged;
+    bool reached = true;
+
+    arm_pool_size = 0;
+    arm_pool_ofs = -1;
+
+    /* reserve stack */
+    fn_define(fn, &define_ir);
+    emit_ph2_ir(&define_ir);
+
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        bb->elf_offset = elf_code_idx;
+
+        for (ph2_ir_t *insn = bb->ph2_ir_list.head; insn; insn = insn->next) {
+            if ((insn->op == OP_return) | (insn->op == OP_tail_call)) {
+                /* restore sp */
+                insn->src1 = frame_size(fn);
+                insn->dest = fn->is_leaf;
+            }
+
+            if (insn->op == OP_branch) {
+                /* branch to the block not following, if any, and jump to
+                 * 'else_bb' only if neither of them follows
+                 */
+                if (insn->then_bb == bb->rpo_next) {
+                    insn->then_bb = insn->else_bb;
+                    insn->else_bb = bb->rpo_next;
+                    insn->is_branch_inverted = !insn->is_branch_inverted;
+                }
+                insn->is_branch_detached = insn->else_bb != bb->rpo_next;
+            }
+
+            memcpy(&merged, insn, sizeof(ph2_ir_t));
+            int n = arm_merge_transfers(insn, &merged);
+            if (!n) {
+                emit_insn(insn);
+                continue;
+            }
+            emit_ph2_ir(&merged);
+            for (; n > 1; n--)
+                insn = insn->next;
+        }
     }
+
+    arm_pool_ofs = elf_code_idx;
+    for (int i = 0; i < arm_pool_size; i++)
+        elf_write_code_int(arm_pool[i]);
+
+    for (fixup_t *fixup = BB_FIXUPS; fixup; fixup = fixup->next) {
+        ph2_ir_t *ph2_ir = fixup->ph2_ir;
+        if (ph2_ir->op != OP_load_constant)
+            continue;
+        int ofs = arm_pool_ofs + arm_pool_slot(ph2_ir->src0) * 4;
+        if (ofs - fixup->code_idx - 8 < 4096)
+            continue;
+        ph2_ir->is_far = true;
+        reached = false;
+    }
+    return reached;
+}
+
+/* A function is laid out again with the constants found out of reach of
+ * the pool built in place, until they are all within reach. Each round
+ * builds at least one more constant so, which makes this end.
+ */
+void fn_emit(fn_t *fn)
+{
+    int code_idx;
+    fixup_t *fixups = FIXUPS;
+
+    thumb_pad();
+    code_idx = elf_code_idx;
+    fn->elf_offset = elf_code_idx;
+
+    arm_pooling = !thumb;
+    while (!fn_layout(fn))
+        emit_rewind(code_idx, fixups);
+
+    emit_bb_fixups();
+    arm_pooling = false;
 }
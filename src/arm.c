@@ -127,22 +127,32 @@ int __svc()
     return arm_encode(__AL, 240, 0, 0, 0);
 }
 
+/* The operand 2 encoding of 'imm', an 8-bit value rotated right by twice
+ * the 4-bit amount above it, or -1 if 'imm' has none
+ */
+int arm_imm(int imm)
+{
+    for (int rot = 0; rot < 16; rot++) {
+        /* undo the rotation right by 2 * rot */
+        int v = imm;
+        if (rot)
+            v = (imm << (rot * 2)) +
+                ((imm >> (32 - rot * 2)) & ((1 << (rot * 2)) - 1));
+        if ((v >= 0) & (v <= 255))
+            return (rot << 8) + v;
+    }
+    return -1;
+}
+
 int __mov(arm_cond_t cond, int io, int opcode, int s, int rn, int rd, int op2)
 {
-    int shift = 0;
-    if (op2 > 255) {
-        shift = 16; /* full rotation */
-        while ((op2 & 3) == 0) {
-            /* we can shift by two bits */
-            op2 = op2 >> 2;
-            shift -= 1;
-        }
-        if (op2 > 255)
+    if (io) {
+        op2 = arm_imm(op2);
+        if (op2 < 0)
             /* value spans more than 8 bits */
             error("Unable to represent value");
     }
-    return arm_encode(cond, s + (opcode << 1) + (io << 5), rn, rd,
-                      (shift << 8) + (op2 & 255));
+    return arm_encode(cond, s + (opcode << 1) + (io << 5), rn, rd, op2);
 }
 
 int __and_r(arm_cond_t cond, arm_reg rd, arm_reg rs, arm_reg rm)
@@ -165,6 +175,11 @@ int __mvn_r(arm_cond_t cond, arm_reg rd, arm_reg rm)
     return __mov(cond, 0, arm_mvn, 0, 0, rd, rm);
 }
 
+int __mvn_i(arm_cond_t cond, arm_reg rd, int imm)
+{
+    return __mov(cond, 1, arm_mvn, 0, 0, rd, imm);
+}
+
 int __movw(arm_cond_t cond, arm_reg rd, int imm)
 {
     return arm_encode(cond, 48, 0, rd, 0) +
@@ -283,6 +298,79 @@ int __sb(arm_cond_t cond, arm_reg rd, arm_reg rn, int ofs)
     return arm_transfer(cond, 0, 1, rn, rd, ofs);
 }
 
+/* Transfer at the address in 'rn', which is moved by 'ofs' afterwards: the
+ * one of arm_transfer() without its pre-indexing bit
+ */
+int arm_post_transfer(arm_cond_t cond,
+                      int l,
+                      int size,
+                      arm_reg rn,
+                      arm_reg rd,
+                      int ofs)
+{
+    return arm_transfer(cond, l, size, rn, rd, ofs) - (16 << 20);
+}
+
+int __lw_post(arm_cond_t cond, arm_reg rd, arm_reg rn, int ofs)
+{
+    return arm_post_transfer(cond, 1, 4, rn, rd, ofs);
+}
+
+int __lb_post(arm_cond_t cond, arm_reg rd, arm_reg rn, int ofs)
+{
+    return arm_post_transfer(cond, 1, 1, rn, rd, ofs);
+}
+
+/* Transfer of the registers in the bit mask 'list', the lowest one at the
+ * lowest address: 'p' moves the address before each transfer rather than
+ * after, 'u' moves it up from 'rn' rather than down, and 'w' writes the last
+ * address back to 'rn'.
+ */
+int arm_block_transfer(arm_cond_t cond,
+                       int l,
+                       int p,
+                       int u,
+                       int w,
+                       arm_reg rn,
+                       int list)
+{
+    int opcode = 128 + (p << 4) + (u << 3) + (w << 1) + l;
+    return arm_encode(cond, opcode, rn, 0, list & 65535);
+}
+
+/* ldmia/stmia, from the address in 'rn' up */
+int __ldm(arm_cond_t cond, arm_reg rn, int list)
+{
+    return arm_block_transfer(cond, 1, 0, 1, 0, rn, list);
+}
+
+int __stm(arm_cond_t cond, arm_reg rn, int list)
+{
+    return arm_block_transfer(cond, 0, 0, 1, 0, rn, list);
+}
+
+/* ldmib/stmib, from the word after the address in 'rn' up */
+int __ldmib(arm_cond_t cond, arm_reg rn, int list)
+{
+    return arm_block_transfer(cond, 1, 1, 1, 0, rn, list);
+}
+
+int __stmib(arm_cond_t cond, arm_reg rn, int list)
+{
+    return arm_block_transfer(cond, 0, 1, 1, 0, rn, list);
+}
+
+/* stmdb sp! and ldmia sp! */
+int __push(arm_cond_t cond, int list)
+{
+    return arm_block_transfer(cond, 0, 1, 0, 1, __sp, list);
+}
+
+int __pop(arm_cond_t cond, int list)
+{
+    return arm_block_transfer(cond, 1, 0, 1, 1, __sp, list);
+}
+
 int __b(arm_cond_t cond, int ofs)
 {
     int o = (ofs - 8) >> 2;
@@ -295,11 +383,24 @@ int __bl(arm_cond_t cond, int ofs)
     return arm_encode(cond, 176, 0, 0, 0) + (o & 16777215);
 }
 
+/* call Thumb code, at 'ofs' aligned to a halfword */
+int __blx_i(int ofs)
+{
+    int o = (ofs - 8) >> 2;
+    return arm_encode(15, 160, 0, 0, 0) + (((ofs >> 1) & 1) << 24) +
+           (o & 16777215);
+}
+
 int __blx(arm_cond_t cond, arm_reg rd)
 {
     return arm_encode(cond, 18, 15, 15, rd + 3888);
 }
 
+int __bx(arm_cond_t cond, arm_reg rd)
+{
+    return arm_encode(cond, 18, 15, 15, rd + 3856);
+}
+
 int __mul(arm_cond_t cond, arm_reg rd, arm_reg r1, arm_reg r2)
 {
     return arm_encode(cond, 0, rd, 0, (r1 << 8) + 144 + r2);
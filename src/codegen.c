@@ -0,0 +1 @@
+/root/repo/src/riscv-codegen.c
\ No newline at end of file
@@ -14,26 +14,47 @@
 #define MAX_VAR_LEN 32
 #define MAX_TYPE_LEN 32
 #define MAX_PARAMS 8
-#define MAX_LOCALS 1450
+#define MAX_LOCALS 1600
+#define LOCALS_CHUNK 64
+#define MAX_LOCAL_CHUNKS 25 /* MAX_LOCALS / LOCALS_CHUNK */
 #define MAX_FIELDS 32
 #define MAX_FUNCS 512
-#define MAX_FUNC_TRIES 2160
-#define MAX_BLOCKS 2048
+#define MAX_BLOCKS 4096
 #define MAX_TYPES 64
-#define MAX_IR_INSTR 36864
+#define MAX_IR_INSTR 65536
 #define MAX_BB_PRED 128
 #define MAX_BB_DOM_SUCC 64
 #define MAX_GLOBAL_IR 256
 #define MAX_LABEL 4096
-#define MAX_SOURCE 327680
-#define MAX_CODE 262144
+#define MAX_SOURCE 524288
+#define MAX_CODE 524288
 #define MAX_DATA 262144
 #define MAX_SYMTAB 65536
 #define MAX_STRTAB 65536
 #define MAX_HEADER 1024
 #define MAX_SECTION 1024
 #define MAX_ALIASES 1024
+#define MAX_MACRO_TOKENS 8192
+#define MAX_MACRO_STRS 65536
+#define MAX_LOOKAHEAD 4096
+#define MAX_LOOKAHEAD_STRS 32768
 #define MAX_CONSTANTS 1024
+#define MAX_INCLUDES 64
+#define MAX_JOBS 64
+#define MAX_INPUTS 1024
+#define MAX_REQUEST 65536
+#define MAX_PASSES 16
+#define MAX_RULES 16
+#define MAX_WINDOW 8     /* instructions a peephole rule looks ahead */
+#define MAX_PREDICATED 6 /* instructions of a branch merged by if-conversion */
+#define MAX_UNROLL 8     /* highest factor of the loop unrolling */
+#define MAX_UNROLLED 64  /* instructions of an unrolled loop body */
+#define MAX_LOOP_PHIS 32 /* phi functions of a loop header */
+#define MAX_REDUCED 8    /* pointers added to a loop by strength reduction */
+#define MAX_SCHEDULED 32 /* instructions scheduled together */
+#define MAX_LITERALS 256 /* constants of a literal pool on ARM */
+#define MAX_TAIL 32      /* instructions compared by tail merging */
+#define HASHMAP_INIT_SIZE 64
 #define MAX_CASES 128
 #define MAX_NESTING 128
 #define MAX_OPERAND_STACK_SIZE 32
@@ -83,6 +104,7 @@ typedef enum {
     OP_call,     /* function call */
     OP_indirect, /* indirect call with function pointer */
     OP_return,   /* explicit return */
+    OP_tail_call, /* call returning directly to the caller of the function */
 
     OP_allocat, /* allocate space on stack */
     OP_assign,
@@ -93,6 +115,7 @@ typedef enum {
     OP_label,
     OP_branch,      /* conditional jump */
     OP_jump,        /* unconditional jump */
+    OP_predicate,   /* condition of the blocks merged by if-conversion */
     OP_func_ret,    /* returned value */
     OP_block_start, /* code block start */
     OP_block_end,   /* code block end */
@@ -109,8 +132,11 @@ typedef enum {
     OP_global_load,
     OP_store, /* store a word to stack */
     OP_global_store,
-    OP_read,  /* read from memory address */
-    OP_write, /* write to memory address */
+    OP_load_multiple,  /* load adjacent words from stack, in ARM code */
+    OP_store_multiple, /* store adjacent words to stack, in ARM code */
+    OP_read,     /* read from memory address */
+    OP_read_inc, /* read, then step the address by the size read */
+    OP_write,    /* write to memory address */
 
     /* arithmetic operators */
     OP_add,
@@ -180,14 +206,20 @@ struct var {
 
 typedef struct var var_t;
 
+/* token lexed ahead of time, for macro bodies and the lookahead buffer */
+typedef struct {
+    int kind; /* token_t, defined by the lexer */
+    char *literal;
+    bool expand; /* false if it names the macro it was expanded from */
+} macro_token_t;
+
 typedef struct {
     char name[MAX_VAR_LEN];
     bool is_variadic;
-    int start_source_idx;
     var_t param_defs[MAX_PARAMS];
     int num_param_defs;
-    int params[MAX_PARAMS];
-    int num_params;
+    int start_token; /* body, as a slice of MACRO_TOKENS */
+    int num_tokens;
     bool disabled;
 } macro_t;
 
@@ -205,11 +237,11 @@ typedef struct {
 
 /* block definition */
 struct block {
-    var_t locals[MAX_LOCALS];
+    /* allocated LOCALS_CHUNK variables at a time, see block_local() */
+    var_t *locals[MAX_LOCAL_CHUNKS];
     int next_local;
     struct block *parent;
     func_t *func;
-    macro_t *macro;
     int locals_size;
     int index;
 };
@@ -235,6 +267,8 @@ typedef struct {
 
 typedef struct basic_block basic_block_t;
 
+typedef enum { NEXT, ELSE, THEN } bb_connection_type_t;
+
 /* phase-2 IR definition */
 struct ph2_ir {
     opcode_t op;
@@ -247,10 +281,37 @@ struct ph2_ir {
     basic_block_t *else_bb;
     struct ph2_ir *next;
     bool is_branch_detached;
+    bool is_branch_inverted; /* branches to 'then_bb' if the operand is 0 */
+    bool is_far; /* its target is out of reach of the short form */
+    /* THEN or ELSE in the branches merged by if-conversion, which are only
+     * executed, or only take effect, if their condition holds
+     */
+    bb_connection_type_t pred;
 };
 
 typedef struct ph2_ir ph2_ir_t;
 
+/* An instruction encoded before the location it refers to was known. It is
+ * encoded again at 'code_idx' once the location is laid out.
+ */
+typedef struct fixup {
+    int code_idx;
+    ph2_ir_t *ph2_ir;
+    struct fixup *next;
+} fixup_t;
+
+/* string-keyed hash map with open addressing and linear probing */
+typedef struct {
+    char *key; /* points to the name stored by the owner of 'val' */
+    void *val; /* NULL if the key has been removed */
+} hashmap_node_t;
+
+typedef struct {
+    hashmap_node_t *table;
+    int size; /* number of slots, always a power of 2 */
+    int used; /* occupied slots, including removed keys */
+} hashmap_t;
+
 /* type definition */
 struct type {
     char type_name[MAX_TYPE_LEN];
@@ -259,6 +320,7 @@ struct type {
     int size;
     var_t fields[MAX_FIELDS];
     int num_fields;
+    hashmap_t *members; /* index of fields, built by 'find_member' */
 };
 
 typedef struct type type_t;
@@ -279,17 +341,18 @@ typedef struct {
     bool disabled;
 } alias_t;
 
+/* source file that is not loaded again when included again */
+typedef struct {
+    char path[MAX_LINE_LEN];
+    char guard[MAX_VAR_LEN]; /* empty if marked with '#pragma once' */
+} include_t;
+
 /* constants for enums */
 typedef struct {
     char alias[MAX_VAR_LEN];
     int value;
 } constant_t;
 
-typedef struct {
-    int index;
-    int next[128];
-} trie_t;
-
 struct phi_operand {
     var_t *var;
     basic_block_t *from;
@@ -323,8 +386,6 @@ typedef struct {
     ph2_ir_t *tail;
 } ph2_ir_list_t;
 
-typedef enum { NEXT, ELSE, THEN } bb_connection_type_t;
-
 typedef struct {
     basic_block_t *bb;
     bb_connection_type_t type;
@@ -366,6 +427,7 @@ struct basic_block {
     struct basic_block *DF[64];
     int df_idx;
     int visited;
+    int loop; /* number of the last loop found holding the block */
     struct basic_block *dom_next[64];
     struct basic_block *dom_prev;
     fn_t *belong_to;
@@ -386,7 +448,11 @@ struct fn {
     symbol_list_t global_sym_list;
     int bb_cnt;
     int visited;
+    int loops; /* loops found so far, see find_loop() */
     func_t *func;
+    int elf_offset;
+    bool is_leaf; /* calls no function, set by the register allocation */
+    bool is_cold; /* does not return, like abort(), see fn_find_cold() */
     struct fn *next;
 };
 
@@ -406,3 +472,41 @@ typedef struct {
     var_t *var;
     int polluted;
 } regfile_t;
+
+/* A pass of the backend, run on each function in turn. The counters are
+ * gathered for the '--stats' option.
+ */
+typedef struct {
+    char name[MAX_VAR_LEN];
+    int level; /* lowest optimization level enabling it, 0 if required */
+    bool enabled;
+    void (*run)(fn_t *fn);
+    int fns;   /* functions it has run on */
+    int insns; /* instructions left after it */
+    int ph2;   /* second phase instructions left after it */
+    int usec;  /* time spent, in host builds */
+} pass_t;
+
+/* A rule of the peephole optimizer, rewriting the instructions of a block
+ * from 'ph2_ir' on, which follows 'prev', or starts the block if 'prev' is
+ * NULL. It returns whether it applied. The hits are gathered for the
+ * '--stats' option.
+ */
+typedef struct {
+    char name[MAX_VAR_LEN];
+    bool (*apply)(basic_block_t *bb, ph2_ir_t *prev, ph2_ir_t *ph2_ir);
+    int hits;
+} peephole_rule_t;
+
+/* A loop found by the loop passes, from its header back to its latch */
+typedef struct {
+    basic_block_t *pre; /* the only block entering the loop */
+    basic_block_t *header;
+    basic_block_t *latch;
+    var_t *phi_dest[MAX_LOOP_PHIS]; /* phi functions of the header, */
+    var_t *phi_src[MAX_LOOP_PHIS];  /* as the latch unwinds them */
+    int phis;
+    insn_t *cmp; /* of the induction variable with the bound, if counted */
+    int step;    /* of the induction variable */
+    int factor;  /* of the unrolling */
+} loop_t;
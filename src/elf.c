@@ -66,6 +66,12 @@ void elf_write_code_int(int val)
     elf_code_idx = elf_write_int(elf_code, elf_code_idx, val);
 }
 
+void elf_write_code_short(int val)
+{
+    elf_code[elf_code_idx++] = e_extract_byte(val, 0);
+    elf_code[elf_code_idx++] = e_extract_byte(val, 1);
+}
+
 void elf_generate_header()
 {
     /* ELF header */
@@ -87,7 +93,8 @@ void elf_generate_header()
                          elf_symtab_index +
                          elf_strtab_index); /* section header offset */
     /* flags */
-    elf_write_header_int(ELF_FLAGS);
+    /* EF_RISCV_RVC, in the code with compressed instructions */
+    elf_write_header_int(ELF_FLAGS | rvc);
     elf_write_header_byte(0x34); /* header size */
     elf_write_header_byte(0);
     elf_write_header_byte(0x20); /* program header size */
@@ -214,17 +221,15 @@ void elf_generate_sections()
 
 void elf_align()
 {
-    int remainder = elf_data_idx & 3;
-    if (remainder)
-        elf_data_idx += (4 - remainder);
+    /* pad with zeros, the buffers come from malloc and are not cleared */
+    while (elf_data_idx & 3)
+        elf_data[elf_data_idx++] = 0;
 
-    remainder = elf_symtab_index & 3;
-    if (remainder)
-        elf_symtab_index += (4 - remainder);
+    while (elf_symtab_index & 3)
+        elf_symtab[elf_symtab_index++] = 0;
 
-    remainder = elf_strtab_index & 3;
-    if (remainder)
-        elf_strtab_index += (4 - remainder);
+    while (elf_strtab_index & 3)
+        elf_strtab[elf_strtab_index++] = 0;
 }
 
 void elf_add_symbol(char *symbol, int len, int pc)
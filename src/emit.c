@@ -0,0 +1,136 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* The code is encoded in a single pass over the functions, each block being
+ * laid out where it is reached. An instruction referring to a location not
+ * laid out yet, like a block further down, a function defined later or the
+ * data section following the code, is encoded in place with a wrong target,
+ * and recorded to be encoded again at the same location once it is known.
+ * The code generators give such an instruction a single form whatever its
+ * target, so that its size does not change.
+ */
+
+void emit_ph2_ir(ph2_ir_t *ph2_ir);
+
+/* Whether the location 'ph2_ir' refers to, if any, is already laid out */
+bool is_laid_out(ph2_ir_t *ph2_ir)
+{
+    func_t *func;
+
+    switch (ph2_ir->op) {
+    case OP_branch:
+    case OP_jump:
+        /* the blocks of the function are all laid out at its end */
+        return false;
+    case OP_load_data_address:
+        /* the data section follows the code, whose size is not known yet */
+        return false;
+    case OP_call:
+    case OP_tail_call:
+    case OP_address_of_func:
+        func = find_func(ph2_ir->func_name);
+        if (!func->fn)
+            return false;
+        return func->fn->elf_offset >= 0;
+    default:
+        return true;
+    }
+}
+
+/* Record 'ph2_ir', about to be encoded at the end of the code, to be
+ * encoded again once its function is laid out
+ */
+void add_bb_fixup(ph2_ir_t *ph2_ir)
+{
+    fixup_t *fixup = malloc(sizeof(fixup_t));
+    fixup->code_idx = elf_code_idx;
+    /* the function is laid out before its instructions are freed */
+    fixup->ph2_ir = ph2_ir;
+    fixup->next = BB_FIXUPS;
+    BB_FIXUPS = fixup;
+}
+
+/* Encode 'ph2_ir' at the end of the code */
+void emit_insn(ph2_ir_t *ph2_ir)
+{
+    if (!is_laid_out(ph2_ir)) {
+        if ((ph2_ir->op == OP_branch) | (ph2_ir->op == OP_jump))
+            add_bb_fixup(ph2_ir);
+        else {
+            fixup_t *fixup = malloc(sizeof(fixup_t));
+            fixup->code_idx = elf_code_idx;
+            fixup->ph2_ir = malloc(sizeof(ph2_ir_t));
+            memcpy(fixup->ph2_ir, ph2_ir, sizeof(ph2_ir_t));
+            fixup->next = FIXUPS;
+            FIXUPS = fixup;
+        }
+    }
+    emit_ph2_ir(ph2_ir);
+}
+
+/* Encode again the instructions recorded in 'FIXUPS', now that their
+ * targets are laid out, and release them.
+ */
+void emit_fixups()
+{
+    int code_idx = elf_code_idx;
+
+    while (FIXUPS) {
+        fixup_t *next = FIXUPS->next;
+        elf_code_idx = FIXUPS->code_idx;
+        emit_ph2_ir(FIXUPS->ph2_ir);
+        free(FIXUPS->ph2_ir);
+        free(FIXUPS);
+        FIXUPS = next;
+    }
+    elf_code_idx = code_idx;
+}
+
+/* Encode again the instructions of the function laid out last recorded by
+ * add_bb_fixup(), like its branches and jumps
+ */
+void emit_bb_fixups()
+{
+    int code_idx = elf_code_idx;
+
+    while (BB_FIXUPS) {
+        fixup_t *next = BB_FIXUPS->next;
+        elf_code_idx = BB_FIXUPS->code_idx;
+        emit_ph2_ir(BB_FIXUPS->ph2_ir);
+        free(BB_FIXUPS);
+        BB_FIXUPS = next;
+    }
+    elf_code_idx = code_idx;
+}
+
+/* Discard the code of the function starting at 'code_idx', to lay it out
+ * again, with the fixups recorded since 'FIXUPS' was 'fixups'.
+ */
+void emit_rewind(int code_idx, fixup_t *fixups)
+{
+    while (BB_FIXUPS) {
+        fixup_t *next = BB_FIXUPS->next;
+        free(BB_FIXUPS);
+        BB_FIXUPS = next;
+    }
+    while (FIXUPS != fixups) {
+        fixup_t *next = FIXUPS->next;
+        free(FIXUPS->ph2_ir);
+        free(FIXUPS);
+        FIXUPS = next;
+    }
+    elf_code_idx = code_idx;
+}
+
+/* The instruction reserving the stack frame of 'fn', in 'define_ir' */
+void fn_define(fn_t *fn, ph2_ir_t *define_ir)
+{
+    define_ir->op = OP_define;
+    define_ir->pred = NEXT;
+    define_ir->src0 = frame_size(fn);
+    define_ir->dest = fn->is_leaf;
+}
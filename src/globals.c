@@ -12,51 +12,90 @@ int blocks_idx = 0;
 
 macro_t *MACROS;
 int macros_idx = 0;
+hashmap_t *MACROS_MAP;
+
+/* The bodies of function-like macros are lexed once into MACRO_TOKENS, with
+ * their literals kept in MACRO_STRS.
+ */
+macro_token_t *MACRO_TOKENS;
+int macro_tokens_idx = 0;
+char *MACRO_STRS;
+int macro_strs_idx = 0;
+
+/* LOOKAHEAD holds the tokens of macro expansions that the lexer returns before
+ * reading the source again. It is a stack, with the next token on top. The
+ * literals of macro arguments are copied to LOOKAHEAD_STRS, which is reused
+ * once the stack is empty.
+ */
+macro_token_t *LOOKAHEAD;
+int lookahead_idx = 0;
+char *LOOKAHEAD_STRS;
+int lookahead_strs_idx = 0;
+
+/* arguments of the macro invocation being expanded */
+macro_token_t *MACRO_ARGS;
 
 /* the first element is reserved for global scope */
 func_t *FUNCS;
 int funcs_idx = 1;
 
-/* FUNC_TRIES is used to improve the performance of the find_func function.
- * Instead of searching through all functions and comparing their names, we can
- * utilize the trie data structure to search for existing functions efficiently.
- * The index starts from 1 because the first trie node represents an empty input
- * string, and it is not possible to record a function with an empty name.
+/* FUNCS_MAP maps the function names to their entries in FUNCS, so that
+ * find_func does not have to compare the name against every function.
  */
-trie_t *FUNC_TRIES;
-int func_tries_idx = 1;
+hashmap_t *FUNCS_MAP;
 
 type_t *TYPES;
 int types_idx = 0;
 
+/* Types are looked up by name in two namespaces: structure tags, and all the
+ * other type names.
+ */
+hashmap_t *TYPES_MAP;
+hashmap_t *TAGS_MAP;
+
 ph1_ir_t *GLOBAL_IR;
 int global_ir_idx = 0;
 
 ph1_ir_t *PH1_IR;
 int ph1_ir_idx = 0;
 
-ph2_ir_t *PH2_IR;
-int ph2_ir_idx = 0;
-
 label_lut_t *LABEL_LUT;
 int label_lut_idx = 0;
+hashmap_t *LABELS_MAP;
 
 func_list_t FUNC_LIST;
 func_t GLOBAL_FUNC;
-basic_block_t *MAIN_BB;
-int elf_offset = 0;
+fixup_t *FIXUPS;
+fixup_t *BB_FIXUPS;
 
+#ifdef __SHECC__
 regfile_t REGS[REG_CNT];
+#else
+/* every thread of the '-j' mode allocates the registers of its functions */
+__thread regfile_t REGS[REG_CNT];
+
+/* guards the objects shared by the functions processed in parallel */
+pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 alias_t *ALIASES;
 int aliases_idx = 0;
+hashmap_t *ALIASES_MAP;
 
 constant_t *CONSTANTS;
 int constants_idx = 0;
+hashmap_t *CONSTANTS_MAP;
 
 char *SOURCE;
 int source_idx = 0;
 
+/* INCLUDES_MAP maps the paths of the headers which are guarded against
+ * multiple inclusion to their entries in INCLUDES.
+ */
+include_t *INCLUDES;
+int includes_idx = 0;
+hashmap_t *INCLUDES_MAP;
+
 /* ELF sections */
 
 char *elf_code;
@@ -72,67 +111,116 @@ char *elf_symtab;
 char *elf_strtab;
 char *elf_section;
 
-/**
- * insert_trie() - Inserts a new element into the trie structure.
- * @trie: A pointer to the trie where the name will be inserted.
- * @name: The name to be inserted into the trie.
- * @funcs_index: The index of the pointer to the func_t. The index is recorded
- *     in a 1-indexed format. Because the first element of 'FUNCS' has been
- *     reserved, there is no need to shift it.
- * Return: The index of the pointer to the func_t.
- *
- * If the function has been inserted, the return value is the index of the
- * function in FUNCS. Otherwise, the return value is the value of the parameter
- * @funcs_index.
- */
-int insert_trie(trie_t *trie, char *name, int funcs_index)
-{
-    char first_char = *name;
-    int fc = first_char;
-    if (!fc) {
-        if (!trie->index)
-            trie->index = funcs_index;
-        return trie->index;
+/* djb2 string hash, kept within 24 bits so that it never overflows */
+int hashmap_hash(char *key)
+{
+    int h = 5381;
+    for (int i = 0; key[i]; i++)
+        h = ((h << 5) + h + key[i]) & 0xFFFFFF;
+    return h;
+}
+
+hashmap_t *hashmap_create(int size)
+{
+    hashmap_t *map = malloc(sizeof(hashmap_t));
+    map->table = calloc(size, sizeof(hashmap_node_t));
+    map->size = size;
+    map->used = 0;
+    return map;
+}
+
+/* Return the slot holding @key, or the empty slot where it would be placed. */
+hashmap_node_t *hashmap_probe(hashmap_t *map, char *key)
+{
+    hashmap_node_t *table = map->table;
+    int mask = map->size - 1;
+    int i = hashmap_hash(key) & mask;
+
+    while (table[i].key) {
+        if (!strcmp(table[i].key, key))
+            break;
+        i = (i + 1) & mask;
     }
-    if (!trie->next[fc]) {
-        /* FIXME: The func_tries_idx variable may exceed the maximum number,
-         * which can lead to a segmentation fault. This issue is affected by the
-         * number of functions and the length of their names. The proper way to
-         * handle this is to dynamically allocate a new element.
-         */
-        trie->next[fc] = func_tries_idx++;
-        for (int i = 0; i < 128; i++)
-            FUNC_TRIES[trie->next[fc]].next[i] = 0;
-        FUNC_TRIES[trie->next[fc]].index = 0;
+    return &table[i];
+}
+
+void hashmap_put(hashmap_t *map, char *key, void *val);
+
+/* Double the table and drop the removed keys. */
+void hashmap_grow(hashmap_t *map)
+{
+    hashmap_node_t *old = map->table;
+    int old_size = map->size;
+
+    map->size = old_size * 2;
+    map->table = calloc(map->size, sizeof(hashmap_node_t));
+    map->used = 0;
+
+    for (int i = 0; i < old_size; i++) {
+        if (old[i].val)
+            hashmap_put(map, old[i].key, old[i].val);
     }
-    return insert_trie(&FUNC_TRIES[trie->next[fc]], name + 1, funcs_index);
+    free(old);
 }
 
 /**
- * find_trie() - search the index of the function name in the trie
- * @trie: A pointer to the trie where the name will be searched.
- * @name: The name to be searched.
- *
- * Return: The index of the pointer to the func_t.
- *
- * 0 - the name not found.
- * otherwise - the index of the founded index in the trie array.
+ * hashmap_put() - Map the key to the value, replacing any previous value.
+ * @map: The hash map.
+ * @key: The key. It is not copied, so it must outlive its entry.
+ * @val: The value, which must not be NULL.
  */
-int find_trie(trie_t *trie, char *name)
+void hashmap_put(hashmap_t *map, char *key, void *val)
+{
+    hashmap_node_t *node;
+
+    /* keep the load factor below 3/4 */
+    if ((map->used + 1) * 4 > map->size * 3)
+        hashmap_grow(map);
+
+    node = hashmap_probe(map, key);
+    if (!node->key)
+        map->used++;
+    node->key = key;
+    node->val = val;
+}
+
+/* Return the value mapped by the key, or NULL if not found. */
+void *hashmap_get(hashmap_t *map, char *key)
+{
+    hashmap_node_t *node = hashmap_probe(map, key);
+    return node->val;
+}
+
+/* Return true if the key was present. The slot stays occupied so that probing
+ * sequences passing through it are not broken.
+ */
+bool hashmap_remove(hashmap_t *map, char *key)
+{
+    hashmap_node_t *node = hashmap_probe(map, key);
+    if (!node->val)
+        return false;
+    node->val = NULL;
+    return true;
+}
+
+void hashmap_free(hashmap_t *map)
 {
-    char first_char = *name;
-    int fc = first_char;
-    if (!fc)
-        return trie->index;
-    if (!trie->next[fc])
-        return 0;
-    return find_trie(&FUNC_TRIES[trie->next[fc]], name + 1);
+    free(map->table);
+    free(map);
 }
 
 /* options */
 
 int dump_ir = 0;
 int hard_mul_div = 0;
+int fn_at_a_time = 0;
+int jobs = 1;
+int thumb = 0;
+int rvc = 0;
+int opt_level = 1;
+int unroll_factor = 4;
+int verify_ir = 0;
+int pass_stats = 0;
 
 /**
  * find_type() - Find the type by the given name.
@@ -146,26 +234,27 @@ int hard_mul_div = 0;
  */
 type_t *find_type(char *type_name, int flag)
 {
-    for (int i = 0; i < types_idx; i++) {
-        if (TYPES[i].base_type == TYPE_struct) {
-            if (flag == 1)
-                continue;
-            if (!strcmp(TYPES[i].type_name, type_name))
-                return &TYPES[i];
-        } else {
-            if (flag == 2)
-                continue;
-            if (!strcmp(TYPES[i].type_name, type_name)) {
-                /* If it is a forwardly declared alias of a structure, return
-                 * the base structure type.
-                 */
-                if (TYPES[i].base_type == TYPE_typedef && TYPES[i].size == 0)
-                    return TYPES[i].base_struct;
-                return &TYPES[i];
-            }
-        }
+    type_t *type = NULL, *tag = NULL;
+
+    if (flag != 2)
+        type = hashmap_get(TYPES_MAP, type_name);
+    if (flag != 1)
+        tag = hashmap_get(TAGS_MAP, type_name);
+
+    /* the one declared first wins if both namespaces have the name */
+    if (tag) {
+        if (!type || tag < type)
+            return tag;
     }
-    return NULL;
+    if (!type)
+        return NULL;
+
+    /* If it is a forwardly declared alias of a structure, return the base
+     * structure type.
+     */
+    if (type->base_type == TYPE_typedef && type->size == 0)
+        return type->base_struct;
+    return type;
 }
 
 ph1_ir_t *add_global_ir(opcode_t op)
@@ -182,13 +271,6 @@ ph1_ir_t *add_ph1_ir(opcode_t op)
     return ph1_ir;
 }
 
-ph2_ir_t *add_ph2_ir(opcode_t op)
-{
-    ph2_ir_t *ph2_ir = &PH2_IR[ph2_ir_idx++];
-    ph2_ir->op = op;
-    return ph2_ir;
-}
-
 void set_var_liveout(var_t *var, int end)
 {
     if (var->liveness >= end)
@@ -201,24 +283,29 @@ void add_label(char *name, int offset)
     label_lut_t *lut = &LABEL_LUT[label_lut_idx++];
     strcpy(lut->name, name);
     lut->offset = offset;
+    if (!hashmap_get(LABELS_MAP, lut->name))
+        hashmap_put(LABELS_MAP, lut->name, lut);
 }
 
 int find_label_offset(char name[])
 {
-    for (int i = 0; i < label_lut_idx; i++) {
-        if (!strcmp(LABEL_LUT[i].name, name))
-            return LABEL_LUT[i].offset;
-    }
+    label_lut_t *lut = hashmap_get(LABELS_MAP, name);
+    if (lut)
+        return lut->offset;
     return -1;
 }
 
-block_t *add_block(block_t *parent, func_t *func, macro_t *macro)
+void error(char *msg);
+
+block_t *add_block(block_t *parent, func_t *func)
 {
+    if (blocks_idx >= MAX_BLOCKS)
+        error("Too many blocks");
+
     block_t *blk = &BLOCKS[blocks_idx];
     blk->index = blocks_idx++;
     blk->parent = parent;
     blk->func = func;
-    blk->macro = macro;
     blk->next_local = 0;
     return blk;
 }
@@ -229,82 +316,64 @@ void add_alias(char *alias, char *value)
     strcpy(al->alias, alias);
     strcpy(al->value, value);
     al->disabled = false;
+    hashmap_put(ALIASES_MAP, al->alias, al);
 }
 
 char *find_alias(char alias[])
 {
-    for (int i = 0; i < aliases_idx; i++) {
-        if (!ALIASES[i].disabled && !strcmp(alias, ALIASES[i].alias))
-            return ALIASES[i].value;
-    }
+    alias_t *al = hashmap_get(ALIASES_MAP, alias);
+    if (al)
+        return al->value;
     return NULL;
 }
 
 bool remove_alias(char *alias)
 {
-    for (int i = 0; i < aliases_idx; i++) {
-        if (!ALIASES[i].disabled && !strcmp(alias, ALIASES[i].alias)) {
-            ALIASES[i].disabled = true;
-            return true;
-        }
-    }
-    return false;
+    alias_t *al = hashmap_get(ALIASES_MAP, alias);
+    if (!al)
+        return false;
+    al->disabled = true;
+    hashmap_remove(ALIASES_MAP, alias);
+    return true;
 }
 
 macro_t *add_macro(char *name)
 {
     macro_t *ma = &MACROS[macros_idx++];
     strcpy(ma->name, name);
+    ma->is_variadic = false;
+    ma->num_param_defs = 0;
+    ma->num_tokens = 0;
     ma->disabled = false;
+    hashmap_put(MACROS_MAP, ma->name, ma);
     return ma;
 }
 
 macro_t *find_macro(char *name)
 {
-    for (int i = 0; i < macros_idx; i++) {
-        if (!MACROS[i].disabled && !strcmp(name, MACROS[i].name))
-            return &MACROS[i];
-    }
-    return NULL;
+    return hashmap_get(MACROS_MAP, name);
 }
 
 bool remove_macro(char *name)
 {
-    for (int i = 0; i < macros_idx; i++) {
-        if (!MACROS[i].disabled && !strcmp(name, MACROS[i].name)) {
-            MACROS[i].disabled = true;
-            return true;
-        }
-    }
-    return false;
-}
-
-void error(char *msg);
-int find_macro_param_src_idx(char *name, block_t *parent)
-{
-    macro_t *macro = parent->macro;
-
-    if (!parent)
-        error("The macro expansion is not supported in the global scope");
-    if (!parent->macro)
-        return 0;
-
-    for (int i = 0; i < macro->num_param_defs; i++) {
-        if (!strcmp(macro->param_defs[i].var_name, name))
-            return macro->params[i];
-    }
-    return 0;
+    macro_t *ma = hashmap_get(MACROS_MAP, name);
+    if (!ma)
+        return false;
+    ma->disabled = true;
+    hashmap_remove(MACROS_MAP, name);
+    return true;
 }
 
 func_t *add_func(char *name)
 {
-    func_t *fn;
-    int index = insert_trie(FUNC_TRIES, name, funcs_idx);
-    if (index == funcs_idx) {
+    func_t *fn = hashmap_get(FUNCS_MAP, name);
+    if (!fn) {
+        if (funcs_idx >= MAX_FUNCS)
+            error("Too many functions");
         fn = &FUNCS[funcs_idx++];
         strcpy(fn->return_def.var_name, name);
+        hashmap_put(FUNCS_MAP, fn->return_def.var_name, fn);
     }
-    fn = &FUNCS[index];
     fn->stack_size = 4; /* starting point of stack */
     return fn;
 }
@@ -321,28 +390,35 @@ type_t *add_named_type(char *name)
     return type;
 }
 
+/* Make the type visible to 'find_type' once its name and base type are
+ * settled. An earlier type of the same name in the same namespace is kept.
+ */
+void index_type(type_t *type)
+{
+    hashmap_t *map = TYPES_MAP;
+    if (type->base_type == TYPE_struct)
+        map = TAGS_MAP;
+    if (!hashmap_get(map, type->type_name))
+        hashmap_put(map, type->type_name, type);
+}
+
 void add_constant(char alias[], int value)
 {
     constant_t *constant = &CONSTANTS[constants_idx++];
     strcpy(constant->alias, alias);
     constant->value = value;
+    if (!hashmap_get(CONSTANTS_MAP, constant->alias))
+        hashmap_put(CONSTANTS_MAP, constant->alias, constant);
 }
 
 constant_t *find_constant(char alias[])
 {
-    for (int i = 0; i < constants_idx; i++) {
-        if (!strcmp(CONSTANTS[i].alias, alias))
-            return &CONSTANTS[i];
-    }
-    return NULL;
+    return hashmap_get(CONSTANTS_MAP, alias);
 }
 
 func_t *find_func(char func_name[])
 {
-    int index = find_trie(FUNC_TRIES, func_name);
-    if (index)
-        return &FUNCS[index];
-    return NULL;
+    return hashmap_get(FUNCS_MAP, func_name);
 }
 
 var_t *find_member(char token[], type_t *type)
@@ -353,11 +429,23 @@ var_t *find_member(char token[], type_t *type)
     if (type->size == 0)
         type = type->base_struct;
 
-    for (int i = 0; i < type->num_fields; i++) {
-        if (!strcmp(type->fields[i].var_name, token))
-            return &type->fields[i];
+    /* the structure is complete by now, index its fields on first use */
+    if (!type->members) {
+        type->members = hashmap_create(HASHMAP_INIT_SIZE);
+        for (int i = 0; i < type->num_fields; i++) {
+            var_t *field = &type->fields[i];
+            if (!hashmap_get(type->members, field->var_name))
+                hashmap_put(type->members, field->var_name, field);
+        }
     }
-    return NULL;
+    return hashmap_get(type->members, token);
+}
+
+/* The variable 'i' of 'blk' */
+var_t *block_local(block_t *blk, int i)
+{
+    var_t *chunk = blk->locals[i / LOCALS_CHUNK];
+    return &chunk[i % LOCALS_CHUNK];
 }
 
 var_t *find_local_var(char *token, block_t *block)
@@ -366,8 +454,9 @@ var_t *find_local_var(char *token, block_t *block)
 
     for (; block; block = block->parent) {
         for (int i = 0; i < block->next_local; i++) {
-            if (!strcmp(block->locals[i].var_name, token))
-                return &block->locals[i];
+            var_t *var = block_local(block, i);
+            if (!strcmp(var->var_name, token))
+                return var;
         }
     }
 
@@ -385,8 +474,9 @@ var_t *find_global_var(char *token)
     block_t *block = &BLOCKS[0];
 
     for (int i = 0; i < block->next_local; i++) {
-        if (!strcmp(block->locals[i].var_name, token))
-            return &block->locals[i];
+        var_t *var = block_local(block, i);
+        if (!strcmp(var->var_name, token))
+            return var;
     }
     return NULL;
 }
@@ -422,6 +512,7 @@ int size_var(var_t *var)
 fn_t *add_fn()
 {
     fn_t *n = calloc(1, sizeof(fn_t));
+    n->elf_offset = -1; /* not laid out yet */
 
     if (!FUNC_LIST.head) {
         FUNC_LIST.head = n;
@@ -572,18 +663,30 @@ void global_init()
 {
     elf_code_start = ELF_START + elf_header_len;
 
-    BLOCKS = malloc(MAX_BLOCKS * sizeof(block_t));
+    BLOCKS = calloc(MAX_BLOCKS, sizeof(block_t));
     MACROS = malloc(MAX_ALIASES * sizeof(macro_t));
+    MACROS_MAP = hashmap_create(HASHMAP_INIT_SIZE);
+    MACRO_TOKENS = malloc(MAX_MACRO_TOKENS * sizeof(macro_token_t));
+    MACRO_STRS = malloc(MAX_MACRO_STRS);
+    LOOKAHEAD = malloc(MAX_LOOKAHEAD * sizeof(macro_token_t));
+    LOOKAHEAD_STRS = malloc(MAX_LOOKAHEAD_STRS);
+    MACRO_ARGS = malloc(MAX_LOOKAHEAD * sizeof(macro_token_t));
     FUNCS = malloc(MAX_FUNCS * sizeof(func_t));
-    FUNC_TRIES = malloc(MAX_FUNC_TRIES * sizeof(trie_t));
+    FUNCS_MAP = hashmap_create(HASHMAP_INIT_SIZE);
     TYPES = malloc(MAX_TYPES * sizeof(type_t));
+    TYPES_MAP = hashmap_create(HASHMAP_INIT_SIZE);
+    TAGS_MAP = hashmap_create(HASHMAP_INIT_SIZE);
     GLOBAL_IR = malloc(MAX_GLOBAL_IR * sizeof(ph1_ir_t));
     PH1_IR = malloc(MAX_IR_INSTR * sizeof(ph1_ir_t));
-    PH2_IR = malloc(MAX_IR_INSTR * sizeof(ph2_ir_t));
     LABEL_LUT = malloc(MAX_LABEL * sizeof(label_lut_t));
+    LABELS_MAP = hashmap_create(HASHMAP_INIT_SIZE);
     SOURCE = malloc(MAX_SOURCE);
+    INCLUDES = malloc(MAX_INCLUDES * sizeof(include_t));
+    INCLUDES_MAP = hashmap_create(HASHMAP_INIT_SIZE);
     ALIASES = malloc(MAX_ALIASES * sizeof(alias_t));
+    ALIASES_MAP = hashmap_create(HASHMAP_INIT_SIZE);
     CONSTANTS = malloc(MAX_CONSTANTS * sizeof(constant_t));
+    CONSTANTS_MAP = hashmap_create(HASHMAP_INIT_SIZE);
 
     elf_code = malloc(MAX_CODE);
     elf_data = malloc(MAX_DATA);
@@ -596,20 +699,137 @@ void global_init()
     FUNCS[0].stack_size = 4;
 }
 
+/* Zero 'size' bytes from 'mem' */
+void clear_mem(void *mem, int size)
+{
+    char *bytes = mem;
+    for (int i = 0; i < size; i++)
+        bytes[i] = 0;
+}
+
+/* Bring the global objects back to their state after global_init(), so that
+ * another program can be compiled by the same process. Only the entries of
+ * the tables which have been used are cleared. The content of SOURCE is kept,
+ * the caller decides how much of it is reused.
+ */
+void global_reset()
+{
+    for (fn_t *fn = FUNC_LIST.head; fn;) {
+        fn_t *next = fn->next;
+        free(fn);
+        fn = next;
+    }
+    FUNC_LIST.head = NULL;
+    FUNC_LIST.tail = NULL;
+    clear_mem(&GLOBAL_FUNC, sizeof(func_t));
+
+    /* the chunks of variables in use are cleared, and kept for the next
+     * program
+     */
+    for (int i = 0; i < blocks_idx; i++) {
+        block_t *blk = &BLOCKS[i];
+        for (int j = 0; j < blk->next_local; j += LOCALS_CHUNK)
+            clear_mem(blk->locals[j / LOCALS_CHUNK],
+                      LOCALS_CHUNK * sizeof(var_t));
+        blk->next_local = 0;
+        blk->parent = NULL;
+        blk->func = NULL;
+        blk->locals_size = 0;
+        blk->index = 0;
+    }
+    blocks_idx = 0;
+    clear_mem(MACROS, macros_idx * sizeof(macro_t));
+    macros_idx = 0;
+    hashmap_free(MACROS_MAP);
+    MACROS_MAP = hashmap_create(HASHMAP_INIT_SIZE);
+    macro_tokens_idx = 0;
+    macro_strs_idx = 0;
+    lookahead_idx = 0;
+    lookahead_strs_idx = 0;
+
+    clear_mem(FUNCS, funcs_idx * sizeof(func_t));
+    funcs_idx = 1;
+    hashmap_free(FUNCS_MAP);
+    FUNCS_MAP = hashmap_create(HASHMAP_INIT_SIZE);
+    for (int i = 0; i < types_idx; i++) {
+        if (TYPES[i].members)
+            hashmap_free(TYPES[i].members);
+    }
+    clear_mem(TYPES, types_idx * sizeof(type_t));
+    types_idx = 0;
+    hashmap_free(TYPES_MAP);
+    TYPES_MAP = hashmap_create(HASHMAP_INIT_SIZE);
+    hashmap_free(TAGS_MAP);
+    TAGS_MAP = hashmap_create(HASHMAP_INIT_SIZE);
+
+    clear_mem(GLOBAL_IR, global_ir_idx * sizeof(ph1_ir_t));
+    global_ir_idx = 0;
+    clear_mem(PH1_IR, ph1_ir_idx * sizeof(ph1_ir_t));
+    ph1_ir_idx = 0;
+    clear_mem(LABEL_LUT, label_lut_idx * sizeof(label_lut_t));
+    label_lut_idx = 0;
+    hashmap_free(LABELS_MAP);
+    LABELS_MAP = hashmap_create(HASHMAP_INIT_SIZE);
+
+    clear_mem(INCLUDES, includes_idx * sizeof(include_t));
+    includes_idx = 0;
+    hashmap_free(INCLUDES_MAP);
+    INCLUDES_MAP = hashmap_create(HASHMAP_INIT_SIZE);
+    clear_mem(ALIASES, aliases_idx * sizeof(alias_t));
+    aliases_idx = 0;
+    hashmap_free(ALIASES_MAP);
+    ALIASES_MAP = hashmap_create(HASHMAP_INIT_SIZE);
+    clear_mem(CONSTANTS, constants_idx * sizeof(constant_t));
+    constants_idx = 0;
+    hashmap_free(CONSTANTS_MAP);
+    CONSTANTS_MAP = hashmap_create(HASHMAP_INIT_SIZE);
+    source_idx = 0;
+
+    clear_mem(elf_code, elf_code_idx);
+    elf_code_idx = 0;
+    clear_mem(elf_data, elf_data_idx);
+    elf_data_idx = 0;
+    clear_mem(elf_header, elf_header_idx);
+    elf_header_idx = 0;
+
+    /* set starting point of global stack manually */
+    FUNCS[0].stack_size = 4;
+}
+
 void global_release()
 {
+    for (int i = 0; i < MAX_BLOCKS; i++) {
+        for (int j = 0; j < MAX_LOCAL_CHUNKS; j++)
+            free(BLOCKS[i].locals[j]);
+    }
     free(BLOCKS);
     free(MACROS);
+    hashmap_free(MACROS_MAP);
+    free(MACRO_TOKENS);
+    free(MACRO_STRS);
+    free(LOOKAHEAD);
+    free(LOOKAHEAD_STRS);
+    free(MACRO_ARGS);
     free(FUNCS);
-    free(FUNC_TRIES);
+    hashmap_free(FUNCS_MAP);
+    for (int i = 0; i < types_idx; i++) {
+        if (TYPES[i].members)
+            hashmap_free(TYPES[i].members);
+    }
     free(TYPES);
+    hashmap_free(TYPES_MAP);
+    hashmap_free(TAGS_MAP);
     free(GLOBAL_IR);
     free(PH1_IR);
-    free(PH2_IR);
     free(LABEL_LUT);
+    hashmap_free(LABELS_MAP);
     free(SOURCE);
+    free(INCLUDES);
+    hashmap_free(INCLUDES_MAP);
     free(ALIASES);
+    hashmap_free(ALIASES_MAP);
     free(CONSTANTS);
+    hashmap_free(CONSTANTS_MAP);
 
     free(elf_code);
     free(elf_data);
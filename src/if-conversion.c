@@ -0,0 +1,148 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* If-conversion merges the small branches of an 'if' statement or of a
+ * ternary operator into the block ending with their conditional branch. The
+ * branch becomes OP_predicate, and the instructions of the branches are
+ * marked with the one they belong to. Then ARM executes them conditionally,
+ * and RISC-V executes them all, storing what the branch taken stores.
+ *
+ * The registers do not carry any variable from a block to another, so the
+ * branches only communicate with the following block through memory.
+ */
+
+/* Whether the code generator can emit 'ph2_ir' in a merged branch */
+bool is_predicable(ph2_ir_t *ph2_ir);
+
+/* The last block of the branch of 'head' starting with 'bb', or NULL if it
+ * cannot be merged into 'head'. Its blocks follow each other in the layout,
+ * each one only reached from the previous one, and all their instructions
+ * are predicable but the jump ending the last one.
+ */
+basic_block_t *merged_branch_end(basic_block_t *bb, basic_block_t *head)
+{
+    basic_block_t *prev = head;
+    int n = 0;
+
+    for (;;) {
+        if (bb->then_ || bb->else_ || !bb->next)
+            return NULL;
+        for (int i = 0; i < MAX_BB_PRED; i++) {
+            if (!bb->prev[i].bb)
+                continue;
+            if (bb->prev[i].bb != prev)
+                return NULL;
+        }
+
+        for (ph2_ir_t *ph2_ir = bb->ph2_ir_list.head; ph2_ir;
+             ph2_ir = ph2_ir->next) {
+            if (ph2_ir->op == OP_jump && !ph2_ir->next)
+                continue;
+            if (!is_predicable(ph2_ir))
+                return NULL;
+            n++;
+        }
+        if (n > MAX_PREDICATED)
+            return NULL;
+
+        /* the branch goes on with the next block if only reached from it */
+        if (bb->next != bb->rpo_next)
+            return bb;
+        for (int i = 0; i < MAX_BB_PRED; i++) {
+            if (!bb->next->prev[i].bb)
+                continue;
+            if (bb->next->prev[i].bb != bb)
+                return bb;
+        }
+        prev = bb;
+        bb = bb->next;
+    }
+}
+
+/* Mark the instructions of the blocks from 'bb' to 'end' with 'pred', and
+ * remove the jump to the join, which follows the merged branches.
+ */
+void merge_branch(basic_block_t *bb,
+                  basic_block_t *end,
+                  bb_connection_type_t pred)
+{
+    for (;;) {
+        ph2_ir_t *last = NULL;
+        for (ph2_ir_t *ph2_ir = bb->ph2_ir_list.head; ph2_ir;
+             ph2_ir = ph2_ir->next) {
+            if (ph2_ir->op == OP_jump)
+                break;
+            ph2_ir->pred = pred;
+            last = ph2_ir;
+        }
+        if (last)
+            last->next = NULL;
+        else
+            bb->ph2_ir_list.head = NULL;
+        bb->ph2_ir_list.tail = last;
+
+        if (bb == end)
+            return;
+        bb = bb->next;
+    }
+}
+
+/* The branches must follow their head in the layout, either both of them
+ * (a diamond) or the only one which does not lead to the join (a triangle),
+ * immediately followed by the join.
+ */
+void fn_if_conversion(fn_t *fn)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        ph2_ir_t *branch = bb->ph2_ir_list.tail;
+        if (!branch)
+            continue;
+        if (branch->op != OP_branch)
+            continue;
+        if (bb->then_ == bb->else_)
+            continue;
+
+        /* the successor laid out first, then the other one */
+        basic_block_t *first = bb->rpo_next;
+        basic_block_t *other = bb->then_;
+        if (first == bb->then_)
+            other = bb->else_;
+        else if (first != bb->else_)
+            continue;
+
+        basic_block_t *end = merged_branch_end(first, bb);
+        if (!end)
+            continue;
+        if (end->rpo_next != other)
+            continue;
+
+        basic_block_t *other_end = NULL;
+        if (end->next != other) {
+            /* diamond */
+            other_end = merged_branch_end(other, bb);
+            if (!other_end)
+                continue;
+            if (other_end->next != end->next)
+                continue;
+            if (other_end->rpo_next != end->next)
+                continue;
+        }
+
+        branch->op = OP_predicate;
+        bb_connection_type_t pred = ELSE;
+        if (first == bb->then_)
+            pred = THEN;
+        merge_branch(first, end, pred);
+        if (!other_end)
+            continue;
+        if (pred == THEN)
+            pred = ELSE;
+        else
+            pred = THEN;
+        merge_branch(other, other_end, pred);
+    }
+}
@@ -0,0 +1,227 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* The code is laid out to keep the instructions running together close to
+ * each other. A function is encoded right after the first function calling
+ * it, and the paths ending the program, calling a function which does not
+ * return, like abort() or exit(), are moved out of the way: such blocks go
+ * after the other blocks of their function, and such functions after all
+ * the others, at the end of the code.
+ */
+
+/* Whether calling 'name' does not return */
+bool is_cold_func(char *name)
+{
+    func_t *func = find_func(name);
+
+    if (!func)
+        return false;
+    if (!func->fn)
+        return false;
+    return func->fn->is_cold;
+}
+
+bool bb_calls_cold(basic_block_t *bb)
+{
+    for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+        if (insn->opcode != OP_call)
+            continue;
+        if (is_cold_func(insn->str))
+            return true;
+    }
+    return false;
+}
+
+/* Find whether 'fn' does not return, the exit block being out of reach
+ * past the blocks calling a function which does not return either. A
+ * function looping forever without such calls is not taken for one. Sets
+ * 'is_cold' and returns whether it changed.
+ */
+bool fn_find_cold(fn_t *fn)
+{
+    char *name = fn->func->return_def.var_name;
+
+    if (fn->is_cold)
+        return false;
+    if (!strcmp(name, "abort") | !strcmp(name, "exit")) {
+        fn->is_cold = true;
+        return true;
+    }
+
+    fn->visited++;
+    fn->bbs->visited = fn->visited;
+    bool stopped = false;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+            if (bb->visited != fn->visited)
+                continue;
+            if (bb_calls_cold(bb)) {
+                stopped = true;
+                continue;
+            }
+            for (int i = 0; i < 3; i++) {
+                basic_block_t *succ = bb->next;
+                if (i == 1)
+                    succ = bb->then_;
+                if (i == 2)
+                    succ = bb->else_;
+                if (!succ)
+                    continue;
+                if (succ->visited == fn->visited)
+                    continue;
+                succ->visited = fn->visited;
+                changed = true;
+            }
+        }
+    }
+    if (stopped)
+        fn->is_cold = fn->exit->visited != fn->visited;
+
+    /* the traversals of the CFG expect its blocks all left as visited */
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next)
+        bb->visited = fn->visited;
+    fn->exit->visited = fn->visited;
+    return fn->is_cold;
+}
+
+/* Find the functions of the program which do not return, until the ones
+ * calling them are all found too
+ */
+void find_cold_fns()
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
+            if (fn_find_cold(fn))
+                changed = true;
+        }
+    }
+}
+
+/* Whether 'bb' calls a function which does not return */
+bool bb_is_cold(basic_block_t *bb)
+{
+    for (ph2_ir_t *ph2_ir = bb->ph2_ir_list.head; ph2_ir;
+         ph2_ir = ph2_ir->next) {
+        if ((ph2_ir->op != OP_call) & (ph2_ir->op != OP_tail_call))
+            continue;
+        if (is_cold_func(ph2_ir->func_name))
+            return true;
+    }
+    return false;
+}
+
+/* Whether 'bb' goes on to the block laid out after it */
+bool falls_through(basic_block_t *bb)
+{
+    ph2_ir_t *tail = bb->ph2_ir_list.tail;
+
+    if (!bb->next)
+        return false;
+    if (!tail)
+        return true;
+    switch (tail->op) {
+    case OP_jump:
+    case OP_branch:
+    case OP_return:
+    case OP_tail_call:
+        return false;
+    default:
+        return true;
+    }
+}
+
+void add_jump(basic_block_t *bb, basic_block_t *to)
+{
+    ph2_ir_t *jump = bb_add_ph2_ir(bb, OP_jump);
+    jump->next_bb = to;
+}
+
+/* Whether 'bb' is only reached from the blocks laid out from 'first' to
+ * 'last'
+ */
+bool only_reached_from(basic_block_t *bb,
+                       basic_block_t *first,
+                       basic_block_t *last)
+{
+    bool reached = false;
+
+    for (int i = 0; i < MAX_BB_PRED; i++) {
+        basic_block_t *pred = bb->prev[i].bb;
+        if (!pred)
+            continue;
+
+        basic_block_t *run = first;
+        while (run != pred) {
+            if (run == last)
+                return false;
+            run = run->rpo_next;
+        }
+        reached = true;
+    }
+    return reached;
+}
+
+/* Move the runs of blocks calling a function which does not return after
+ * the other blocks of 'fn', in their order, the block before each run
+ * jumping to it if it went on to it. A run takes along the blocks reached
+ * only from it, such as the jump out of a 'default' label calling abort().
+ */
+void fn_cold_split(fn_t *fn)
+{
+    basic_block_t *prev = fn->bbs;
+    basic_block_t *cold = NULL;
+    basic_block_t *cold_tail = NULL;
+
+    while (prev->rpo_next) {
+        basic_block_t *first = prev->rpo_next;
+        if (!bb_is_cold(first)) {
+            prev = first;
+            continue;
+        }
+
+        basic_block_t *last = first;
+        while (last->rpo_next) {
+            basic_block_t *bb = last->rpo_next;
+            if (!bb_is_cold(bb))
+                if (!only_reached_from(bb, first, last))
+                    break;
+            last = bb;
+        }
+        basic_block_t *next = last->rpo_next;
+
+        /* already at the end */
+        if (!next)
+            break;
+
+        /* the blocks calling such a function do not go on past the call,
+         * but the ones taken along may
+         */
+        if (falls_through(prev))
+            add_jump(prev, first);
+        if (!bb_is_cold(last))
+            if (falls_through(last))
+                add_jump(last, last->next);
+
+        prev->rpo_next = next;
+        last->rpo_next = NULL;
+        if (cold)
+            cold_tail->rpo_next = first;
+        else
+            cold = first;
+        cold_tail = last;
+    }
+
+    if (cold) {
+        while (prev->rpo_next)
+            prev = prev->rpo_next;
+        prev->rpo_next = cold;
+    }
+}
@@ -77,7 +77,9 @@ typedef enum {
     T_cppd_elif,
     T_cppd_else,
     T_cppd_endif,
-    T_cppd_ifdef
+    T_cppd_ifdef,
+    T_cppd_ifndef,
+    T_cppd_pragma
 } token_t;
 
 char token_str[MAX_TOKEN_LEN];
@@ -87,11 +89,6 @@ bool skip_newline = true;
 
 bool preproc_match;
 
-/* Point to the first character after where the macro has been called. It is
- * needed when returning from the macro body.
- */
-int macro_return_idx;
-
 bool is_whitespace(char c)
 {
     return c == ' ' || c == '\t';
@@ -175,13 +172,295 @@ char peek_char(int offset)
     return SOURCE[source_idx + offset];
 }
 
+/* Identify a preprocessor directive, including its leading '#', by its length
+ * and leading letters so that at most one string comparison is made. Return
+ * T_start if it is not a known directive.
+ */
+token_t lex_directive(char *str, int len)
+{
+    switch (len) {
+    case 3:
+        if (!strcmp(str, "#if"))
+            return T_cppd_if;
+        break;
+    case 5:
+        if (str[1] == 'e') {
+            if (str[2] == 'l' && !strcmp(str, "#elif"))
+                return T_cppd_elif;
+            if (!strcmp(str, "#else"))
+                return T_cppd_else;
+        }
+        break;
+    case 6:
+        if (str[1] == 'u' && !strcmp(str, "#undef"))
+            return T_cppd_undef;
+        if (str[1] == 'e') {
+            if (str[2] == 'r' && !strcmp(str, "#error"))
+                return T_cppd_error;
+            if (!strcmp(str, "#endif"))
+                return T_cppd_endif;
+        }
+        if (str[1] == 'i' && !strcmp(str, "#ifdef"))
+            return T_cppd_ifdef;
+        break;
+    case 7:
+        if (str[1] == 'd' && !strcmp(str, "#define"))
+            return T_cppd_define;
+        if (str[1] == 'i' && !strcmp(str, "#ifndef"))
+            return T_cppd_ifndef;
+        if (!strcmp(str, "#pragma"))
+            return T_cppd_pragma;
+        break;
+    case 8:
+        if (!strcmp(str, "#include"))
+            return T_cppd_include;
+        break;
+    }
+    return T_start;
+}
+
+/* Identify a keyword by its length and leading letters so that at most one
+ * string comparison is made. Return T_identifier if it is not a keyword. This
+ * runs for every identifier, which is the most frequent kind of token.
+ */
+token_t lex_keyword(char *str, int len)
+{
+    switch (len) {
+    case 2:
+        if (str[0] == 'i' && str[1] == 'f')
+            return T_if;
+        if (str[0] == 'd' && str[1] == 'o')
+            return T_do;
+        break;
+    case 3:
+        if (!strcmp(str, "for"))
+            return T_for;
+        break;
+    case 4:
+        if (str[0] == 'e') {
+            if (str[1] == 'l' && !strcmp(str, "else"))
+                return T_else;
+            if (!strcmp(str, "enum"))
+                return T_enum;
+        }
+        if (str[0] == 'c' && !strcmp(str, "case"))
+            return T_case;
+        break;
+    case 5:
+        if (str[0] == 'w' && !strcmp(str, "while"))
+            return T_while;
+        if (str[0] == 'b' && !strcmp(str, "break"))
+            return T_break;
+        break;
+    case 6:
+        if (str[0] == 'r' && !strcmp(str, "return"))
+            return T_return;
+        if (str[0] == 's') {
+            if (str[1] == 't' && !strcmp(str, "struct"))
+                return T_struct;
+            if (str[1] == 'i' && !strcmp(str, "sizeof"))
+                return T_sizeof;
+            if (!strcmp(str, "switch"))
+                return T_switch;
+        }
+        break;
+    case 7:
+        if (str[0] == 't' && !strcmp(str, "typedef"))
+            return T_typedef;
+        if (str[0] == 'd' && !strcmp(str, "default"))
+            return T_default;
+        break;
+    case 8:
+        if (!strcmp(str, "continue"))
+            return T_continue;
+        break;
+    }
+    return T_identifier;
+}
+
+/* Copy 'token_str' into the string pool 'pool' of 'size' bytes, at the offset
+ * pointed by 'idx', and return the copy.
+ */
+char *lex_save_token_str(char *pool, int *idx, int size)
+{
+    int len = strlen(token_str) + 1;
+    char *str;
+
+    if (idx[0] + len > size)
+        error("Too many macro tokens");
+    str = &pool[idx[0]];
+    strcpy(str, token_str);
+    idx[0] += len;
+    return str;
+}
+
+/* Push a token onto the lookahead buffer, so that it is read next. */
+void lex_push_token(int kind, char *literal, bool expand)
+{
+    macro_token_t *tk;
+
+    if (lookahead_idx >= MAX_LOOKAHEAD)
+        error("Macro expansion is too large");
+    tk = &LOOKAHEAD[lookahead_idx++];
+    tk->kind = kind;
+    tk->literal = literal;
+    tk->expand = expand;
+}
+
+token_t lex_token_internal(bool aliasing);
+
+/**
+ * lex_expand_macro() - expand an invocation of a function-like macro
+ * @macro: the macro, whose name has just been lexed.
+ *
+ * Read the arguments of the invocation and push the pre-lexed body of @macro
+ * onto the lookahead buffer, with every parameter replaced by the tokens of
+ * its argument. The expansion is rescanned as it is read, which expands the
+ * nested macros. A macro name found in its own body is left as is.
+ */
+void lex_expand_macro(macro_t *macro)
+{
+    int arg_start[MAX_PARAMS];
+    int num_args = 0, args_idx = 0, depth = 0;
+    int end = macro->start_token + macro->num_tokens;
+    token_t token;
+
+    lex_token_internal(false); /* ( */
+    token = lex_token_internal(false);
+    if (token != T_close_bracket)
+        arg_start[num_args++] = 0;
+
+    /* The arguments are split at the top-level commas. With a variadic macro,
+     * the remaining ones are kept together as the last argument.
+     */
+    while (token != T_close_bracket || depth) {
+        if (token == T_eof)
+            error("Unterminated macro invocation");
+        if (token == T_comma && !depth &&
+            (num_args <= macro->num_param_defs || !macro->is_variadic)) {
+            if (num_args >= macro->num_param_defs + macro->is_variadic ||
+                num_args >= MAX_PARAMS)
+                error("Too many macro arguments");
+            arg_start[num_args++] = args_idx;
+        } else {
+            if (token == T_open_bracket)
+                depth++;
+            else if (token == T_close_bracket)
+                depth--;
+            if (args_idx >= MAX_LOOKAHEAD)
+                error("Macro expansion is too large");
+            MACRO_ARGS[args_idx].kind = token;
+            MACRO_ARGS[args_idx].literal = lex_save_token_str(
+                LOOKAHEAD_STRS, &lookahead_strs_idx, MAX_LOOKAHEAD_STRS);
+            args_idx++;
+        }
+        token = lex_token_internal(false);
+    }
+    if (num_args > macro->num_param_defs + macro->is_variadic)
+        error("Too many macro arguments");
+
+    for (int i = end - 1; i >= macro->start_token; i--) {
+        macro_token_t *tk = &MACRO_TOKENS[i];
+        int param = -1;
+
+        if (tk->kind == T_identifier) {
+            for (int j = 0; j < macro->num_param_defs; j++) {
+                if (!strcmp(tk->literal, macro->param_defs[j].var_name))
+                    param = j;
+            }
+            if (!strcmp(tk->literal, "__VA_ARGS__")) {
+                if (!macro->is_variadic)
+                    error("Unexpected identifier '__VA_ARGS__'");
+                param = macro->num_param_defs;
+            }
+        }
+
+        if (param < 0) {
+            lex_push_token(tk->kind, tk->literal,
+                           strcmp(tk->literal, macro->name) != 0);
+        } else if (param < num_args) {
+            int arg_end = args_idx;
+
+            if (param + 1 < num_args)
+                arg_end = arg_start[param + 1];
+            for (int j = arg_end - 1; j >= arg_start[param]; j--)
+                lex_push_token(MACRO_ARGS[j].kind, MACRO_ARGS[j].literal,
+                               true);
+        }
+    }
+}
+
+/* Substitute the identifier in 'token_str' if it is an alias, or if it names
+ * a function-like macro and an argument list follows.
+ */
+token_t lex_identifier(bool aliasing)
+{
+    char *alias;
+    macro_t *macro;
+
+    if (!aliasing)
+        return T_identifier;
+
+    alias = find_alias(token_str);
+    if (alias) {
+        /* an alias defined without a value vanishes */
+        if (!alias[0])
+            return lex_token_internal(aliasing);
+
+        /* FIXME: comparison with string "bool" is a temporary hack */
+        token_t t;
+
+        if (is_numeric(alias)) {
+            t = T_numeric;
+        } else if (!strcmp(alias, "_Bool")) {
+            t = T_identifier;
+        } else {
+            t = T_string;
+        }
+
+        strcpy(token_str, alias);
+        return t;
+    }
+
+    macro = find_macro(token_str);
+    if (!macro)
+        return T_identifier;
+    if (lookahead_idx) {
+        if (LOOKAHEAD[lookahead_idx - 1].kind != T_open_bracket)
+            return T_identifier;
+    } else {
+        if (next_char != '(')
+            return T_identifier;
+        /* nothing refers to the argument literals of earlier expansions */
+        lookahead_strs_idx = 0;
+    }
+
+    lex_expand_macro(macro);
+    return lex_token_internal(aliasing);
+}
+
 /* Lex next token and returns its token type. Parameter 'aliasing' is used for
  * disable preprocessor aliasing on identifier tokens.
  */
 token_t lex_token_internal(bool aliasing)
 {
+    token_t token;
     token_str[0] = 0;
 
+    /* tokens of macro expansions come first */
+    if (lookahead_idx) {
+        macro_token_t *tk = &LOOKAHEAD[lookahead_idx - 1];
+
+        lookahead_idx--;
+        strcpy(token_str, tk->literal);
+        token = tk->kind;
+        if (token != T_identifier)
+            return token;
+        if (!tk->expand)
+            return T_identifier;
+        return lex_identifier(aliasing);
+    }
+
     /* partial preprocessor */
     if (next_char == '#') {
         int i = 0;
@@ -192,24 +471,9 @@ token_t lex_token_internal(bool aliasing)
         token_str[i] = 0;
         skip_whitespace();
 
-        if (!strcmp(token_str, "#include"))
-            return T_cppd_include;
-        if (!strcmp(token_str, "#define"))
-            return T_cppd_define;
-        if (!strcmp(token_str, "#undef"))
-            return T_cppd_undef;
-        if (!strcmp(token_str, "#error"))
-            return T_cppd_error;
-        if (!strcmp(token_str, "#if"))
-            return T_cppd_if;
-        if (!strcmp(token_str, "#elif"))
-            return T_cppd_elif;
-        if (!strcmp(token_str, "#ifdef"))
-            return T_cppd_ifdef;
-        if (!strcmp(token_str, "#else"))
-            return T_cppd_else;
-        if (!strcmp(token_str, "#endif"))
-            return T_cppd_endif;
+        token = lex_directive(token_str, i);
+        if (token != T_start)
+            return token;
         error("Unknown directive");
     }
 
@@ -477,7 +741,6 @@ token_t lex_token_internal(bool aliasing)
     }
 
     if (is_alnum(next_char)) {
-        char *alias;
         int i = 0;
         do {
             token_str[i++] = next_char;
@@ -485,68 +748,17 @@ token_t lex_token_internal(bool aliasing)
         token_str[i] = 0;
         skip_whitespace();
 
-        if (!strcmp(token_str, "if"))
-            return T_if;
-        if (!strcmp(token_str, "while"))
-            return T_while;
-        if (!strcmp(token_str, "for"))
-            return T_for;
-        if (!strcmp(token_str, "do"))
-            return T_do;
-        if (!strcmp(token_str, "else"))
-            return T_else;
-        if (!strcmp(token_str, "return"))
-            return T_return;
-        if (!strcmp(token_str, "typedef"))
-            return T_typedef;
-        if (!strcmp(token_str, "enum"))
-            return T_enum;
-        if (!strcmp(token_str, "struct"))
-            return T_struct;
-        if (!strcmp(token_str, "sizeof"))
-            return T_sizeof;
-        if (!strcmp(token_str, "switch"))
-            return T_switch;
-        if (!strcmp(token_str, "case"))
-            return T_case;
-        if (!strcmp(token_str, "break"))
-            return T_break;
-        if (!strcmp(token_str, "default"))
-            return T_default;
-        if (!strcmp(token_str, "continue"))
-            return T_continue;
-
-        if (aliasing) {
-            alias = find_alias(token_str);
-            if (alias) {
-                /* FIXME: comparison with string "bool" is a temporary hack */
-                token_t t;
-
-                if (is_numeric(alias)) {
-                    t = T_numeric;
-                } else if (!strcmp(alias, "_Bool")) {
-                    t = T_identifier;
-                } else {
-                    t = T_string;
-                }
-
-                strcpy(token_str, alias);
-                return t;
-            }
-        }
-
-        return T_identifier;
+        token = lex_keyword(token_str, i);
+        if (token != T_identifier)
+            return token;
+        return lex_identifier(aliasing);
     }
 
-    /* This only happens when parsing a macro. Move to the token after the
-     * macro definition or return to where the macro has been called.
+    /* This only happens when lexing a preprocessor directive, which ends at the
+     * newline. Move on to the next line.
      */
     if (next_char == '\n') {
-        if (macro_return_idx) {
-            source_idx = macro_return_idx;
-            next_char = SOURCE[source_idx];
-        } else
-            next_char = read_char(true);
+        next_char = read_char(true);
         return lex_token_internal(aliasing);
     }
 
@@ -567,11 +779,24 @@ token_t lex_token()
     return lex_token_internal(true);
 }
 
-/* Skip the content. We only need the index where the macro body begins. */
-void skip_macro_body()
+/* Lex the body of a function-like macro, up to the end of the line, into
+ * MACRO_TOKENS so that its invocations do not have to lex it again.
+ */
+void lex_macro_body(macro_t *macro)
 {
-    while (!is_newline(next_char))
-        next_token = lex_token();
+    macro->start_token = macro_tokens_idx;
+    while (!is_newline(next_char) && next_char != 0) {
+        macro_token_t *tk;
+
+        if (macro_tokens_idx >= MAX_MACRO_TOKENS)
+            error("Too many macro tokens");
+        tk = &MACRO_TOKENS[macro_tokens_idx++];
+        tk->kind = lex_token_internal(false);
+        tk->literal =
+            lex_save_token_str(MACRO_STRS, &macro_strs_idx, MAX_MACRO_STRS);
+        tk->expand = true;
+    }
+    macro->num_tokens = macro_tokens_idx - macro->start_token;
 
     skip_newline = true;
     next_token = lex_token();
@@ -0,0 +1,311 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* Loop unrolling copies the body of a small counted loop several times in a
+ * row, so that the comparison and the branch of the loop are paid once for
+ * several iterations. A loop is counted when its header only compares a
+ * variable, stepped by a constant in the loop, with a bound the loop does
+ * not change:
+ *
+ *   for (i = start; i < bound; i += step)
+ *
+ * The unrolled loop is placed before the original one, and runs while the
+ * 'factor' next iterations are all due:
+ *
+ *   while (i + (factor - 1) * step < bound) { body; body; ... }
+ *
+ * unless the sum wraps around, then the original loop runs the remaining
+ * ones. The bound is known at run time only, or is a constant like the
+ * start, in which case a loop too short for a single unrolled iteration is
+ * left as is.
+ *
+ * The body must be straight-line code, so that its copies follow each other
+ * in a single block. Each copy defines its own variables, and reads the
+ * values the previous one leaves to the phi functions of the header, which
+ * are stored after the last copy only.
+ */
+
+/* Whether the comparison 'op' of a counted loop holds for 'l' and 'r' */
+bool loop_cmp_holds(opcode_t op, int l, int r)
+{
+    if (op == OP_lt)
+        return l < r;
+    if (op == OP_leq)
+        return l <= r;
+    if (op == OP_gt)
+        return l > r;
+    return l >= r;
+}
+
+/* Whether the body of 'loop' is straight-line code small enough to be
+ * copied twice at least. Set the factor of 'loop'.
+ */
+bool loop_body_unrollable(loop_t *loop)
+{
+    basic_block_t *header = loop->header;
+    basic_block_t *prev = header;
+    int n = 0;
+
+    for (basic_block_t *bb = header->then_;; bb = bb->next) {
+        if (!bb)
+            return false;
+        if (bb == header)
+            return false;
+        if (bb->then_ || !bb->next)
+            return false;
+        for (int i = 0; i < MAX_BB_PRED; i++) {
+            if (!bb->prev[i].bb)
+                continue;
+            if (bb->prev[i].bb != prev)
+                return false;
+        }
+
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (insn->opcode == OP_unwound_phi)
+                continue;
+            /* only the declarations the register allocation ignores */
+            if (insn->opcode == OP_allocat) {
+                if (insn->rd->array_size)
+                    return false;
+                if (strcmp(insn->rd->type_name, "int") &&
+                    strcmp(insn->rd->type_name, "char") &&
+                    strcmp(insn->rd->type_name, "_Bool"))
+                    return false;
+            }
+            n++;
+        }
+        if (n > MAX_UNROLLED / 2)
+            return false;
+
+        if (bb->next == header) {
+            if (bb != loop->latch)
+                return false;
+            break;
+        }
+        prev = bb;
+    }
+
+    loop->factor = unroll_factor;
+    while (loop->factor * n > MAX_UNROLLED)
+        loop->factor--;
+    return loop->factor >= 2;
+}
+
+/* Whether 'header' starts a counted loop worth unrolling, described then by
+ * 'loop'.
+ */
+bool find_counted_loop(fn_t *fn, basic_block_t *header, loop_t *loop)
+{
+    insn_t *br = header->insn_list.tail;
+    if (!br)
+        return false;
+    if (br->opcode != OP_branch)
+        return false;
+    insn_t *cmp = br->prev;
+    if (!cmp)
+        return false;
+    if (cmp->rd != br->rs1)
+        return false;
+    if ((cmp->opcode != OP_lt) & (cmp->opcode != OP_leq) &
+        (cmp->opcode != OP_gt) & (cmp->opcode != OP_geq))
+        return false;
+    /* the header may load the constant bound, which the unrolled loop
+     * loads again
+     */
+    for (insn_t *insn = header->insn_list.head; insn != cmp;
+         insn = insn->next) {
+        if (insn->opcode != OP_load_constant)
+            return false;
+    }
+
+    if (!find_loop(fn, header, loop))
+        return false;
+    loop->cmp = cmp;
+    if (!loop_body_unrollable(loop))
+        return false;
+
+    /* the induction variable, stepped by a constant towards the bound */
+    var_t *iv = cmp->rs1, *bound = cmp->rs2;
+    int phi = loop_phi(loop, iv);
+    if (phi < 0)
+        return false;
+    loop->step = iv_step(fn, loop, phi);
+    if ((cmp->opcode == OP_lt) | (cmp->opcode == OP_leq)) {
+        if (loop->step <= 0)
+            return false;
+    } else if (loop->step >= 0)
+        return false;
+
+    if (!bound->is_const) {
+        if (loop_var_def(fn, bound))
+            return false;
+    }
+    if (bound->is_global)
+        return false;
+    if (var_address_taken(fn, iv))
+        return false;
+    if (var_address_taken(fn, bound))
+        return false;
+
+    /* a loop whose constant trip count is below the factor is left as is */
+    if (!bound->is_const)
+        return true;
+    var_t *start = loop_entry_value(loop, iv);
+    if (!start)
+        return false;
+    if (!start->is_const)
+        return true;
+    int last = start->init_val + (loop->factor - 1) * loop->step;
+    if ((last > start->init_val) != (loop->step > 0))
+        return false;
+    return loop_cmp_holds(cmp->opcode, last, bound->init_val);
+}
+
+/* Append a copy of 'insn' to 'bb' */
+insn_t *copy_insn(basic_block_t *bb, insn_t *insn)
+{
+    insn_t *n = calloc(1, sizeof(insn_t));
+    memcpy(n, insn, sizeof(insn_t));
+    n->next = NULL;
+    n->prev = bb->insn_list.tail;
+    if (!bb->insn_list.head)
+        bb->insn_list.head = n;
+    else
+        bb->insn_list.tail->next = n;
+    bb->insn_list.tail = n;
+    return n;
+}
+
+/* The variable 'var' stands for in the copy being made of the body */
+var_t *unrolled_var(var_t *from[], var_t *to[], int n, var_t *var)
+{
+    for (int i = 0; i < n; i++) {
+        if (from[i] == var)
+            return to[i];
+    }
+    return var;
+}
+
+void unroll_loop(fn_t *fn, loop_t *loop)
+{
+    basic_block_t *header = loop->header;
+    block_t *scope = header->scope;
+    basic_block_t *guard = bb_create(scope);
+    basic_block_t *body = bb_create(scope);
+    insn_t *cmp = loop->cmp;
+
+    /* i + (factor - 1) * step < bound, where the sum must not wrap around
+     * past the bound
+     */
+    for (insn_t *insn = header->insn_list.head; insn != cmp;
+         insn = insn->next)
+        copy_insn(guard, insn);
+    var_t *ofs = copy_var(scope, cmp->rs1);
+    var_t *last = copy_var(scope, cmp->rs1);
+    var_t *in_range = copy_var(scope, cmp->rd);
+    var_t *due = copy_var(scope, cmp->rd);
+    var_t *cond = copy_var(scope, cmp->rd);
+    ofs->is_const = true;
+    ofs->init_val = (loop->factor - 1) * loop->step;
+    add_insn(scope, guard, OP_load_constant, ofs, NULL, NULL, 0, NULL);
+    add_insn(scope, guard, OP_add, last, cmp->rs1, ofs, 0, NULL);
+    add_insn(scope, guard, loop->step > 0 ? OP_gt : OP_lt, in_range, last,
+             cmp->rs1, 0, NULL);
+    add_insn(scope, guard, cmp->opcode, due, last, cmp->rs2, 0, NULL);
+    add_insn(scope, guard, OP_bit_and, cond, in_range, due, 0, NULL);
+    add_insn(scope, guard, OP_branch, NULL, cond, NULL, 0, NULL);
+
+    /* The variables of the phi functions come first in the map from the
+     * variables of the body to those of the copy, then those the body
+     * defines.
+     */
+    var_t *from[MAX_UNROLLED];
+    var_t *to[MAX_UNROLLED];
+    var_t *vals[MAX_UNROLLED];
+    int n = loop->phis;
+    for (int i = 0; i < loop->phis; i++) {
+        from[i] = loop->phi_dest[i];
+        to[i] = loop->phi_dest[i];
+    }
+
+    for (int copy = 0; copy < loop->factor; copy++) {
+        if (copy) {
+            for (int i = 0; i < loop->phis; i++)
+                vals[i] = unrolled_var(from, to, n, loop->phi_src[i]);
+            for (int i = 0; i < loop->phis; i++)
+                to[i] = vals[i];
+        }
+
+        for (basic_block_t *bb = header->then_;; bb = bb->next) {
+            for (insn_t *insn = bb->insn_list.head; insn;
+                 insn = insn->next) {
+                if (insn->opcode == OP_unwound_phi)
+                    continue;
+
+                insn_t *c = copy_insn(body, insn);
+                if (c->rs1)
+                    c->rs1 = unrolled_var(from, to, n, c->rs1);
+                if (c->rs2)
+                    c->rs2 = unrolled_var(from, to, n, c->rs2);
+
+                /* the global variables are not in SSA form */
+                if (!c->rd)
+                    continue;
+                if (c->rd->is_global)
+                    continue;
+                if (c->opcode == OP_allocat)
+                    continue;
+                if (!copy) {
+                    from[n] = c->rd;
+                    to[n++] = c->rd;
+                    continue;
+                }
+                var_t *v = copy_var(scope, c->rd);
+                for (int i = loop->phis; i < n; i++) {
+                    if (from[i] == insn->rd)
+                        to[i] = v;
+                }
+                c->rd = v;
+            }
+            if (bb == loop->latch)
+                break;
+        }
+    }
+
+    for (int i = 0; i < loop->phis; i++)
+        add_insn(scope, body, OP_unwound_phi, loop->phi_dest[i],
+                 unrolled_var(from, to, n, loop->phi_src[i]), NULL, 0, NULL);
+
+    bb_disconnect(loop->pre, header);
+    bb_connect(loop->pre, guard, NEXT);
+    bb_connect(guard, body, THEN);
+    bb_connect(guard, header, ELSE);
+    bb_connect(body, guard, NEXT);
+    guard->idom = loop->pre;
+    body->idom = guard;
+    header->idom = guard;
+
+    /* the unrolled loop is laid out right before the original one */
+    basic_block_t *bb = fn->bbs;
+    while (bb->rpo_next != header)
+        bb = bb->rpo_next;
+    bb->rpo_next = guard;
+    guard->rpo_next = body;
+    body->rpo_next = header;
+    int rpo = fn->bbs->rpo;
+    for (bb = fn->bbs; bb; bb = bb->rpo_next)
+        bb->rpo = rpo++;
+}
+
+void fn_loop_unroll(fn_t *fn)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        loop_t loop;
+        if (find_counted_loop(fn, bb, &loop))
+            unroll_loop(fn, &loop);
+    }
+}
@@ -0,0 +1,225 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* The loops the loop passes work on are entered from a single block, and
+ * reached back from a single latch. Once the phi functions are unwound, the
+ * latch ends with the copies of the values the phi functions of the header
+ * take for the next iteration. An induction variable is one of them, whose
+ * next value is its own plus a constant.
+ */
+
+/* Index of the phi function of the header of 'loop' defining 'var', or -1 */
+int loop_phi(loop_t *loop, var_t *var)
+{
+    for (int i = 0; i < loop->phis; i++) {
+        if (loop->phi_dest[i] == var)
+            return i;
+    }
+    return -1;
+}
+
+/* The value the phi function of the header of 'loop' defining 'var' takes
+ * on entry to the loop, or NULL
+ */
+var_t *loop_entry_value(loop_t *loop, var_t *var)
+{
+    for (insn_t *insn = loop->pre->insn_list.head; insn; insn = insn->next) {
+        if (insn->opcode != OP_unwound_phi)
+            continue;
+        if (insn->rd == var)
+            return insn->rs1;
+    }
+    return NULL;
+}
+
+/* Mark the blocks of the loop reaching 'bb' back to its header, which has
+ * been marked first.
+ */
+void mark_loop(fn_t *fn, basic_block_t *bb)
+{
+    bb->loop = fn->loops;
+    for (int i = 0; i < MAX_BB_PRED; i++) {
+        basic_block_t *pred = bb->prev[i].bb;
+        if (!pred)
+            continue;
+        if (pred->loop != fn->loops)
+            mark_loop(fn, pred);
+    }
+}
+
+/* Whether 'header' starts a loop, described then by 'loop'. Its blocks are
+ * numbered 'fn->loops'.
+ */
+bool find_loop(fn_t *fn, basic_block_t *header, loop_t *loop)
+{
+    loop->pre = NULL;
+    loop->latch = NULL;
+    for (int i = 0; i < MAX_BB_PRED; i++) {
+        basic_block_t *pred = header->prev[i].bb;
+        if (!pred)
+            continue;
+        if (pred->next != header)
+            return false;
+        if (pred->rpo < header->rpo) {
+            if (loop->pre)
+                return false;
+            loop->pre = pred;
+        } else {
+            if (loop->latch)
+                return false;
+            loop->latch = pred;
+        }
+    }
+    if (!loop->pre || !loop->latch)
+        return false;
+    loop->header = header;
+
+    /* nothing jumps into the middle of the loop */
+    for (basic_block_t *bb = loop->latch; bb != header; bb = bb->idom) {
+        if (bb->idom == bb)
+            return false;
+    }
+
+    loop->phis = 0;
+    for (insn_t *insn = loop->latch->insn_list.head; insn; insn = insn->next) {
+        if (insn->opcode != OP_unwound_phi)
+            continue;
+        if (loop->phis == MAX_LOOP_PHIS)
+            return false;
+        loop->phi_dest[loop->phis] = insn->rd;
+        loop->phi_src[loop->phis++] = insn->rs1;
+    }
+
+    fn->loops++;
+    header->loop = fn->loops;
+    if (loop->latch != header)
+        mark_loop(fn, loop->latch);
+    return true;
+}
+
+/* The instruction of the last loop found in 'fn' defining 'var', or NULL */
+insn_t *loop_var_def(fn_t *fn, var_t *var)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        if (bb->loop != fn->loops)
+            continue;
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (insn->rd == var)
+                return insn;
+        }
+    }
+    return NULL;
+}
+
+/* The step of the induction variable of the phi function 'phi' of 'loop',
+ * or 0 if it is not one.
+ */
+int iv_step(fn_t *fn, loop_t *loop, int phi)
+{
+    insn_t *def = loop_var_def(fn, loop->phi_src[phi]);
+    if (!def)
+        return 0;
+    if (def->opcode == OP_assign) {
+        def = loop_var_def(fn, def->rs1);
+        if (!def)
+            return 0;
+    }
+    if ((def->opcode != OP_add) & (def->opcode != OP_sub))
+        return 0;
+    if (def->rs1 != loop->phi_dest[phi])
+        return 0;
+    if (!def->rs2->is_const)
+        return 0;
+    if (def->rs2->is_global)
+        return 0;
+    if (def->opcode == OP_sub)
+        return 0 - def->rs2->init_val;
+    return def->rs2->init_val;
+}
+
+/* Whether 'fn' takes the address of 'var', which may then change through a
+ * pointer without the SSA form knowing it.
+ */
+bool var_address_taken(fn_t *fn, var_t *var)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (insn->opcode != OP_address_of)
+                continue;
+            if (insn->rs1->base == var->base)
+                return true;
+        }
+    }
+    return false;
+}
+
+/* A new variable like 'var', for the instructions a loop pass adds */
+var_t *copy_var(block_t *scope, var_t *var)
+{
+    var_t *v = require_var(scope);
+    memcpy(v, var, sizeof(var_t));
+    v->offset = 0;
+    v->consumed = -1;
+    v->ref_block_list.head = NULL;
+    v->ref_block_list.tail = NULL;
+    return v;
+}
+
+/* Insert a new instruction in 'bb' after 'prev', or first if it is NULL */
+insn_t *insert_insn(basic_block_t *bb,
+                    insn_t *prev,
+                    opcode_t op,
+                    var_t *rd,
+                    var_t *rs1,
+                    var_t *rs2)
+{
+    insn_t *n = calloc(1, sizeof(insn_t));
+    n->opcode = op;
+    n->rd = rd;
+    n->rs1 = rs1;
+    n->rs2 = rs2;
+    n->prev = prev;
+    if (prev) {
+        n->next = prev->next;
+        prev->next = n;
+    } else {
+        n->next = bb->insn_list.head;
+        bb->insn_list.head = n;
+    }
+    if (n->next)
+        n->next->prev = n;
+    else
+        bb->insn_list.tail = n;
+    return n;
+}
+
+void remove_insn(basic_block_t *bb, insn_t *insn)
+{
+    if (insn->prev)
+        insn->prev->next = insn->next;
+    else
+        bb->insn_list.head = insn->next;
+    if (insn->next)
+        insn->next->prev = insn->prev;
+    else
+        bb->insn_list.tail = insn->prev;
+}
+
+/* Number of the instructions of 'fn' reading 'var' */
+int var_uses(fn_t *fn, var_t *var)
+{
+    int n = 0;
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (insn->rs1 == var)
+                n++;
+            if (insn->rs2 == var)
+                n++;
+        }
+    }
+    return n;
+}
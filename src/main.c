@@ -5,10 +5,26 @@
  * file "LICENSE" for information on usage and redistribution of this file.
  */
 
+#ifdef __SHECC__
+#else
+/* sockets and processes of the compile server, timing of the passes */
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SHECC__
+#else
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#endif
 
 /* Define target machine */
 #include "../config"
@@ -37,85 +53,706 @@
 /* Peephole optimization */
 #include "peephole.c"
 
+/* If-conversion */
+#include "if-conversion.c"
+
+/* Tail calls */
+#include "tail-call.c"
+
+/* Instruction scheduling */
+#include "schedule.c"
+
+/* Tail merging */
+#include "tail-merge.c"
+
+/* Code layout */
+#include "layout.c"
+
+/* Natural loops */
+#include "loop.c"
+
+/* Induction variable strength reduction */
+#include "strength-reduce.c"
+
+/* loop unrolling */
+#include "loop-unroll.c"
+
+/* Pass manager */
+#include "passes.c"
+
+/* Code emission with fixups */
+#include "emit.c"
+
 /* Machine code generation. support ARMv7-A and RV32I */
 #include "codegen.c"
 
 /* inlined libc */
 #include "../out/libc.inc"
 
-int main(int argc, char *argv[])
+/* The code before the functions refers to the global initialization, laid
+ * out after them, so it is encoded again at the end.
+ */
+void compile_start()
+{
+    emit_start();
+}
+
+/* Encode the global initialization after the functions, then the code before
+ * them and the instructions left unresolved.
+ */
+void compile_end()
+{
+    emit_global();
+
+    /* the data section follows the code */
+    elf_data_start = elf_code_start + elf_code_idx;
+
+    int code_idx = elf_code_idx;
+    elf_code_idx = 0;
+    emit_start();
+    elf_code_idx = code_idx;
+
+    emit_fixups();
+}
+
+/* In function-at-a-time mode, each function is taken through the backend as
+ * soon as it has been parsed, and its IR is released right afterwards. The
+ * memory in use is then bounded by the largest function rather than by the
+ * whole program.
+ */
+void compile_function(fn_t *fn)
 {
-    int libc = 1;
-    char *out = NULL, *in = NULL;
+    if (!elf_code_idx)
+        compile_start();
+
+    fn_ssa_build(fn);
+    fn_find_cold(fn);
+    run_passes(fn, 0, alloc_pass);
+    global_var_alloc();
+    run_passes(fn, alloc_pass, passes_idx);
+
+    if (dump_ir)
+        dump_ph2_ir(fn);
+    fn_emit(fn);
+
+    /* the basic blocks are released without their second phase IR */
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        ph2_ir_t *ph2_ir = bb->ph2_ir_list.head;
+        while (ph2_ir) {
+            ph2_ir_t *next = ph2_ir->next;
+            free(ph2_ir);
+            ph2_ir = next;
+        }
+    }
+    fn_ssa_release(fn);
+}
+
+/* Allocate the registers of the global initialization, once all the
+ * functions have been compiled, and finish the code.
+ */
+void compile_finish()
+{
+    if (!elf_code_idx)
+        compile_start();
+
+    global_var_alloc();
+    for (int i = 0; i < REG_CNT; i++) {
+        REGS[i].var = NULL;
+        REGS[i].polluted = 0;
+    }
+    global_reg_alloc();
+    compile_end();
+}
+
+/* Encode 'fn', unless it already is, then the functions it calls in the
+ * order of their first calls, each followed by its own callees, leaving the
+ * functions which do not return for the end
+ */
+void emit_call_tree(fn_t *fn)
+{
+    if (fn->elf_offset >= 0)
+        return;
+
+    if (dump_ir)
+        dump_ph2_ir(fn);
+    fn_emit(fn);
+
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (ph2_ir_t *ph2_ir = bb->ph2_ir_list.head; ph2_ir;
+             ph2_ir = ph2_ir->next) {
+            if ((ph2_ir->op != OP_call) & (ph2_ir->op != OP_tail_call) &
+                (ph2_ir->op != OP_address_of_func))
+                continue;
+            func_t *func = find_func(ph2_ir->func_name);
+            if (!func->fn)
+                continue;
+            if (func->fn->is_cold)
+                continue;
+            emit_call_tree(func->fn);
+        }
+    }
+}
+
+/* Encode the functions of the whole program, from 'main' down the call
+ * graph, then the ones called from nowhere else in the order of their
+ * definitions, and the global initialization.
+ */
+void code_generate()
+{
+    compile_start();
+
+    func_t *func = find_func("main");
+    if (func)
+        if (func->fn)
+            emit_call_tree(func->fn);
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
+        if (!fn->is_cold)
+            emit_call_tree(fn);
+    }
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next)
+        emit_call_tree(fn);
+
+    compile_end();
+}
+
+/* The functions are independent from each other in the passes, so the '-j'
+ * mode spreads them over a pool of threads. Each function still ends up with
+ * the same code as in a single thread, and they are encoded in their
+ * original order afterwards. A compiler built by shecc itself has no threads
+ * and processes them in turn.
+ */
+fn_t *next_job;
+int job_phase;
+
+fn_t *take_job()
+{
+#ifdef __SHECC__
+#else
+    pthread_mutex_lock(&shared_lock);
+#endif
+    fn_t *fn = next_job;
+    if (fn)
+        next_job = fn->next;
+#ifdef __SHECC__
+#else
+    pthread_mutex_unlock(&shared_lock);
+#endif
+    return fn;
+}
+
+void *run_jobs(void *arg)
+{
+    UNUSED(arg);
+
+    for (fn_t *fn = take_job(); fn; fn = take_job()) {
+        if (job_phase == 0)
+            run_passes(fn, 0, alloc_pass);
+        else
+            run_passes(fn, alloc_pass, passes_idx);
+    }
+    return NULL;
+}
+
+void run_phase(int phase)
+{
+    next_job = FUNC_LIST.head;
+    job_phase = phase;
+
+#ifdef __SHECC__
+    run_jobs(NULL);
+#else
+    pthread_t threads[MAX_JOBS];
+
+    if (jobs == 1) {
+        run_jobs(NULL);
+        return;
+    }
+
+    for (int i = 0; i < jobs; i++) {
+        if (pthread_create(&threads[i], NULL, run_jobs, NULL)) {
+            printf("Failed to create thread\n");
+            abort();
+        }
+    }
+    for (int i = 0; i < jobs; i++)
+        pthread_join(threads[i], NULL);
+#endif
+}
+
+void backend()
+{
+    /* the layout of the blocks needs the functions which do not return */
+    find_cold_fns();
+
+    /* the register allocation needs the liveness of the global variables
+     * over the whole program
+     */
+    run_phase(0);
+
+    global_var_alloc();
+    global_reg_alloc();
+    run_phase(1);
+}
+
+/* Compile the source file 'in' into the executable 'out'. The global objects
+ * have been initialized, and the libc loaded, beforehand.
+ */
+void compile(char *in, char *out)
+{
+    /* load and parse source code into IR */
+    parse(in);
+
+    /* dump first phase IR */
+    if (dump_ir)
+        dump_ph1_ir();
+
+    if (fn_at_a_time) {
+        /* the functions have been compiled while being parsed */
+        compile_finish();
+    } else {
+        ssa_build(dump_ir);
+
+        /* optimize and allocate registers from IR */
+        backend();
+
+        /* generate code from IR, dumping the second phase IR */
+        code_generate();
+    }
+
+    /* output code in ELF */
+    elf_generate(out);
+
+    if (pass_stats)
+        print_pass_stats();
+
+    /* release allocated objects */
+    ssa_release();
+}
 
-    for (int i = 1; i < argc; i++) {
+/* In batch mode, the executable compiled from 'in' is written to the
+ * directory 'dir', named after the source file without its '.c' extension.
+ */
+void batch_output(char *path, char *dir, char *in)
+{
+    int start = strlen(in);
+    while (start > 0 && in[start - 1] != '/')
+        start--;
+
+    strcpy(path, dir);
+    int len = strlen(path);
+    path[len++] = '/';
+    strcpy(path + len, in + start);
+
+    len = strlen(path);
+    if (len > 2 && path[len - 2] == '.' && path[len - 1] == 'c')
+        path[len - 2] = 0;
+}
+
+/* options of the compilation */
+int libc = 1;
+char *out;
+char *inputs[MAX_INPUTS];
+int inputs_idx;
+bool batch;
+
+/* Length of the libc source at the beginning of SOURCE. The libc is loaded
+ * once, and stays there for the next programs of a batch or of the server.
+ */
+int libc_len;
+
+/* Read the options and the source files in 'argv'. Return false, after a
+ * message has been printed, if they are not valid.
+ */
+bool parse_options(int argc, char *argv[])
+{
+    for (int i = 0; i < argc; i++) {
         if (!strcmp(argv[i], "--dump-ir"))
             dump_ir = 1;
         else if (!strcmp(argv[i], "+m"))
             hard_mul_div = 1;
-        else if (!strcmp(argv[i], "--no-libc"))
+        else if (!strcmp(argv[i], "+c")) {
+            if (strcmp(ARCH_PREDEFINED, "__riscv")) {
+                printf("The option +c is only supported on RISC-V\n");
+                return false;
+            }
+            rvc = 1;
+        } else if (!strcmp(argv[i], "--no-libc"))
             libc = 0;
-        else if (!strcmp(argv[i], "-o")) {
+        else if (!strcmp(argv[i], "--fn-at-a-time"))
+            fn_at_a_time = 1;
+        else if (!strcmp(argv[i], "--verify-ir"))
+            verify_ir = 1;
+        else if (!strcmp(argv[i], "--stats"))
+            pass_stats = 1;
+        else if (!strcmp(argv[i], "-mthumb")) {
+            if (strcmp(ARCH_PREDEFINED, "__arm__")) {
+                printf("The option -mthumb is only supported on ARM\n");
+                return false;
+            }
+            thumb = 1;
+        } else if (!strncmp(argv[i], "-O", 2)) {
+            char *arg = argv[i];
+            int level = -1;
+            if (arg[2] >= '0' && arg[2] <= '2')
+                if (!arg[3])
+                    level = arg[2] - '0';
+            if (level < 0) {
+                printf("The optimization level must be -O0, -O1 or -O2\n");
+                return false;
+            }
+            set_opt_level(level);
+        } else if (!strncmp(argv[i], "-f", 2)) {
+            /* applied below, over the optimization level */
+        } else if (!strcmp(argv[i], "-j")) {
+            jobs = 0;
+            if (i + 1 < argc) {
+                char *num = argv[i + 1];
+                for (int j = 0; num[j]; j++) {
+                    if (num[j] < '0' || num[j] > '9') {
+                        jobs = 0;
+                        break;
+                    }
+                    jobs = jobs * 10 + num[j] - '0';
+                }
+                i++;
+            }
+            if (jobs < 1 || jobs > MAX_JOBS) {
+                printf("The number of jobs must be between 1 and %d\n",
+                       MAX_JOBS);
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--unroll")) {
+            unroll_factor = 0;
+            if (i + 1 < argc) {
+                char *num = argv[i + 1];
+                for (int j = 0; num[j]; j++) {
+                    if (num[j] < '0' || num[j] > '9') {
+                        unroll_factor = 0;
+                        break;
+                    }
+                    unroll_factor = unroll_factor * 10 + num[j] - '0';
+                }
+                i++;
+            }
+            if (unroll_factor < 1 || unroll_factor > MAX_UNROLL) {
+                printf("The unrolling factor must be between 1 and %d\n",
+                       MAX_UNROLL);
+                return false;
+            }
+        } else if (!strcmp(argv[i], "-o")) {
             if (i < argc + 1) {
                 out = argv[i + 1];
                 i++;
             } else
                 /* unsupported options */
                 abort();
-        } else
-            in = argv[i];
+        } else if (!strncmp(argv[i], "@", 1)) {
+            /* list file, with the path of a source file on each line */
+            char *list = argv[i];
+            FILE *f = fopen(list + 1, "rb");
+            if (!f) {
+                printf("Unable to open %s\n", list + 1);
+                return false;
+            }
+            char *line = malloc(MAX_LINE_LEN);
+            while (fgets(line, MAX_LINE_LEN, f)) {
+                int len = strlen(line);
+                if (line[len - 1] == '\n')
+                    line[len - 1] = 0;
+                if (!line[0])
+                    continue;
+                if (inputs_idx == MAX_INPUTS) {
+                    printf("Too many source files\n");
+                    return false;
+                }
+                inputs[inputs_idx++] = line;
+                line = malloc(MAX_LINE_LEN);
+            }
+            free(line);
+            fclose(f);
+            batch = true;
+        } else {
+            if (inputs_idx == MAX_INPUTS) {
+                printf("Too many source files\n");
+                return false;
+            }
+            inputs[inputs_idx++] = argv[i];
+        }
     }
 
-    if (!in) {
+    if (!inputs_idx) {
         printf("Missing source file!\n");
         printf(
-            "Usage: shecc [-o output] [+m] [--dump-ir] [--no-libc] "
-            "<input.c>\n");
+            "Usage: shecc [-o output] [+m] [+c] [--dump-ir] [--no-libc] "
+            "[--fn-at-a-time] [-j jobs] [-O0|-O1|-O2] [-f[no-]<pass>] "
+            "[--unroll factor] [--verify-ir] [--stats] [-mthumb] <input.c>\n"
+            "       shecc [-o outdir] [options] <input.c>... | @list\n"
+            "       shecc --server <socket>\n"
+            "       shecc --client <socket> [options] <input.c>...\n");
+        return false;
+    }
+
+    /* the passes named explicitly take precedence over the level */
+    for (int i = 0; i < argc; i++) {
+        char *arg = argv[i];
+        if (!strcmp(arg, "-o") || !strcmp(arg, "-j") ||
+            !strcmp(arg, "--unroll"))
+            i++;
+        else if (!strncmp(arg, "-fno-", 5)) {
+            if (!set_pass(arg + 5, false))
+                return false;
+        } else if (!strncmp(arg, "-f", 2)) {
+            if (!set_pass(arg + 2, true))
+                return false;
+        }
+    }
+
+    /* with several source files, the output is a directory */
+    if (inputs_idx > 1)
+        batch = true;
+    if (batch && !out)
+        out = ".";
+    return true;
+}
+
+/* Compile the source files in turn, once the libc has been loaded */
+void compile_inputs()
+{
+    for (int i = 0; i < inputs_idx; i++) {
+        if (i) {
+            global_reset();
+            global_alloc_insn = NULL;
+            source_idx = libc_len;
+            SOURCE[source_idx] = 0;
+        }
+
+        if (batch) {
+            char path[MAX_LINE_LEN];
+            batch_output(path, out, inputs[i]);
+            compile(inputs[i], path);
+        } else
+            compile(inputs[i], out);
+    }
+}
+
+#ifdef __SHECC__
+int server(char *path)
+{
+    UNUSED(path);
+    printf("The compile server requires a compiler built by the host\n");
+    return -1;
+}
+
+int client(char *path, int argc, char *argv[])
+{
+    UNUSED(path);
+    UNUSED(argc);
+    UNUSED(argv);
+    printf("The compile server requires a compiler built by the host\n");
+    return -1;
+}
+#else
+/* The compile server keeps the libc loaded and the tables allocated. Each
+ * request is compiled by a child process, so that the state of the server is
+ * left untouched, and an error only ends that process. The request is made of
+ * NUL-terminated strings: the working directory of the client, then its
+ * arguments, up to an empty string. The server sends back the output of the
+ * compiler, followed by a byte with its exit status.
+ */
+bool write_all(int fd, char *buf, int len)
+{
+    while (len > 0) {
+        int n = write(fd, buf, len);
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Read a request from 'conn' into 'buf', and point 'args' to its strings.
+ * Return their number, or -1 if the request is incomplete.
+ */
+int read_request(int conn, char *buf, char *args[])
+{
+    int len = 0, argc = 0, start = 0;
+
+    for (;;) {
+        if (len == MAX_REQUEST)
+            return -1;
+        int n = read(conn, buf + len, MAX_REQUEST - len);
+        if (n <= 0)
+            return -1;
+        len += n;
+
+        for (; start < len; start += strlen(buf + start) + 1) {
+            char *end = memchr(buf + start, 0, len - start);
+            if (!end)
+                break;
+            if (end == buf + start)
+                return argc;
+            if (argc == MAX_INPUTS)
+                return -1;
+            args[argc++] = buf + start;
+        }
+    }
+}
+
+void serve(int conn)
+{
+    char *buf = malloc(MAX_REQUEST);
+    char *args[MAX_INPUTS];
+    int argc = read_request(conn, buf, args);
+    if (argc < 1)
+        return;
+
+    int status;
+    pid_t pid = fork();
+    if (!pid) {
+        dup2(conn, STDOUT_FILENO);
+        dup2(conn, STDERR_FILENO);
+        setvbuf(stdout, NULL, _IONBF, 0);
+
+        if (chdir(args[0])) {
+            printf("Unable to enter %s\n", args[0]);
+            exit(1);
+        }
+        if (!parse_options(argc - 1, &args[1]))
+            exit(1);
+        if (!libc) {
+            libc_len = 0;
+            source_idx = 0;
+            SOURCE[0] = 0;
+        }
+        compile_inputs();
+        exit(0);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+        status = 1;
+    else if (WIFEXITED(status))
+        status = WEXITSTATUS(status);
+    else
+        status = 128 + WTERMSIG(status);
+
+    char code = status;
+    write_all(conn, &code, 1);
+}
+
+int server(char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("The socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(fd, 64)) {
+        perror("shecc: server");
         return -1;
     }
 
-    /* initialize global objects */
     global_init();
+    libc_generate();
+    libc_len = source_idx;
 
-    /* include libc */
-    if (libc)
-        libc_generate();
+    /* the processes serving the connections are reaped by the system */
+    signal(SIGCHLD, SIG_IGN);
 
-    /* load and parse source code into IR */
-    parse(in);
+    for (;;) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0)
+            continue;
+        if (!fork()) {
+            close(fd);
+            signal(SIGCHLD, SIG_DFL);
+            serve(conn);
+            exit(0);
+        }
+        close(conn);
+    }
+}
 
-    /* dump first phase IR */
-    if (dump_ir)
-        dump_ph1_ir();
+int client(char *path, int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    char cwd[MAX_REQUEST];
 
-    ssa_build(dump_ir);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("The socket path is too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
 
-    /* SSA-based optimization */
-    optimize();
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        perror("shecc: client");
+        return -1;
+    }
 
-    /* SSA-based liveness analyses */
-    liveness_analysis();
+    if (!getcwd(cwd, sizeof(cwd)))
+        return -1;
+    bool sent = write_all(fd, cwd, strlen(cwd) + 1);
+    for (int i = 0; i < argc; i++)
+        sent &= write_all(fd, argv[i], strlen(argv[i]) + 1);
+    sent &= write_all(fd, "", 1);
+    if (!sent) {
+        perror("shecc: client");
+        return -1;
+    }
 
-    /* allocate register from IR */
-    reg_alloc();
+    /* the last byte received is the exit status, not part of the output */
+    char buf[4096];
+    int n, status = -1;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (status >= 0)
+            putchar(status);
+        fwrite(buf, 1, n - 1, stdout);
+        status = (unsigned char) buf[n - 1];
+    }
+    close(fd);
 
-    peephole();
+    if (status < 0) {
+        printf("The compile server closed the connection\n");
+        return -1;
+    }
+    return status;
+}
+#endif
 
-    /* flatten CFG to linear instruction */
-    cfg_flatten();
+int main(int argc, char *argv[])
+{
+    register_passes();
 
-    /* dump second phase IR */
-    if (dump_ir)
-        dump_ph2_ir();
+    if (argc > 2) {
+        if (!strcmp(argv[1], "--server"))
+            return server(argv[2]);
+        if (!strcmp(argv[1], "--client"))
+            return client(argv[2], argc - 3, &argv[3]);
+    }
 
-    /* generate code from IR */
-    code_generate();
+    if (!parse_options(argc - 1, &argv[1]))
+        return -1;
 
-    /* output code in ELF */
-    elf_generate(out);
+    /* initialize global objects */
+    global_init();
+
+    /* include libc */
+    if (libc)
+        libc_generate();
+    libc_len = source_idx;
+
+    compile_inputs();
 
-    /* release allocated objects */
-    ssa_release();
     global_release();
 
     exit(0);
@@ -27,7 +27,10 @@ var_t *require_var(block_t *blk)
     if (blk->next_local >= MAX_LOCALS)
         error("Too many locals");
 
-    var_t *var = &blk->locals[blk->next_local++];
+    int chunk = blk->next_local / LOCALS_CHUNK;
+    if (!blk->locals[chunk])
+        blk->locals[chunk] = calloc(LOCALS_CHUNK, sizeof(var_t));
+    var_t *var = block_local(blk, blk->next_local++);
     var->consumed = -1;
     var->base = var;
     return var;
@@ -326,14 +329,14 @@ void cppd_control_flow_skip_lines()
 {
     while (!lex_peek(T_cppd_elif, NULL) && !lex_peek(T_cppd_else, NULL) &&
            !lex_peek(T_cppd_endif, NULL)) {
-        next_token = lex_token();
+        next_token = lex_token_internal(false);
     }
     skip_whitespace();
 }
 
 void check_def(char *alias)
 {
-    if (find_alias(alias))
+    if (find_alias(alias) || find_macro(alias))
         preproc_match = true;
 }
 
@@ -376,36 +379,51 @@ bool read_preproc_directive()
 
         return true;
     }
-    if (lex_accept(T_cppd_define)) {
+    if (lex_peek(T_cppd_define, NULL)) {
         char alias[MAX_VAR_LEN];
         char value[MAX_VAR_LEN];
 
+        /* keep the newline visible to tell whether a value follows */
+        skip_newline = false;
+        lex_expect_internal(T_cppd_define, false);
+
+        if (is_newline(next_char) || !next_char) {
+            /* e.g., '#define HEADER_H' of an include guard */
+            skip_newline = true;
+            lex_ident(T_identifier, alias);
+            add_alias(alias, "");
+            return true;
+        }
+
         lex_ident_internal(T_identifier, alias, false);
 
-        if (lex_peek(T_numeric, value)) {
-            lex_expect(T_numeric);
-            add_alias(alias, value);
-        } else if (lex_peek(T_string, value)) {
-            lex_expect(T_string);
-            add_alias(alias, value);
-        } else if (lex_peek(T_identifier, value)) {
-            lex_expect(T_identifier);
-            add_alias(alias, value);
-        } else if (lex_accept(T_open_bracket)) { /* function-like macro */
+        if (lex_accept_internal(T_open_bracket, false)) {
+            /* function-like macro */
             macro_t *macro = add_macro(alias);
 
-            skip_newline = false;
             while (lex_peek(T_identifier, alias)) {
                 lex_expect(T_identifier);
                 strcpy(macro->param_defs[macro->num_param_defs++].var_name,
                        alias);
-                lex_accept(T_comma);
+                lex_accept_internal(T_comma, false);
             }
             if (lex_accept(T_elipsis))
                 macro->is_variadic = true;
 
-            macro->start_source_idx = source_idx;
-            skip_macro_body();
+            lex_macro_body(macro);
+            return true;
+        }
+
+        skip_newline = true;
+        if (lex_peek(T_numeric, value)) {
+            lex_expect(T_numeric);
+            add_alias(alias, value);
+        } else if (lex_peek(T_string, value)) {
+            lex_expect(T_string);
+            add_alias(alias, value);
+        } else if (lex_peek(T_identifier, value)) {
+            lex_expect(T_identifier);
+            add_alias(alias, value);
         }
 
         return true;
@@ -446,7 +464,7 @@ bool read_preproc_directive()
     if (lex_accept(T_cppd_elif)) {
         if (preproc_match) {
             while (!lex_peek(T_cppd_endif, NULL)) {
-                next_token = lex_token();
+                next_token = lex_token_internal(false);
             }
             return true;
         }
@@ -492,6 +510,27 @@ bool read_preproc_directive()
         cppd_control_flow_skip_lines();
         return true;
     }
+    if (lex_accept_internal(T_cppd_ifndef, false)) {
+        preproc_match = false;
+        lex_ident(T_identifier, token);
+        check_def(token);
+        preproc_match = !preproc_match;
+
+        if (preproc_match) {
+            skip_whitespace();
+            return true;
+        }
+
+        cppd_control_flow_skip_lines();
+        return true;
+    }
+    if (lex_peek(T_cppd_pragma, NULL)) {
+        /* '#pragma once' is handled by load_source_file, others are ignored */
+        while (!is_newline(next_char) && next_char != 0)
+            read_char(false);
+        next_token = lex_token();
+        return true;
+    }
 
     return false;
 }
@@ -845,69 +884,8 @@ void read_expr_operand(block_t *parent, basic_block_t **bb)
         constant_t *con = find_constant(token);
         var_t *var = find_var(token, parent);
         func_t *fn = find_func(token);
-        int macro_param_idx = find_macro_param_src_idx(token, parent);
-        macro_t *mac = find_macro(token);
-
-        if (!strcmp(token, "__VA_ARGS__")) {
-            /* 'source_idx' has pointed at the character after __VA_ARGS__ */
-            int remainder, t = source_idx;
-            macro_t *macro = parent->macro;
-
-            if (!macro)
-                error("The '__VA_ARGS__' identifier can only be used in macro");
-            if (!macro->is_variadic)
-                error("Unexpected identifier '__VA_ARGS__'");
-
-            remainder = macro->num_params - macro->num_param_defs;
-            for (int i = 0; i < remainder; i++) {
-                source_idx = macro->params[macro->num_params - remainder + i];
-                next_char = SOURCE[source_idx];
-                next_token = lex_token();
-                read_expr(parent, bb);
-            }
-            source_idx = t;
-            next_char = SOURCE[source_idx];
-            next_token = lex_token();
-        } else if (mac) {
-            if (parent->macro)
-                error("Nested macro is not yet supported");
-
-            parent->macro = mac;
-            mac->num_params = 0;
-            lex_expect(T_identifier);
 
-            /* 'source_idx' has pointed at the first parameter */
-            while (!lex_peek(T_close_bracket, NULL)) {
-                mac->params[mac->num_params++] = source_idx;
-                do {
-                    next_token = lex_token();
-                } while (next_token != T_comma &&
-                         next_token != T_close_bracket);
-            }
-            /* move 'source_idx' to the macro body */
-            macro_return_idx = source_idx;
-            source_idx = mac->start_source_idx;
-            next_char = SOURCE[source_idx];
-            lex_expect(T_close_bracket);
-
-            skip_newline = 0;
-            read_expr(parent, bb);
-
-            /* cleanup */
-            skip_newline = 1;
-            parent->macro = NULL;
-            macro_return_idx = 0;
-        } else if (macro_param_idx) {
-            /* "expand" the argument from where it comes from */
-            int t = source_idx;
-            source_idx = macro_param_idx;
-            next_char = SOURCE[source_idx];
-            next_token = lex_token();
-            read_expr(parent, bb);
-            source_idx = t;
-            next_char = SOURCE[source_idx];
-            next_token = lex_token();
-        } else if (con) {
+        if (con) {
             ph1_ir = add_ph1_ir(OP_load_constant);
             vd = require_var(parent);
             vd->init_val = con->value;
@@ -1904,7 +1882,6 @@ void perform_side_effect(block_t *parent, basic_block_t *bb)
 }
 
 basic_block_t *read_code_block(func_t *func,
-                               macro_t *macro,
                                block_t *parent,
                                basic_block_t *bb);
 
@@ -1912,7 +1889,6 @@ basic_block_t *read_body_statement(block_t *parent, basic_block_t *bb)
 {
     char token[MAX_ID_LEN];
     ph1_ir_t *ph1_ir;
-    macro_t *mac;
     func_t *fn;
     type_t *type;
     var_t *vd, *var;
@@ -1927,7 +1903,7 @@ basic_block_t *read_body_statement(block_t *parent, basic_block_t *bb)
      */
 
     if (lex_peek(T_open_curly, NULL))
-        return read_code_block(parent->func, parent->macro, parent, bb);
+        return read_code_block(parent->func, parent, bb);
 
     if (lex_accept(T_return)) {
         /* return void */
@@ -2307,7 +2283,7 @@ basic_block_t *read_body_statement(block_t *parent, basic_block_t *bb)
         lex_expect(T_open_bracket);
 
         /* synthesize for loop block */
-        block_t *blk = add_block(parent, parent->func, parent->macro);
+        block_t *blk = add_block(parent, parent->func);
         add_ph1_ir(OP_block_start);
 
         /* setup - execute once */
@@ -2445,6 +2421,16 @@ basic_block_t *read_body_statement(block_t *parent, basic_block_t *bb)
             bb_connect(body_, inc_, NEXT);
             bb_connect(inc_, cond_, NEXT);
         } else {
+            /* the end of the body is not reached, but a 'continue' may
+             * still go on to the increment
+             */
+            basic_block_t *inc_start = continue_bb[continue_pos_idx - 1];
+            for (int i = 0; i < MAX_BB_PRED; i++) {
+                if (inc_start->prev[i].bb) {
+                    bb_connect(inc_, cond_, NEXT);
+                    break;
+                }
+            }
             /* TODO: Release dangling inc basic block */
         }
 
@@ -2594,38 +2580,6 @@ basic_block_t *read_body_statement(block_t *parent, basic_block_t *bb)
         return bb;
     }
 
-    mac = find_macro(token);
-    if (mac) {
-        if (parent->macro)
-            error("Nested macro is not yet supported");
-
-        parent->macro = mac;
-        mac->num_params = 0;
-        lex_expect(T_identifier);
-
-        /* 'source_idx' has pointed at the first parameter */
-        while (!lex_peek(T_close_bracket, NULL)) {
-            mac->params[mac->num_params++] = source_idx;
-            do {
-                next_token = lex_token();
-            } while (next_token != T_comma && next_token != T_close_bracket);
-        }
-        /* move 'source_idx' to the macro body */
-        macro_return_idx = source_idx;
-        source_idx = mac->start_source_idx;
-        next_char = SOURCE[source_idx];
-        lex_expect(T_close_bracket);
-
-        skip_newline = 0;
-        bb = read_body_statement(parent, bb);
-
-        /* cleanup */
-        skip_newline = 1;
-        parent->macro = NULL;
-        macro_return_idx = 0;
-        return bb;
-    }
-
     /* is a function call? */
     fn = find_func(token);
     if (fn) {
@@ -2648,11 +2602,10 @@ basic_block_t *read_body_statement(block_t *parent, basic_block_t *bb)
 }
 
 basic_block_t *read_code_block(func_t *func,
-                               macro_t *macro,
                                block_t *parent,
                                basic_block_t *bb)
 {
-    block_t *blk = add_block(parent, func, macro);
+    block_t *blk = add_block(parent, func);
     bb->scope = blk;
 
     add_ph1_ir(OP_block_start);
@@ -2670,10 +2623,11 @@ basic_block_t *read_code_block(func_t *func,
 }
 
 void var_add_killed_bb(var_t *var, basic_block_t *bb);
+void compile_function(fn_t *fn);
 
 void read_func_body(func_t *fdef, fn_t *fn)
 {
-    block_t *blk = add_block(NULL, fdef, NULL);
+    block_t *blk = add_block(NULL, fdef);
     fn->bbs = bb_create(blk);
     fn->exit = bb_create(blk);
 
@@ -2683,7 +2637,7 @@ void read_func_body(func_t *fdef, fn_t *fn)
         fdef->param_defs[i].base = &fdef->param_defs[i];
         var_add_killed_bb(&fdef->param_defs[i], fn->bbs);
     }
-    basic_block_t *body = read_code_block(fdef, NULL, NULL, fn->bbs);
+    basic_block_t *body = read_code_block(fdef, NULL, fn->bbs);
     if (body)
         bb_connect(body, fn->exit, NEXT);
 }
@@ -2714,6 +2668,8 @@ void read_global_decl(block_t *block)
             fn->func = fd;
             fd->fn = fn;
             read_func_body(fd, fn);
+            if (fn_at_a_time)
+                compile_function(fn);
             return;
         }
         if (lex_accept(T_semicolon)) /* forward definition */
@@ -2770,6 +2726,7 @@ void read_global_statement()
         type->size = size;
         type->num_fields = i;
         type->base_type = TYPE_struct;
+        index_type(type);
         lex_expect(T_semicolon);
     } else if (lex_accept(T_typedef)) {
         if (lex_accept(T_enum)) {
@@ -2791,6 +2748,7 @@ void read_global_statement()
             lex_expect(T_close_curly);
             lex_ident(T_identifier, token);
             strcpy(type->type_name, token);
+            index_type(type);
             lex_expect(T_semicolon);
         } else if (lex_accept(T_struct)) {
             int i = 0, size = 0, has_struct_def = 0;
@@ -2806,6 +2764,7 @@ void read_global_statement()
                     tag = add_type();
                     tag->base_type = TYPE_struct;
                     strcpy(tag->type_name, token);
+                    index_type(tag);
                 }
             }
 
@@ -2825,6 +2784,7 @@ void read_global_statement()
             type->size = size;
             type->num_fields = i;
             type->base_type = TYPE_typedef;
+            index_type(type);
 
             if (tag && has_struct_def == 1) {
                 strcpy(token, tag->type_name);
@@ -2852,6 +2812,7 @@ void read_global_statement()
             type->size = base->size;
             type->num_fields = 0;
             lex_ident(T_identifier, type->type_name);
+            index_type(type);
             lex_expect(T_semicolon);
         }
     } else if (lex_peek(T_identifier, NULL)) {
@@ -2862,18 +2823,25 @@ void read_global_statement()
 
 void parse_internal()
 {
+    /* the numbering restarts with every program */
+    global_var_idx = 0;
+    global_label_idx = 0;
+
     /* built-in types */
     type_t *type = add_named_type("void");
     type->base_type = TYPE_void;
     type->size = 0;
+    index_type(type);
 
     type = add_named_type("char");
     type->base_type = TYPE_char;
     type->size = 1;
+    index_type(type);
 
     type = add_named_type("int");
     type->base_type = TYPE_int;
     type->size = 4;
+    index_type(type);
 
     /* builtin type _Bool was introduced in C99 specification, it is more
      * well-known as macro type bool, which is defined in <std_bool.h> (in
@@ -2882,9 +2850,13 @@ void parse_internal()
     type = add_named_type("_Bool");
     type->base_type = TYPE_char;
     type->size = 1;
+    index_type(type);
 
-    add_block(NULL, NULL, NULL); /* global block */
-    elf_add_symbol("", 0, 0);    /* undef symbol */
+    add_block(NULL, NULL); /* global block */
+    elf_symbol_index = 0;
+    elf_symtab_index = 0;
+    elf_strtab_index = 0;
+    elf_add_symbol("", 0, 0); /* undef symbol */
 
     /* architecture defines */
     add_alias(ARCH_PREDEFINED, "1");
@@ -2907,6 +2879,8 @@ void parse_internal()
     /* lexer initialization */
     source_idx = 0;
     next_char = SOURCE[0];
+    next_token = T_start;
+    skip_newline = true;
     lex_expect(T_start);
 
     do {
@@ -2916,20 +2890,182 @@ void parse_internal()
     } while (!lex_accept(T_eof));
 }
 
-/* Load specified source file and referred inclusion recursively */
+/* Number of the conditional directives enclosing the line being loaded, not
+ * counting include guards. A header included within them might not be parsed,
+ * so it is not skipped when it is included again.
+ */
+int load_cond_depth = 0;
+bool load_in_comment;
+
+/* Whether 'line' holds nothing but blanks and comments. 'load_in_comment'
+ * carries an unterminated block comment over to the next line.
+ */
+bool load_is_blank(char *line)
+{
+    int i = 0;
+
+    while (line[i]) {
+        if (load_in_comment) {
+            if (line[i] == '*' && line[i + 1] == '/') {
+                load_in_comment = false;
+                i++;
+            }
+        } else if (line[i] == '/' && line[i + 1] == '*') {
+            load_in_comment = true;
+            i++;
+        } else if (line[i] == '/' && line[i + 1] == '/') {
+            return true;
+        } else if (!is_whitespace(line[i]) && !is_newline(line[i])) {
+            return false;
+        }
+        i++;
+    }
+    return true;
+}
+
+/* If 'line' is the directive 'name', return the rest of the line after the
+ * name. Otherwise, return NULL.
+ */
+char *load_match_directive(char *line, char *name)
+{
+    int len = strlen(name);
+
+    while (is_whitespace(line[0]))
+        line++;
+    if (line[0] != '#')
+        return NULL;
+    line++;
+    while (is_whitespace(line[0]))
+        line++;
+    if (strncmp(line, name, len))
+        return NULL;
+    line = &line[len];
+    if (is_alnum(line[0]))
+        return NULL;
+    while (is_whitespace(line[0]))
+        line++;
+    return line;
+}
+
+/* Copy the identifier at the beginning of 'str' into 'name'. */
+void load_read_ident(char *str, char *name)
+{
+    int i = 0;
+
+    while (is_alnum(str[i]) && i < MAX_VAR_LEN - 1) {
+        name[i] = str[i];
+        i++;
+    }
+    name[i] = 0;
+}
+
+/* The headers guarded by 'guard' have to be loaded again once it is undefined.
+ */
+void load_forget_guard(char *guard)
+{
+    for (int i = 0; i < includes_idx; i++) {
+        include_t *inc = &INCLUDES[i];
+        if (!strcmp(inc->guard, guard))
+            hashmap_remove(INCLUDES_MAP, inc->path);
+    }
+}
+
+/**
+ * load_source_file() - append a file to SOURCE, with its included files
+ * @file: path of the file.
+ *
+ * A file marked with '#pragma once', or whose content is enclosed in an
+ * include guard, '#ifndef X', '#define X', ..., '#endif', is recorded in
+ * INCLUDES. It is not loaded again when it is included another time, as it
+ * would be skipped by the preprocessor anyway, unless X gets undefined.
+ */
 void load_source_file(char *file)
 {
     char buffer[MAX_LINE_LEN];
+    char guard[MAX_VAR_LEN];
+    char name[MAX_VAR_LEN];
+    char *rest;
+    /* 0: only blank lines so far, 1: after '#ifndef X', 2: after '#define X',
+     * 3: after the '#endif' of the guard, -1: not guarded.
+     */
+    int guard_state = 0;
+    bool guard_open = false; /* in the conditional of the include guard */
+    bool once = false;
+    bool uncond = load_cond_depth == 0;
+    int depth = 0;
+
+    if (hashmap_get(INCLUDES_MAP, file))
+        return;
 
     FILE *f = fopen(file, "rb");
     if (!f)
         abort();
+    load_in_comment = false;
 
     for (;;) {
-        if (!fgets(buffer, MAX_LINE_LEN, f)) {
-            fclose(f);
-            return;
+        if (!fgets(buffer, MAX_LINE_LEN, f))
+            break;
+
+        if (guard_state == 0 || guard_state == 1 || guard_state == 3) {
+            if (load_is_blank(buffer)) {
+                /* blank lines and comments are allowed around the guard */
+            } else if (guard_state == 0) {
+                rest = load_match_directive(buffer, "ifndef");
+                guard_state = -1;
+                if (rest) {
+                    load_read_ident(rest, guard);
+                    guard_state = 1;
+                    guard_open = true;
+                }
+            } else if (guard_state == 1) {
+                rest = load_match_directive(buffer, "define");
+                guard_state = -1;
+                if (rest) {
+                    load_read_ident(rest, name);
+                    if (!strcmp(name, guard))
+                        guard_state = 2;
+                }
+            } else {
+                guard_state = -1;
+            }
+        }
+        if (guard_state < 0 && guard_open) {
+            /* what looked like a guard is an ordinary conditional */
+            guard_open = false;
+            load_cond_depth++;
+        }
+
+        if (load_match_directive(buffer, "if") ||
+            load_match_directive(buffer, "ifdef") ||
+            load_match_directive(buffer, "ifndef")) {
+            depth++;
+            if (!guard_open || depth > 1)
+                load_cond_depth++;
+        } else if (load_match_directive(buffer, "endif")) {
+            depth--;
+            if (guard_open && depth == 0) {
+                guard_open = false;
+                guard_state = 3;
+                load_in_comment = false;
+            } else {
+                load_cond_depth--;
+            }
+        } else if (load_match_directive(buffer, "else") ||
+                   load_match_directive(buffer, "elif")) {
+            if (guard_open && depth == 1) {
+                guard_open = false;
+                guard_state = -1;
+                load_cond_depth++;
+            }
+        } else if (load_match_directive(buffer, "undef")) {
+            load_read_ident(load_match_directive(buffer, "undef"), name);
+            load_forget_guard(name);
+        } else if (load_match_directive(buffer, "pragma")) {
+            load_read_ident(load_match_directive(buffer, "pragma"), name);
+            if (!strcmp(name, "once"))
+                once = true;
         }
+
         if (!strncmp(buffer, "#include ", 9) && (buffer[9] == '"')) {
             char path[MAX_LINE_LEN];
             int c = strlen(file) - 1;
@@ -2944,12 +3080,23 @@ void load_source_file(char *file)
             buffer[strlen(buffer) - 2] = 0;
             strcpy(path + c, buffer + 10);
             load_source_file(path);
+            load_in_comment = false;
         } else {
             strcpy(SOURCE + source_idx, buffer);
             source_idx += strlen(buffer);
         }
     }
     fclose(f);
+
+    if (uncond && (once || guard_state == 3) && includes_idx < MAX_INCLUDES) {
+        include_t *inc = &INCLUDES[includes_idx++];
+        strcpy(inc->path, file);
+        if (once)
+            strcpy(inc->guard, "");
+        else
+            strcpy(inc->guard, guard);
+        hashmap_put(INCLUDES_MAP, inc->path, inc);
+    }
 }
 
 void parse(char *file)
@@ -0,0 +1,252 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* The backend is a list of passes, run on each function in the order they
+ * are registered. The optimization level enables the passes up to it, and
+ * the '-f<pass>' and '-fno-<pass>' options override it for a single pass.
+ * The passes of level 0 are required to generate code at all.
+ */
+pass_t PASSES[MAX_PASSES];
+int passes_idx = 0;
+
+/* index of the register allocation: the passes before it only need the
+ * liveness of their own function, those after it the global registers too
+ */
+int alloc_pass;
+
+pass_t *add_pass(char *name, int level)
+{
+    if (passes_idx == MAX_PASSES) {
+        printf("Too many passes\n");
+        abort();
+    }
+
+    pass_t *pass = &PASSES[passes_idx++];
+    strcpy(pass->name, name);
+    pass->level = level;
+    pass->enabled = level <= opt_level;
+    return pass;
+}
+
+void register_passes()
+{
+    pass_t *pass = add_pass("cse", 1);
+    pass->run = fn_cse;
+    pass = add_pass("const-fold", 1);
+    pass->run = fn_const_folding;
+    pass = add_pass("strength-reduce", 2);
+    pass->run = fn_strength_reduce;
+    pass = add_pass("loop-unroll", 2);
+    pass->run = fn_loop_unroll;
+    pass = add_pass("liveness", 0);
+    pass->run = fn_liveness_analysis;
+
+    alloc_pass = passes_idx;
+    pass = add_pass("reg-alloc", 0);
+    pass->run = fn_reg_alloc;
+    pass = add_pass("peephole", 1);
+    pass->run = fn_peephole;
+    register_peephole_rules();
+    pass = add_pass("tail-call", 1);
+    pass->run = fn_tail_call;
+    pass = add_pass("schedule", 2);
+    pass->run = fn_schedule;
+    pass = add_pass("if-conversion", 2);
+    pass->run = fn_if_conversion;
+    pass = add_pass("tail-merge", 2);
+    pass->run = fn_tail_merge;
+    pass = add_pass("cold-split", 2);
+    pass->run = fn_cold_split;
+}
+
+/* Enable the passes up to the optimization level 'level' */
+void set_opt_level(int level)
+{
+    opt_level = level;
+    for (int i = 0; i < passes_idx; i++)
+        PASSES[i].enabled = PASSES[i].level <= level;
+}
+
+/* Enable or disable the pass 'name'. Return false, after a message has been
+ * printed, if there is no such pass, or if it cannot be disabled.
+ */
+bool set_pass(char *name, bool enabled)
+{
+    for (int i = 0; i < passes_idx; i++) {
+        pass_t *pass = &PASSES[i];
+        if (strcmp(pass->name, name))
+            continue;
+        if (!pass->level && !enabled) {
+            printf("The pass '%s' is required\n", name);
+            return false;
+        }
+        pass->enabled = enabled;
+        return true;
+    }
+    printf("Unknown pass '%s'\n", name);
+    return false;
+}
+
+int count_insns(fn_t *fn)
+{
+    int n = 0;
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next)
+            n++;
+    }
+    return n;
+}
+
+int count_ph2_insns(fn_t *fn)
+{
+    int n = 0;
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (ph2_ir_t *ph2_ir = bb->ph2_ir_list.head; ph2_ir;
+             ph2_ir = ph2_ir->next)
+            n++;
+    }
+    return n;
+}
+
+void verify_failed(pass_t *pass, fn_t *fn, char *msg)
+{
+    printf("IR verification failed after '%s' in '%s': %s\n", pass->name,
+           fn->func->return_def.var_name, msg);
+    abort();
+}
+
+/* Check the consistency of the IR of 'fn' after the pass 'pass' */
+void verify_fn(pass_t *pass, fn_t *fn)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        insn_t *last = NULL;
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (insn->prev != last)
+                verify_failed(pass, fn, "broken instruction list");
+            if (insn->opcode == OP_phi)
+                verify_failed(pass, fn, "phi function left");
+            last = insn;
+        }
+        if (bb->insn_list.tail != last)
+            verify_failed(pass, fn, "wrong tail of instruction list");
+
+        ph2_ir_t *last_ph2 = NULL;
+        for (ph2_ir_t *ph2_ir = bb->ph2_ir_list.head; ph2_ir;
+             ph2_ir = ph2_ir->next)
+            last_ph2 = ph2_ir;
+        if (bb->ph2_ir_list.tail != last_ph2)
+            verify_failed(pass, fn, "wrong tail of second phase IR list");
+
+        for (int i = 0; i < 3; i++) {
+            basic_block_t *succ = bb->next;
+            if (i == 1)
+                succ = bb->then_;
+            if (i == 2)
+                succ = bb->else_;
+            if (!succ)
+                continue;
+
+            bool found = false;
+            for (int j = 0; j < MAX_BB_PRED; j++) {
+                if (succ->prev[j].bb == bb)
+                    found = true;
+            }
+            if (!found)
+                verify_failed(pass, fn, "successor without predecessor");
+        }
+    }
+}
+
+#ifdef __SHECC__
+int pass_clock()
+{
+    return 0;
+}
+#else
+/* in microseconds since the first call */
+time_t clock_base;
+
+int pass_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (!clock_base)
+        clock_base = ts.tv_sec;
+    return (ts.tv_sec - clock_base) * 1000000 + ts.tv_nsec / 1000;
+}
+#endif
+
+/* Run the enabled passes of index 'first' up to 'last', excluded, on 'fn' */
+void run_passes(fn_t *fn, int first, int last)
+{
+    for (int i = first; i < last; i++) {
+        pass_t *pass = &PASSES[i];
+        if (!pass->enabled)
+            continue;
+
+        int start = 0;
+        if (pass_stats)
+            start = pass_clock();
+
+        pass->run(fn);
+
+        if (pass_stats) {
+            int usec = pass_clock() - start;
+            int insns = count_insns(fn);
+            int ph2 = count_ph2_insns(fn);
+#ifdef __SHECC__
+#else
+            pthread_mutex_lock(&shared_lock);
+#endif
+            pass->fns++;
+            pass->insns += insns;
+            pass->ph2 += ph2;
+            pass->usec += usec;
+#ifdef __SHECC__
+#else
+            pthread_mutex_unlock(&shared_lock);
+#endif
+        }
+
+        if (verify_ir)
+            verify_fn(pass, fn);
+    }
+}
+
+/* Print the counters of the passes for the program just compiled, and reset
+ * them for the next one.
+ */
+void print_pass_stats()
+{
+    printf("pass               fns     insns       ph2      usec\n");
+    for (int i = 0; i < passes_idx; i++) {
+        pass_t *pass = &PASSES[i];
+        printf("%s", pass->name);
+        for (int j = strlen(pass->name); j < 12; j++)
+            printf(" ");
+        if (pass->enabled)
+            printf("%10d%10d%10d%10d\n", pass->fns, pass->insns, pass->ph2,
+                   pass->usec);
+        else
+            printf("  disabled\n");
+
+        pass->fns = 0;
+        pass->insns = 0;
+        pass->ph2 = 0;
+        pass->usec = 0;
+    }
+
+    printf("peephole rule     hits\n");
+    for (int i = 0; i < rules_idx; i++) {
+        peephole_rule_t *rule = &RULES[i];
+        printf("%s", rule->name);
+        for (int j = strlen(rule->name); j < 14; j++)
+            printf(" ");
+        printf("%8d\n", rule->hits);
+        rule->hits = 0;
+    }
+}
@@ -5,6 +5,204 @@
  * file "LICENSE" for information on usage and redistribution of this file.
  */
 
+/* The peephole optimizer applies a table of rules to the allocated
+ * instructions of each block, in turn from each instruction. A rule matches
+ * a few instructions from there, or looks up to MAX_WINDOW instructions
+ * ahead, and rewrites them. The rules are tried in the order of the table,
+ * each one once on an instruction, and all of them again on the instruction
+ * following one they remove.
+ *
+ * The register allocation spills and reloads around each call and at the
+ * ends of the blocks, and moves the result of an operation to the register
+ * of its variable, which leaves most of the work to the rules.
+ */
+
+peephole_rule_t RULES[MAX_RULES];
+int rules_idx = 0;
+
+/* Whether 'ph2_ir' is a plain operation or transfer, whose registers and
+ * memory are told by the functions below. The others, like the calls and
+ * the branches, may read or write any of them.
+ */
+bool ph2_plain(ph2_ir_t *ph2_ir)
+{
+    /* the instructions of a branch merged by if-conversion may not run */
+    if (ph2_ir->pred != NEXT)
+        return false;
+
+    switch (ph2_ir->op) {
+    case OP_load_constant:
+    case OP_load_data_address:
+    case OP_address_of:
+    case OP_global_address_of:
+    case OP_assign:
+    case OP_load:
+    case OP_store:
+    case OP_global_load:
+    case OP_global_store:
+    case OP_read:
+    case OP_read_inc:
+    case OP_write:
+    case OP_add:
+    case OP_sub:
+    case OP_mul:
+    case OP_div:
+    case OP_mod:
+    case OP_lshift:
+    case OP_rshift:
+    case OP_eq:
+    case OP_neq:
+    case OP_gt:
+    case OP_geq:
+    case OP_lt:
+    case OP_leq:
+    case OP_bit_and:
+    case OP_bit_or:
+    case OP_bit_xor:
+    case OP_log_and:
+    case OP_log_or:
+    case OP_negate:
+    case OP_bit_not:
+    case OP_log_not:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Registers written by the plain instruction 'ph2_ir', as a mask */
+int ph2_defs(ph2_ir_t *ph2_ir)
+{
+    switch (ph2_ir->op) {
+    case OP_store:
+    case OP_global_store:
+    case OP_write:
+        return 0;
+    case OP_read_inc:
+        return (1 << ph2_ir->dest) | (1 << ph2_ir->src0);
+    case OP_div:
+    case OP_mod:
+        /* the division without hardware support of ARM overwrites its
+         * operands
+         */
+        return (1 << ph2_ir->dest) | (1 << ph2_ir->src0) | (1 << ph2_ir->src1);
+    default:
+        return 1 << ph2_ir->dest;
+    }
+}
+
+/* Registers read by the plain instruction 'ph2_ir', as a mask */
+int ph2_uses(ph2_ir_t *ph2_ir)
+{
+    switch (ph2_ir->op) {
+    case OP_load_constant:
+    case OP_load_data_address:
+    case OP_address_of:
+    case OP_global_address_of:
+    case OP_load:
+    case OP_global_load:
+        return 0;
+    case OP_assign:
+    case OP_store:
+    case OP_global_store:
+    case OP_read:
+    case OP_read_inc:
+    case OP_negate:
+    case OP_bit_not:
+    case OP_log_not:
+        return 1 << ph2_ir->src0;
+    default:
+        return (1 << ph2_ir->src0) | (1 << ph2_ir->src1);
+    }
+}
+
+/* Whether the plain instruction 'ph2_ir' reads or writes memory */
+bool ph2_loads(ph2_ir_t *ph2_ir)
+{
+    return (ph2_ir->op == OP_load) | (ph2_ir->op == OP_global_load) |
+           (ph2_ir->op == OP_read) | (ph2_ir->op == OP_read_inc);
+}
+
+bool ph2_stores(ph2_ir_t *ph2_ir)
+{
+    return (ph2_ir->op == OP_store) | (ph2_ir->op == OP_global_store) |
+           (ph2_ir->op == OP_write);
+}
+
+/* The slot of the stack or of the global variables 'ph2_ir' transfers, or
+ * -1 if it goes through a pointer, which may reach any of them.
+ */
+int ph2_slot(ph2_ir_t *ph2_ir)
+{
+    switch (ph2_ir->op) {
+    case OP_load:
+    case OP_global_load:
+        return ph2_ir->src0;
+    case OP_store:
+    case OP_global_store:
+        return ph2_ir->src1;
+    default:
+        return -1;
+    }
+}
+
+bool ph2_global(ph2_ir_t *ph2_ir)
+{
+    return (ph2_ir->op == OP_global_load) | (ph2_ir->op == OP_global_store);
+}
+
+/* Whether the transfers 'a' and 'b' may reach the same memory */
+bool ph2_may_alias(ph2_ir_t *a, ph2_ir_t *b)
+{
+    if ((ph2_slot(a) == -1) | (ph2_slot(b) == -1))
+        return true;
+    if (ph2_global(a) != ph2_global(b))
+        return false;
+    return ph2_slot(a) == ph2_slot(b);
+}
+
+/* Whether 'a' and 'b' transfer the very same slot */
+bool ph2_same_slot(ph2_ir_t *a, ph2_ir_t *b)
+{
+    if ((ph2_slot(a) == -1) | (ph2_slot(b) == -1))
+        return false;
+    return ph2_may_alias(a, b);
+}
+
+void remove_ph2_ir(basic_block_t *bb, ph2_ir_t *prev, ph2_ir_t *ph2_ir)
+{
+    if (prev)
+        prev->next = ph2_ir->next;
+    else
+        bb->ph2_ir_list.head = ph2_ir->next;
+    if (bb->ph2_ir_list.tail == ph2_ir)
+        bb->ph2_ir_list.tail = prev;
+}
+
+/* Replace the load 'ld' of a value already in the register 'reg' with a
+ * move, or remove it if it loads the value into the register itself.
+ */
+void replace_load(basic_block_t *bb, ph2_ir_t *prev, ph2_ir_t *ld, int reg)
+{
+    if (ld->dest == reg) {
+        remove_ph2_ir(bb, prev, ld);
+        return;
+    }
+    ld->op = OP_assign;
+    ld->src0 = reg;
+}
+
+/* mv rX, rX */
+bool rule_self_move(basic_block_t *bb, ph2_ir_t *prev, ph2_ir_t *ph2_ir)
+{
+    if (ph2_ir->op != OP_assign)
+        return false;
+    if (ph2_ir->dest != ph2_ir->src0)
+        return false;
+    remove_ph2_ir(bb, prev, ph2_ir);
+    return true;
+}
+
 bool is_fusible_insn(ph2_ir_t *ph2_ir)
 {
     switch (ph2_ir->op) {
@@ -31,40 +229,275 @@ bool is_fusible_insn(ph2_ir_t *ph2_ir)
     }
 }
 
-void insn_fusion(ph2_ir_t *ph2_ir)
+/* {ALU rn, rs1, rs2; mv rd, rn;} into {ALU rd, rs1, rs2;} */
+bool rule_alu_move(basic_block_t *bb, ph2_ir_t *prev, ph2_ir_t *ph2_ir)
 {
+    UNUSED(prev);
+
     ph2_ir_t *next = ph2_ir->next;
     if (!next)
-        return;
+        return false;
+    if (next->op != OP_assign)
+        return false;
+    if (!is_fusible_insn(ph2_ir))
+        return false;
+    if (ph2_ir->dest != next->src0)
+        return false;
+    ph2_ir->dest = next->dest;
+    remove_ph2_ir(bb, ph2_ir, next);
+    return true;
+}
 
-    if (next->op == OP_assign) {
-        /* eliminate {ALU rn, rs1, rs2; mv rd, rn;} */
-        if (!is_fusible_insn(ph2_ir))
-            return;
-        if (ph2_ir->dest == next->src0) {
-            ph2_ir->dest = next->dest;
-            ph2_ir->next = next->next;
-            return;
-        }
+/* Replace the loads of the slot of 'ph2_ir' following it with moves from
+ * 'reg', which holds the value of the slot, as long as it does.
+ */
+bool forward_slot(basic_block_t *bb, ph2_ir_t *ph2_ir, int reg)
+{
+    bool forwarded = false;
+    ph2_ir_t *p = ph2_ir;
+    ph2_ir_t *next = ph2_ir->next;
+    for (int i = 0; i < MAX_WINDOW; i++) {
+        if (!next)
+            break;
+        if (!ph2_plain(next))
+            break;
+        if (ph2_stores(next))
+            if (ph2_may_alias(ph2_ir, next))
+                break;
+        if (ph2_loads(next))
+            if (ph2_same_slot(ph2_ir, next)) {
+                forwarded = true;
+                replace_load(bb, p, next, reg);
+                next = p->next;
+                continue;
+            }
+        if (ph2_defs(next) & (1 << reg))
+            break;
+        p = next;
+        next = next->next;
+    }
+    return forwarded;
+}
+
+/* {store rX, slot; ...; load rY, slot;} into {store rX, slot; ...; mv rY,
+ * rX;}
+ */
+bool rule_store_load(basic_block_t *bb, ph2_ir_t *prev, ph2_ir_t *ph2_ir)
+{
+    UNUSED(prev);
+
+    if ((ph2_ir->op != OP_store) & (ph2_ir->op != OP_global_store))
+        return false;
+    return forward_slot(bb, ph2_ir, ph2_ir->src0);
+}
+
+/* {load rX, slot; ...; load rY, slot;} into {load rX, slot; ...; mv rY, rX;}
+ * as the register allocation reloads the variables it has just spilled.
+ */
+bool rule_reload(basic_block_t *bb, ph2_ir_t *prev, ph2_ir_t *ph2_ir)
+{
+    UNUSED(prev);
+
+    if ((ph2_ir->op != OP_load) & (ph2_ir->op != OP_global_load))
+        return false;
+    return forward_slot(bb, ph2_ir, ph2_ir->dest);
+}
+
+/* {store rX, slot; ...; store rY, slot;} into {...; store rY, slot;} */
+bool rule_dead_store(basic_block_t *bb, ph2_ir_t *prev, ph2_ir_t *ph2_ir)
+{
+    if ((ph2_ir->op != OP_store) & (ph2_ir->op != OP_global_store))
+        return false;
+
+    ph2_ir_t *next = ph2_ir->next;
+    for (int i = 0; i < MAX_WINDOW; i++) {
+        if (!next)
+            return false;
+        if (!ph2_plain(next))
+            return false;
+        if (ph2_loads(next))
+            if (ph2_may_alias(ph2_ir, next))
+                return false;
+        if (ph2_stores(next))
+            if (ph2_same_slot(ph2_ir, next)) {
+                remove_ph2_ir(bb, prev, ph2_ir);
+                return true;
+            }
+        next = next->next;
+    }
+    return false;
+}
+
+/* The block a jump to 'bb' ends up in, past the blocks which only jump, or
+ * NULL if they jump around in a loop.
+ */
+basic_block_t *jump_target(basic_block_t *bb)
+{
+    for (int i = 0; i < MAX_WINDOW; i++) {
+        ph2_ir_t *head = bb->ph2_ir_list.head;
+        if (!head)
+            return bb;
+        if (head->op != OP_jump)
+            return bb;
+        bb = head->next_bb;
     }
-    /* other insn fusions */
+    return NULL;
+}
+
+/* {j L1; ...; L1: j L2;} into {j L2; ...; L1: j L2;}, and likewise for the
+ * target of a branch which does not follow it, as the code generators fall
+ * through to the other one.
+ */
+bool rule_jump_thread(basic_block_t *bb, ph2_ir_t *prev, ph2_ir_t *ph2_ir)
+{
+    UNUSED(prev);
+
+    basic_block_t *target;
+    bool threaded = false;
+
+    if (ph2_ir->op == OP_jump) {
+        target = jump_target(ph2_ir->next_bb);
+        if (!target)
+            return false;
+        if (target == ph2_ir->next_bb)
+            return false;
+        ph2_ir->next_bb = target;
+        return true;
+    }
+    if (ph2_ir->op != OP_branch)
+        return false;
+
+    if (ph2_ir->then_bb != bb->rpo_next) {
+        target = jump_target(ph2_ir->then_bb);
+        if (target)
+            if (target != ph2_ir->then_bb) {
+                ph2_ir->then_bb = target;
+                threaded = true;
+            }
+    }
+    if (ph2_ir->else_bb != bb->rpo_next) {
+        target = jump_target(ph2_ir->else_bb);
+        if (target)
+            if (target != ph2_ir->else_bb) {
+                ph2_ir->else_bb = target;
+                threaded = true;
+            }
+    }
+    return threaded;
+}
+
+/* {j L1; L1:} into {L1:} */
+bool rule_jump_next(basic_block_t *bb, ph2_ir_t *prev, ph2_ir_t *ph2_ir)
+{
+    if (ph2_ir->op != OP_jump)
+        return false;
+    if (ph2_ir->next_bb != bb->rpo_next)
+        return false;
+    remove_ph2_ir(bb, prev, ph2_ir);
+    return true;
+}
+
+/* {br rX, L1, L2; j L2; L1:}, which the code generators emit when the block
+ * following the branch is not the one reached if rX is 0, into {brz rX, L2,
+ * L1; L1:}
+ */
+bool rule_branch_invert(basic_block_t *bb, ph2_ir_t *prev, ph2_ir_t *ph2_ir)
+{
+    UNUSED(prev);
+
+    if (ph2_ir->op != OP_branch)
+        return false;
+    if (ph2_ir->then_bb != bb->rpo_next)
+        return false;
+    if (ph2_ir->else_bb == bb->rpo_next)
+        return false;
+
+    basic_block_t *then_bb = ph2_ir->then_bb;
+    ph2_ir->then_bb = ph2_ir->else_bb;
+    ph2_ir->else_bb = then_bb;
+    ph2_ir->is_branch_inverted = !ph2_ir->is_branch_inverted;
+    return true;
+}
+
+peephole_rule_t *add_rule(char *name)
+{
+    if (rules_idx == MAX_RULES) {
+        printf("Too many peephole rules\n");
+        abort();
+    }
+
+    peephole_rule_t *rule = &RULES[rules_idx++];
+    strcpy(rule->name, name);
+    return rule;
+}
+
+void register_peephole_rules()
+{
+    peephole_rule_t *rule = add_rule("self-move");
+    rule->apply = rule_self_move;
+    rule = add_rule("alu-move");
+    rule->apply = rule_alu_move;
+    rule = add_rule("store-load");
+    rule->apply = rule_store_load;
+    rule = add_rule("reload");
+    rule->apply = rule_reload;
+    rule = add_rule("dead-store");
+    rule->apply = rule_dead_store;
+    rule = add_rule("jump-thread");
+    rule->apply = rule_jump_thread;
+    rule = add_rule("jump-next");
+    rule->apply = rule_jump_next;
+    rule = add_rule("branch-invert");
+    rule->apply = rule_branch_invert;
 }
 
 /* FIXME: release detached basic blocks */
-void peephole()
-{
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
-            for (ph2_ir_t *ir = bb->ph2_ir_list.head; ir; ir = ir->next) {
-                ph2_ir_t *next = ir->next;
-                if (!next)
-                    continue;
-                if (next->op == OP_assign && next->dest == next->src0) {
-                    ir->next = next->next;
-                    continue;
-                }
-                insn_fusion(ir);
+void fn_peephole(fn_t *fn)
+{
+    int hits[MAX_RULES];
+    for (int i = 0; i < rules_idx; i++)
+        hits[i] = 0;
+
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        ph2_ir_t *prev = NULL;
+        ph2_ir_t *ph2_ir = bb->ph2_ir_list.head;
+        int i = 0;
+        while (ph2_ir) {
+            if (i == rules_idx) {
+                prev = ph2_ir;
+                ph2_ir = ph2_ir->next;
+                i = 0;
+                continue;
             }
+            peephole_rule_t *rule = &RULES[i++];
+            if (!rule->apply(bb, prev, ph2_ir))
+                continue;
+            hits[i - 1]++;
+
+            /* all the rules again on the instruction following a removed
+             * one
+             */
+            ph2_ir_t *next = bb->ph2_ir_list.head;
+            if (prev)
+                next = prev->next;
+            if (next != ph2_ir)
+                i = 0;
+            ph2_ir = next;
         }
     }
+
+    if (!pass_stats)
+        return;
+#ifdef __SHECC__
+#else
+    pthread_mutex_lock(&shared_lock);
+#endif
+    for (int i = 0; i < rules_idx; i++) {
+        peephole_rule_t *rule = &RULES[i];
+        rule->hits += hits[i];
+    }
+#ifdef __SHECC__
+#else
+    pthread_mutex_unlock(&shared_lock);
+#endif
 }
@@ -8,8 +8,8 @@
 /* Allocate registers from IR. The linear-scan algorithm now expects a minimum
  * of 7 available registers (typical for RISC-style architectures).
  *
- * TODO: Implement the "-O level" option. This allocator now always drops the
- * dead variable and does NOT wrtie it back to the stack.
+ * The allocator always drops the dead variable and does NOT write it back to
+ * the stack, whatever the optimization level.
  */
 
 bool check_live_out(basic_block_t *bb, var_t *var)
@@ -217,13 +217,101 @@ void spill_live_out(basic_block_t *bb)
 /* The operand of 'OP_push' should not been killed until function called. */
 void extend_liveness(basic_block_t *bb, insn_t *insn, var_t *var, int offset)
 {
+    /* global variables have been extended by the liveness analysis */
+    if (var->is_global)
+        return;
     if (check_live_out(bb, var))
         return;
     if (insn->idx + offset > var->consumed)
         var->consumed = insn->idx + offset;
 }
 
-void reg_alloc()
+/* Whether the read 'insn', from the address in register 'reg', is followed
+ * by the step of the address by the size read, which a post-indexed read
+ * makes as well. The register may hold the stepped address then, unless the
+ * address is needed afterwards and is not in memory.
+ */
+bool read_steps_address(basic_block_t *bb, insn_t *insn, int reg)
+{
+    insn_t *size = insn->next;
+    if (!size)
+        return false;
+    if (size->opcode != OP_load_constant)
+        return false;
+    if (size->rd->init_val != insn->sz)
+        return false;
+    insn_t *step = size->next;
+    if (!step)
+        return false;
+    if (step->opcode != OP_add)
+        return false;
+    if ((step->rs1 != insn->rs1) | (step->rs2 != size->rd))
+        return false;
+    if (step->rd->is_global | insn->rs1->is_global)
+        return false;
+    if (size->rd->consumed != step->idx)
+        return false;
+    if (check_live_out(bb, size->rd))
+        return false;
+
+    if (!REGS[reg].polluted)
+        return true;
+    if (check_live_out(bb, insn->rs1))
+        return false;
+    return insn->rs1->consumed <= step->idx;
+}
+
+/* The last global instruction whose variable has been given its offset */
+insn_t *global_alloc_insn;
+
+/* Assign the offsets of the global variables declared since the last call.
+ * Functions are allocated right after they are parsed in function-at-a-time
+ * mode, by then only the globals declared before them are known.
+ */
+void global_var_alloc()
+{
+    insn_t *global_insn = GLOBAL_FUNC.fn->bbs->insn_list.head;
+    if (global_alloc_insn)
+        global_insn = global_alloc_insn->next;
+
+    for (; global_insn; global_insn = global_insn->next) {
+        global_alloc_insn = global_insn;
+
+        if (global_insn->opcode != OP_allocat)
+            continue;
+
+        /* The functions which read it might not have been parsed yet, so its
+         * assignments are kept as if it was read until the end of any block.
+         */
+        if (fn_at_a_time)
+            global_insn->rd->consumed = MAX_IR_INSTR;
+
+        global_insn->rd->offset = GLOBAL_FUNC.stack_size;
+        if (global_insn->rd->array_size) {
+            GLOBAL_FUNC.stack_size += PTR_SIZE;
+            if (global_insn->rd->is_ptr)
+                GLOBAL_FUNC.stack_size +=
+                    (PTR_SIZE * global_insn->rd->array_size);
+            else {
+                type_t *type = find_type(global_insn->rd->type_name, 0);
+                GLOBAL_FUNC.stack_size +=
+                    (global_insn->rd->array_size * type->size);
+            }
+        } else if (global_insn->rd->is_ptr)
+            GLOBAL_FUNC.stack_size += PTR_SIZE;
+        else if (strcmp(global_insn->rd->type_name, "int") &&
+                 strcmp(global_insn->rd->type_name, "char") &&
+                 strcmp(global_insn->rd->type_name, "_Bool")) {
+            type_t *type = find_type(global_insn->rd->type_name, 0);
+            GLOBAL_FUNC.stack_size += type->size;
+        } else
+            /* 'char' is aligned to one byte for the convenience */
+            GLOBAL_FUNC.stack_size += 4;
+    }
+}
+
+/* Generate the initialization of the global variables */
+void global_reg_alloc()
 {
     /* TODO: .bss and .data section */
     for (insn_t *global_insn = GLOBAL_FUNC.fn->bbs->insn_list.head; global_insn;
@@ -234,17 +322,8 @@ void reg_alloc()
         switch (global_insn->opcode) {
         case OP_allocat:
             if (global_insn->rd->array_size) {
-                global_insn->rd->offset = GLOBAL_FUNC.stack_size;
-                GLOBAL_FUNC.stack_size += PTR_SIZE;
-                src0 = GLOBAL_FUNC.stack_size;
-                if (global_insn->rd->is_ptr)
-                    GLOBAL_FUNC.stack_size +=
-                        (PTR_SIZE * global_insn->rd->array_size);
-                else {
-                    type_t *type = find_type(global_insn->rd->type_name, 0);
-                    GLOBAL_FUNC.stack_size +=
-                        (global_insn->rd->array_size * type->size);
-                }
+                /* the elements follow the pointer to them */
+                src0 = global_insn->rd->offset + PTR_SIZE;
 
                 dest =
                     prepare_dest(GLOBAL_FUNC.fn->bbs, global_insn->rd, -1, -1);
@@ -252,18 +331,6 @@ void reg_alloc()
                 ir->src0 = src0;
                 ir->dest = dest;
                 spill_var(GLOBAL_FUNC.fn->bbs, global_insn->rd, dest);
-            } else {
-                global_insn->rd->offset = GLOBAL_FUNC.stack_size;
-                if (global_insn->rd->is_ptr)
-                    GLOBAL_FUNC.stack_size += PTR_SIZE;
-                else if (strcmp(global_insn->rd->type_name, "int") &&
-                         strcmp(global_insn->rd->type_name, "char") &&
-                         strcmp(global_insn->rd->type_name, "_Bool")) {
-                    type_t *type = find_type(global_insn->rd->type_name, 0);
-                    GLOBAL_FUNC.stack_size += type->size;
-                } else
-                    /* 'char' is aligned to one byte for the convenience */
-                    GLOBAL_FUNC.stack_size += 4;
             }
             break;
         case OP_load_constant:
@@ -288,490 +355,534 @@ void reg_alloc()
             abort();
         }
     }
+}
 
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        fn->visited++;
+/* Size of the stack frame of 'fn', below the stack pointer of its caller.
+ * It holds the stack of 'fn' and the return address, which a leaf function
+ * keeps in its register instead. A leaf function without any stack slot
+ * has no frame at all.
+ */
+int frame_size(fn_t *fn)
+{
+    if (!fn->is_leaf)
+        return fn->func->stack_size + 4;
+    if (fn->func->stack_size == 4)
+        return 0;
+    return fn->func->stack_size;
+}
 
-        if (!strcmp(fn->func->return_def.var_name, "main"))
-            MAIN_BB = fn->bbs;
+void fn_reg_alloc(fn_t *fn)
+{
+    fn->visited++;
+    fn->is_leaf = true;
 
-        for (int i = 0; i < REG_CNT; i++)
-            REGS[i].var = NULL;
+    for (int i = 0; i < REG_CNT; i++)
+        REGS[i].var = NULL;
 
-        /* set arguments available */
-        for (int i = 0; i < fn->func->num_params; i++) {
-            REGS[i].var = fn->func->param_defs[i].subscripts[0];
-            REGS[i].polluted = 1;
-        }
+    /* set arguments available */
+    for (int i = 0; i < fn->func->num_params; i++) {
+        REGS[i].var = fn->func->param_defs[i].subscripts[0];
+        REGS[i].polluted = 1;
+    }
 
-        /* variadic function implementation */
-        if (fn->func->va_args) {
-            for (int i = 0; i < MAX_PARAMS; i++) {
-                ph2_ir_t *ir = bb_add_ph2_ir(fn->bbs, OP_store);
+    /* variadic function implementation */
+    if (fn->func->va_args) {
+        for (int i = 0; i < MAX_PARAMS; i++) {
+            ph2_ir_t *ir = bb_add_ph2_ir(fn->bbs, OP_store);
 
-                if (i < fn->func->num_params)
-                    fn->func->param_defs[i].subscripts[0]->offset =
-                        fn->func->stack_size;
+            if (i < fn->func->num_params)
+                fn->func->param_defs[i].subscripts[0]->offset =
+                    fn->func->stack_size;
 
-                ir->src0 = i;
-                ir->src1 = fn->func->stack_size;
-                fn->func->stack_size += 4;
-            }
+            ir->src0 = i;
+            ir->src1 = fn->func->stack_size;
+            fn->func->stack_size += 4;
         }
+    }
 
-        for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
-            int is_pushing_args = 0, args = 0;
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        int is_pushing_args = 0, args = 0;
 
-            bb->visited++;
+        bb->visited++;
 
-            for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
-                func_t *func;
-                ph2_ir_t *ir;
-                int dest, src0, src1;
-                int sz, clear_reg;
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            func_t *func;
+            ph2_ir_t *ir;
+            int dest, src0, src1;
+            int sz, clear_reg;
 
-                refresh(bb, insn);
+            refresh(bb, insn);
 
-                switch (insn->opcode) {
-                case OP_unwound_phi:
-                    src0 = prepare_operand(bb, insn->rs1, -1);
+            switch (insn->opcode) {
+            case OP_unwound_phi:
+                src0 = prepare_operand(bb, insn->rs1, -1);
 
-                    if (!insn->rd->offset) {
-                        insn->rd->offset = bb->belong_to->func->stack_size;
-                        bb->belong_to->func->stack_size += 4;
-                    }
-
-                    ir = bb_add_ph2_ir(bb, OP_store);
-                    ir->src0 = src0;
-                    ir->src1 = insn->rd->offset;
-                    break;
-                case OP_allocat:
-                    if ((!strcmp(insn->rd->type_name, "void") ||
-                         !strcmp(insn->rd->type_name, "int") ||
-                         !strcmp(insn->rd->type_name, "char") ||
-                         !strcmp(insn->rd->type_name, "_Bool")) &&
-                        insn->rd->array_size == 0)
-                        break;
-
-                    insn->rd->offset = fn->func->stack_size;
-                    fn->func->stack_size += PTR_SIZE;
-                    src0 = fn->func->stack_size;
-
-                    if (insn->rd->is_ptr)
-                        sz = PTR_SIZE;
-                    else {
-                        type_t *type = find_type(insn->rd->type_name, 0);
-                        sz = type->size;
-                    }
-
-                    if (insn->rd->array_size)
-                        fn->func->stack_size += (insn->rd->array_size * sz);
-                    else
-                        fn->func->stack_size += sz;
-
-                    dest = prepare_dest(bb, insn->rd, -1, -1);
-                    ir = bb_add_ph2_ir(bb, OP_address_of);
-                    ir->src0 = src0;
-                    ir->dest = dest;
-                    break;
-                case OP_load_constant:
-                case OP_load_data_address:
-                    if (insn->rd->consumed == -1)
-                        break;
-
-                    dest = prepare_dest(bb, insn->rd, -1, -1);
-                    ir = bb_add_ph2_ir(bb, insn->opcode);
-                    ir->src0 = insn->rd->init_val;
-                    ir->dest = dest;
-
-                    /* store global variable immediately after assignment */
-                    if (insn->rd->is_global) {
-                        ir = bb_add_ph2_ir(bb, OP_global_store);
-                        ir->src0 = dest;
-                        ir->src1 = insn->rd->offset;
-                        REGS[dest].polluted = 0;
-                    }
+                if (!insn->rd->offset) {
+                    insn->rd->offset = bb->belong_to->func->stack_size;
+                    bb->belong_to->func->stack_size += 4;
+                }
 
+                ir = bb_add_ph2_ir(bb, OP_store);
+                ir->src0 = src0;
+                ir->src1 = insn->rd->offset;
+                break;
+            case OP_allocat:
+                if ((!strcmp(insn->rd->type_name, "void") ||
+                     !strcmp(insn->rd->type_name, "int") ||
+                     !strcmp(insn->rd->type_name, "char") ||
+                     !strcmp(insn->rd->type_name, "_Bool")) &&
+                    insn->rd->array_size == 0)
                     break;
-                case OP_address_of:
-                    /* make sure variable is on stack */
-                    if (!insn->rs1->offset) {
-                        insn->rs1->offset = bb->belong_to->func->stack_size;
-                        bb->belong_to->func->stack_size += 4;
-
-                        for (int i = 0; i < REG_CNT; i++)
-                            if (REGS[i].var == insn->rs1) {
-                                ir = bb_add_ph2_ir(bb, OP_store);
-                                ir->src0 = i;
-                                ir->src1 = insn->rs1->offset;
-                            }
-                    }
-
-                    dest = prepare_dest(bb, insn->rd, -1, -1);
-                    if (insn->rs1->is_global)
-                        ir = bb_add_ph2_ir(bb, OP_global_address_of);
-                    else
-                        ir = bb_add_ph2_ir(bb, OP_address_of);
-                    ir->src0 = insn->rs1->offset;
-                    ir->dest = dest;
-                    break;
-                case OP_assign:
-                    if (insn->rd->consumed == -1)
-                        break;
-
-                    src0 = find_in_regs(insn->rs1);
 
-                    /* If operand is loaded from stack, clear the original slot
-                     * after moving.
-                     */
-                    if (src0 > -1)
-                        clear_reg = 0;
-                    else {
-                        clear_reg = 1;
-                        src0 = prepare_operand(bb, insn->rs1, -1);
-                    }
-                    dest = prepare_dest(bb, insn->rd, src0, -1);
-                    ir = bb_add_ph2_ir(bb, OP_assign);
-                    ir->src0 = src0;
-                    ir->dest = dest;
+                insn->rd->offset = fn->func->stack_size;
+                fn->func->stack_size += PTR_SIZE;
+                src0 = fn->func->stack_size;
 
-                    /* store global variable immediately after assignment */
-                    if (insn->rd->is_global) {
-                        ir = bb_add_ph2_ir(bb, OP_global_store);
-                        ir->src0 = dest;
-                        ir->src1 = insn->rd->offset;
-                        REGS[dest].polluted = 0;
-                    }
-
-                    if (clear_reg)
-                        REGS[src0].var = NULL;
-
-                    break;
-                case OP_read:
-                    src0 = prepare_operand(bb, insn->rs1, -1);
-                    dest = prepare_dest(bb, insn->rd, src0, -1);
-                    ir = bb_add_ph2_ir(bb, OP_read);
-                    ir->src0 = src0;
-                    ir->src1 = insn->sz;
-                    ir->dest = dest;
-                    break;
-                case OP_write:
-                    if (insn->rs2->is_func) {
-                        src0 = prepare_operand(bb, insn->rs1, -1);
-                        ir = bb_add_ph2_ir(bb, OP_address_of_func);
-                        ir->src0 = src0;
-                        strcpy(ir->func_name, insn->rs2->var_name);
-                    } else {
-                        /* FIXME: Avoid outdated content in register after
-                         * storing, but causing some redundant spilling.
-                         */
-                        spill_alive(bb, insn);
-                        src0 = prepare_operand(bb, insn->rs1, -1);
-                        src1 = prepare_operand(bb, insn->rs2, src0);
-                        ir = bb_add_ph2_ir(bb, OP_write);
-                        ir->src0 = src0;
-                        ir->src1 = src1;
-                        ir->dest = insn->sz;
-                    }
-                    break;
-                case OP_branch:
-                    src0 = prepare_operand(bb, insn->rs1, -1);
+                if (insn->rd->is_ptr)
+                    sz = PTR_SIZE;
+                else {
+                    type_t *type = find_type(insn->rd->type_name, 0);
+                    sz = type->size;
+                }
 
-                    /* REGS[src0].var had been set to NULL, but the actual
-                     * content is still holded in the register.
-                     */
-                    spill_live_out(bb);
+                if (insn->rd->array_size)
+                    fn->func->stack_size += (insn->rd->array_size * sz);
+                else
+                    fn->func->stack_size += sz;
 
-                    ir = bb_add_ph2_ir(bb, OP_branch);
-                    ir->src0 = src0;
-                    ir->then_bb = bb->then_;
-                    ir->else_bb = bb->else_;
+                dest = prepare_dest(bb, insn->rd, -1, -1);
+                ir = bb_add_ph2_ir(bb, OP_address_of);
+                ir->src0 = src0;
+                ir->dest = dest;
+                break;
+            case OP_load_constant:
+            case OP_load_data_address:
+                if (insn->rd->consumed == -1)
                     break;
-                case OP_push:
-                    extend_liveness(bb, insn, insn->rs1, insn->sz);
 
-                    if (!is_pushing_args) {
-                        spill_alive(bb, insn);
-                        is_pushing_args = 1;
-                    }
-
-                    src0 = prepare_operand(bb, insn->rs1, -1);
-                    ir = bb_add_ph2_ir(bb, OP_assign);
-                    ir->src0 = src0;
-                    ir->dest = args++;
-                    REGS[ir->dest].var = insn->rs1;
-                    REGS[ir->dest].polluted = 0;
-                    break;
-                case OP_call:
-                    func = find_func(insn->str);
-                    if (!func->num_params)
-                        spill_alive(bb, insn);
+                dest = prepare_dest(bb, insn->rd, -1, -1);
+                ir = bb_add_ph2_ir(bb, insn->opcode);
+                ir->src0 = insn->rd->init_val;
+                ir->dest = dest;
 
-                    ir = bb_add_ph2_ir(bb, OP_call);
-                    strcpy(ir->func_name, insn->str);
+                /* store global variable immediately after assignment */
+                if (insn->rd->is_global) {
+                    ir = bb_add_ph2_ir(bb, OP_global_store);
+                    ir->src0 = dest;
+                    ir->src1 = insn->rd->offset;
+                    REGS[dest].polluted = 0;
+                }
 
-                    is_pushing_args = 0;
-                    args = 0;
+                break;
+            case OP_address_of:
+                /* make sure variable is on stack */
+                if (!insn->rs1->offset) {
+                    insn->rs1->offset = bb->belong_to->func->stack_size;
+                    bb->belong_to->func->stack_size += 4;
 
                     for (int i = 0; i < REG_CNT; i++)
-                        REGS[i].var = NULL;
+                        if (REGS[i].var == insn->rs1) {
+                            ir = bb_add_ph2_ir(bb, OP_store);
+                            ir->src0 = i;
+                            ir->src1 = insn->rs1->offset;
+                        }
+                }
 
+                dest = prepare_dest(bb, insn->rd, -1, -1);
+                if (insn->rs1->is_global)
+                    ir = bb_add_ph2_ir(bb, OP_global_address_of);
+                else
+                    ir = bb_add_ph2_ir(bb, OP_address_of);
+                ir->src0 = insn->rs1->offset;
+                ir->dest = dest;
+                break;
+            case OP_assign:
+                if (insn->rd->consumed == -1)
                     break;
-                case OP_indirect:
-                    if (!args)
-                        spill_alive(bb, insn);
 
+                src0 = find_in_regs(insn->rs1);
+
+                /* If operand is loaded from stack, clear the original slot
+                 * after moving.
+                 */
+                if (src0 > -1)
+                    clear_reg = 0;
+                else {
+                    clear_reg = 1;
                     src0 = prepare_operand(bb, insn->rs1, -1);
-                    ir = bb_add_ph2_ir(bb, OP_load_func);
-                    ir->src0 = src0;
+                }
+                dest = prepare_dest(bb, insn->rd, src0, -1);
+                ir = bb_add_ph2_ir(bb, OP_assign);
+                ir->src0 = src0;
+                ir->dest = dest;
+
+                /* store global variable immediately after assignment */
+                if (insn->rd->is_global) {
+                    ir = bb_add_ph2_ir(bb, OP_global_store);
+                    ir->src0 = dest;
+                    ir->src1 = insn->rd->offset;
+                    REGS[dest].polluted = 0;
+                }
 
-                    bb_add_ph2_ir(bb, OP_indirect);
+                if (clear_reg)
+                    REGS[src0].var = NULL;
 
-                    is_pushing_args = 0;
-                    args = 0;
+                break;
+            case OP_read:
+                src0 = prepare_operand(bb, insn->rs1, -1);
+                dest = prepare_dest(bb, insn->rd, src0, -1);
+                ir = bb_add_ph2_ir(bb, OP_read);
+                ir->src0 = src0;
+                ir->src1 = insn->sz;
+                ir->dest = dest;
+
+                /* the arguments pushed so far may share the register */
+                if (is_pushing_args)
                     break;
-                case OP_func_ret:
-                    dest = prepare_dest(bb, insn->rd, -1, -1);
-                    ir = bb_add_ph2_ir(bb, OP_assign);
-                    ir->src0 = 0;
-                    ir->dest = dest;
+                if (!read_steps_address(bb, insn, src0))
                     break;
-                case OP_return:
-                    if (insn->rs1)
-                        src0 = prepare_operand(bb, insn->rs1, -1);
-                    else
-                        src0 = -1;
-
-                    ir = bb_add_ph2_ir(bb, OP_return);
+                ir->op = OP_read_inc;
+                insn = insn->next->next;
+                REGS[src0].var = insn->rd;
+                REGS[src0].polluted = 1;
+                break;
+            case OP_write:
+                if (insn->rs2->is_func) {
+                    src0 = prepare_operand(bb, insn->rs1, -1);
+                    ir = bb_add_ph2_ir(bb, OP_address_of_func);
                     ir->src0 = src0;
-                    break;
-                case OP_add:
-                case OP_sub:
-                case OP_mul:
-                case OP_div:
-                case OP_mod:
-                case OP_lshift:
-                case OP_rshift:
-                case OP_eq:
-                case OP_neq:
-                case OP_gt:
-                case OP_geq:
-                case OP_lt:
-                case OP_leq:
-                case OP_bit_and:
-                case OP_bit_or:
-                case OP_bit_xor:
-                case OP_log_and:
-                case OP_log_or:
+                    strcpy(ir->func_name, insn->rs2->var_name);
+                } else {
+                    /* FIXME: Avoid outdated content in register after
+                     * storing, but causing some redundant spilling.
+                     */
+                    spill_alive(bb, insn);
                     src0 = prepare_operand(bb, insn->rs1, -1);
                     src1 = prepare_operand(bb, insn->rs2, src0);
-                    dest = prepare_dest(bb, insn->rd, src0, src1);
-                    ir = bb_add_ph2_ir(bb, insn->opcode);
+                    ir = bb_add_ph2_ir(bb, OP_write);
                     ir->src0 = src0;
                     ir->src1 = src1;
-                    ir->dest = dest;
-                    break;
-                case OP_negate:
-                case OP_bit_not:
-                case OP_log_not:
-                    src0 = prepare_operand(bb, insn->rs1, -1);
-                    dest = prepare_dest(bb, insn->rd, src0, -1);
-                    ir = bb_add_ph2_ir(bb, insn->opcode);
-                    ir->src0 = src0;
-                    ir->dest = dest;
-                    break;
-                default:
-                    printf("Unknown opcode\n");
-                    abort();
+                    ir->dest = insn->sz;
                 }
-            }
+                break;
+            case OP_branch:
+                src0 = prepare_operand(bb, insn->rs1, -1);
 
-            if (bb->next)
+                /* REGS[src0].var had been set to NULL, but the actual
+                 * content is still holded in the register.
+                 */
                 spill_live_out(bb);
 
-            if (bb == fn->exit)
-                continue;
+                ir = bb_add_ph2_ir(bb, OP_branch);
+                ir->src0 = src0;
+                ir->then_bb = bb->then_;
+                ir->else_bb = bb->else_;
+                break;
+            case OP_push:
+                extend_liveness(bb, insn, insn->rs1, insn->sz);
+
+                if (!is_pushing_args) {
+                    spill_alive(bb, insn);
+                    is_pushing_args = 1;
+                }
 
-            /* append jump instruction for the normal block only */
-            if (!bb->next)
-                continue;
+                src0 = prepare_operand(bb, insn->rs1, -1);
+                ir = bb_add_ph2_ir(bb, OP_assign);
+                ir->src0 = src0;
+                ir->dest = args++;
+                REGS[ir->dest].var = insn->rs1;
+                REGS[ir->dest].polluted = 0;
+                break;
+            case OP_call:
+                func = find_func(insn->str);
+                if (!func->num_params)
+                    spill_alive(bb, insn);
+
+                ir = bb_add_ph2_ir(bb, OP_call);
+                strcpy(ir->func_name, insn->str);
+                fn->is_leaf = false;
+
+                is_pushing_args = 0;
+                args = 0;
+
+                for (int i = 0; i < REG_CNT; i++)
+                    REGS[i].var = NULL;
+
+                break;
+            case OP_indirect:
+                if (!args)
+                    spill_alive(bb, insn);
+
+                src0 = prepare_operand(bb, insn->rs1, -1);
+                ir = bb_add_ph2_ir(bb, OP_load_func);
+                ir->src0 = src0;
 
-            if (bb->next == fn->exit)
-                continue;
+                bb_add_ph2_ir(bb, OP_indirect);
+                fn->is_leaf = false;
+
+                is_pushing_args = 0;
+                args = 0;
+                break;
+            case OP_func_ret:
+                dest = prepare_dest(bb, insn->rd, -1, -1);
+                ir = bb_add_ph2_ir(bb, OP_assign);
+                ir->src0 = 0;
+                ir->dest = dest;
+                break;
+            case OP_return:
+                if (insn->rs1)
+                    src0 = prepare_operand(bb, insn->rs1, -1);
+                else
+                    src0 = -1;
 
-            /* jump to the beginning of loop or over the else block */
-            if (bb->next->visited == fn->visited ||
-                bb->next->rpo != bb->rpo + 1) {
-                ph2_ir_t *ir = bb_add_ph2_ir(bb, OP_jump);
-                ir->next_bb = bb->next;
+                ir = bb_add_ph2_ir(bb, OP_return);
+                ir->src0 = src0;
+                break;
+            case OP_add:
+            case OP_sub:
+            case OP_mul:
+            case OP_div:
+            case OP_mod:
+            case OP_lshift:
+            case OP_rshift:
+            case OP_eq:
+            case OP_neq:
+            case OP_gt:
+            case OP_geq:
+            case OP_lt:
+            case OP_leq:
+            case OP_bit_and:
+            case OP_bit_or:
+            case OP_bit_xor:
+            case OP_log_and:
+            case OP_log_or:
+                src0 = prepare_operand(bb, insn->rs1, -1);
+                src1 = prepare_operand(bb, insn->rs2, src0);
+                dest = prepare_dest(bb, insn->rd, src0, src1);
+                ir = bb_add_ph2_ir(bb, insn->opcode);
+                ir->src0 = src0;
+                ir->src1 = src1;
+                ir->dest = dest;
+                break;
+            case OP_negate:
+            case OP_bit_not:
+            case OP_log_not:
+                src0 = prepare_operand(bb, insn->rs1, -1);
+                dest = prepare_dest(bb, insn->rd, src0, -1);
+                ir = bb_add_ph2_ir(bb, insn->opcode);
+                ir->src0 = src0;
+                ir->dest = dest;
+                break;
+            default:
+                printf("Unknown opcode\n");
+                abort();
             }
         }
 
-        /* handle implicit return */
-        for (int i = 0; i < MAX_BB_PRED; i++) {
-            basic_block_t *bb = fn->exit->prev[i].bb;
-            if (!bb)
-                continue;
+        if (bb->next)
+            spill_live_out(bb);
 
-            if (strcmp(fn->func->return_def.type_name, "void"))
-                continue;
+        if (bb == fn->exit)
+            continue;
+
+        /* append jump instruction for the normal block only */
+        if (!bb->next)
+            continue;
 
-            if (bb->insn_list.tail)
-                if (bb->insn_list.tail->opcode == OP_return)
-                    continue;
+        if (bb->next == fn->exit)
+            continue;
 
-            ph2_ir_t *ir = bb_add_ph2_ir(bb, OP_return);
-            ir->src0 = -1;
+        /* jump to the beginning of loop or over the else block */
+        if (bb->next->visited == fn->visited || bb->next->rpo != bb->rpo + 1) {
+            ph2_ir_t *ir = bb_add_ph2_ir(bb, OP_jump);
+            ir->next_bb = bb->next;
         }
     }
-}
-
-void dump_ph2_ir()
-{
-    for (int i = 0; i < ph2_ir_idx; i++) {
-        ph2_ir_t *ph2_ir = &PH2_IR[i];
 
-        int rd = ph2_ir->dest + 48;
-        int rs1 = ph2_ir->src0 + 48;
-        int rs2 = ph2_ir->src1 + 48;
+    /* handle implicit return */
+    for (int i = 0; i < MAX_BB_PRED; i++) {
+        basic_block_t *bb = fn->exit->prev[i].bb;
+        if (!bb)
+            continue;
 
-        switch (ph2_ir->op) {
-        case OP_define:
-            printf("%s:", ph2_ir->func_name);
-            break;
-        case OP_block_start:
-        case OP_block_end:
-        case OP_allocat:
+        if (strcmp(fn->func->return_def.type_name, "void"))
             continue;
-        case OP_assign:
-            printf("\t%%x%c = %%x%c", rd, rs1);
-            break;
-        case OP_load_constant:
-            printf("\tli %%x%c, $%d", rd, ph2_ir->src0);
-            break;
-        case OP_load_data_address:
-            printf("\t%%x%c = .data(%d)", rd, ph2_ir->src0);
-            break;
-        case OP_address_of:
-            printf("\t%%x%c = %%sp + %d", rd, ph2_ir->src0);
-            break;
-        case OP_global_address_of:
-            printf("\t%%x%c = %%gp + %d", rd, ph2_ir->src0);
-            break;
-        case OP_label:
-            printf("%s:", ph2_ir->func_name);
-            break;
-        case OP_branch:
+
+        if (bb->insn_list.tail)
+            if (bb->insn_list.tail->opcode == OP_return)
+                continue;
+
+        ph2_ir_t *ir = bb_add_ph2_ir(bb, OP_return);
+        ir->src0 = -1;
+    }
+}
+
+void dump_ph2_insn(ph2_ir_t *ph2_ir)
+{
+    int rd = ph2_ir->dest + 48;
+    int rs1 = ph2_ir->src0 + 48;
+    int rs2 = ph2_ir->src1 + 48;
+
+    switch (ph2_ir->op) {
+    case OP_define:
+        printf("%s:", ph2_ir->func_name);
+        break;
+    case OP_block_start:
+    case OP_block_end:
+    case OP_allocat:
+        return;
+    case OP_assign:
+        printf("\t%%x%c = %%x%c", rd, rs1);
+        break;
+    case OP_load_constant:
+        printf("\tli %%x%c, $%d", rd, ph2_ir->src0);
+        break;
+    case OP_load_data_address:
+        printf("\t%%x%c = .data(%d)", rd, ph2_ir->src0);
+        break;
+    case OP_address_of:
+        printf("\t%%x%c = %%sp + %d", rd, ph2_ir->src0);
+        break;
+    case OP_global_address_of:
+        printf("\t%%x%c = %%gp + %d", rd, ph2_ir->src0);
+        break;
+    case OP_label:
+        printf("%s:", ph2_ir->func_name);
+        break;
+    case OP_branch:
+        if (ph2_ir->is_branch_inverted)
+            printf("\tbrz %%x%c", rs1);
+        else
             printf("\tbr %%x%c", rs1);
-            break;
-        case OP_jump:
-            printf("\tj %s", ph2_ir->func_name);
-            break;
-        case OP_call:
-            printf("\tcall @%s", ph2_ir->func_name);
-            break;
-        case OP_return:
-            if (ph2_ir->src0 == -1)
-                printf("\tret");
-            else
-                printf("\tret %%x%c", rs1);
-            break;
-        case OP_load:
-            printf("\tload %%x%c, %d(sp)", rd, ph2_ir->src0);
-            break;
-        case OP_store:
-            printf("\tstore %%x%c, %d(sp)", rs1, ph2_ir->src1);
-            break;
-        case OP_global_load:
-            printf("\tload %%x%c, %d(gp)", rd, ph2_ir->src0);
-            break;
-        case OP_global_store:
-            printf("\tstore %%x%c, %d(gp)", rs1, ph2_ir->src1);
-            break;
-        case OP_read:
-            printf("\t%%x%c = (%%x%c)", rd, rs1);
-            break;
-        case OP_write:
-            printf("\t(%%x%c) = %%x%c", rs2, rs1);
-            break;
-        case OP_address_of_func:
-            printf("\t(%%x%c) = @%s", rs1, ph2_ir->func_name);
-            break;
-        case OP_load_func:
-            printf("\tload %%t0, %d(sp)", ph2_ir->src0);
-            break;
-        case OP_global_load_func:
-            printf("\tload %%t0, %d(gp)", ph2_ir->src0);
-            break;
-        case OP_indirect:
-            printf("\tindirect call @(%%t0)");
-            break;
-        case OP_negate:
-            printf("\tneg %%x%c, %%x%c", rd, rs1);
-            break;
-        case OP_add:
-            printf("\t%%x%c = add %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_sub:
-            printf("\t%%x%c = sub %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_mul:
-            printf("\t%%x%c = mul %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_div:
-            printf("\t%%x%c = div %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_mod:
-            printf("\t%%x%c = mod %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_eq:
-            printf("\t%%x%c = eq %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_neq:
-            printf("\t%%x%c = neq %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_gt:
-            printf("\t%%x%c = gt %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_lt:
-            printf("\t%%x%c = lt %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_geq:
-            printf("\t%%x%c = geq %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_leq:
-            printf("\t%%x%c = leq %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_bit_and:
-            printf("\t%%x%c = and %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_bit_or:
-            printf("\t%%x%c = or %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_bit_not:
-            printf("\t%%x%c = not %%x%c", rd, rs1);
-            break;
-        case OP_bit_xor:
-            printf("\t%%x%c = xor %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_log_and:
-            printf("\t%%x%c = and %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_log_or:
-            printf("\t%%x%c = or %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_log_not:
-            printf("\t%%x%c = not %%x%c", rd, rs1);
-            break;
-        case OP_rshift:
-            printf("\t%%x%c = rshift %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        case OP_lshift:
-            printf("\t%%x%c = lshift %%x%c, %%x%c", rd, rs1, rs2);
-            break;
-        default:
-            break;
-        }
-        printf("\n");
+        break;
+    case OP_jump:
+        printf("\tj %s", ph2_ir->func_name);
+        break;
+    case OP_predicate:
+        printf("\tpred %%x%c", rs1);
+        break;
+    case OP_call:
+        printf("\tcall @%s", ph2_ir->func_name);
+        break;
+    case OP_tail_call:
+        printf("\ttail call @%s", ph2_ir->func_name);
+        break;
+    case OP_return:
+        if (ph2_ir->src0 == -1)
+            printf("\tret");
+        else
+            printf("\tret %%x%c", rs1);
+        break;
+    case OP_load:
+        printf("\tload %%x%c, %d(sp)", rd, ph2_ir->src0);
+        break;
+    case OP_store:
+        printf("\tstore %%x%c, %d(sp)", rs1, ph2_ir->src1);
+        break;
+    case OP_global_load:
+        printf("\tload %%x%c, %d(gp)", rd, ph2_ir->src0);
+        break;
+    case OP_global_store:
+        printf("\tstore %%x%c, %d(gp)", rs1, ph2_ir->src1);
+        break;
+    case OP_read:
+        printf("\t%%x%c = (%%x%c)", rd, rs1);
+        break;
+    case OP_read_inc:
+        printf("\t%%x%c = (%%x%c), %%x%c += %d", rd, rs1, rs1,
+               ph2_ir->src1);
+        break;
+    case OP_write:
+        printf("\t(%%x%c) = %%x%c", rs2, rs1);
+        break;
+    case OP_address_of_func:
+        printf("\t(%%x%c) = @%s", rs1, ph2_ir->func_name);
+        break;
+    case OP_load_func:
+        printf("\tload %%t0, %d(sp)", ph2_ir->src0);
+        break;
+    case OP_global_load_func:
+        printf("\tload %%t0, %d(gp)", ph2_ir->src0);
+        break;
+    case OP_indirect:
+        printf("\tindirect call @(%%t0)");
+        break;
+    case OP_negate:
+        printf("\tneg %%x%c, %%x%c", rd, rs1);
+        break;
+    case OP_add:
+        printf("\t%%x%c = add %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_sub:
+        printf("\t%%x%c = sub %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_mul:
+        printf("\t%%x%c = mul %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_div:
+        printf("\t%%x%c = div %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_mod:
+        printf("\t%%x%c = mod %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_eq:
+        printf("\t%%x%c = eq %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_neq:
+        printf("\t%%x%c = neq %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_gt:
+        printf("\t%%x%c = gt %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_lt:
+        printf("\t%%x%c = lt %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_geq:
+        printf("\t%%x%c = geq %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_leq:
+        printf("\t%%x%c = leq %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_bit_and:
+        printf("\t%%x%c = and %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_bit_or:
+        printf("\t%%x%c = or %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_bit_not:
+        printf("\t%%x%c = not %%x%c", rd, rs1);
+        break;
+    case OP_bit_xor:
+        printf("\t%%x%c = xor %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_log_and:
+        printf("\t%%x%c = and %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_log_or:
+        printf("\t%%x%c = or %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_log_not:
+        printf("\t%%x%c = not %%x%c", rd, rs1);
+        break;
+    case OP_rshift:
+        printf("\t%%x%c = rshift %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    case OP_lshift:
+        printf("\t%%x%c = lshift %%x%c, %%x%c", rd, rs1, rs2);
+        break;
+    default:
+        break;
+    }
+    printf("\n");
+}
+
+/* Dump the second phase IR of 'fn', in the layout order of its blocks */
+void dump_ph2_ir(fn_t *fn)
+{
+    printf("%s:\n", fn->func->return_def.var_name);
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (ph2_ir_t *ph2_ir = bb->ph2_ir_list.head; ph2_ir;
+             ph2_ir = ph2_ir->next)
+            dump_ph2_insn(ph2_ir);
     }
 }
@@ -9,144 +9,122 @@
 
 #include "riscv.c"
 
-void update_elf_offset(ph2_ir_t *ph2_ir)
+/* With the option '+c', emit() writes the compressed form of an instruction
+ * if there is one. The sequences whose size or branch offsets are fixed are
+ * emitted with 'rvc_fixed' set, as are the ones referring to a location
+ * which may not be laid out yet. The jumps keep their 32-bit form.
+ */
+bool rvc_fixed = false;
+
+/* The branches merged by if-conversion are executed whatever the condition,
+ * so their instructions must neither fault nor have effects other than
+ * their stores, which keep the previous content if the branch is not taken.
+ */
+bool is_predicable(ph2_ir_t *ph2_ir)
 {
     switch (ph2_ir->op) {
     case OP_load_constant:
-        if (ph2_ir->src0 < -2048 || ph2_ir->src0 > 2047)
-            elf_offset += 8;
-        else
-            elf_offset += 4;
-        return;
+    case OP_load_data_address:
     case OP_address_of:
     case OP_global_address_of:
-        if (ph2_ir->src0 < -2048 || ph2_ir->src0 > 2047)
-            elf_offset += 12;
-        else
-            elf_offset += 4;
-        return;
     case OP_assign:
-        elf_offset += 4;
-        return;
     case OP_load:
-    case OP_global_load:
-        if (ph2_ir->src0 < -2048 || ph2_ir->src0 > 2047)
-            elf_offset += 16;
-        else
-            elf_offset += 4;
-        return;
     case OP_store:
+    case OP_global_load:
     case OP_global_store:
-        if (ph2_ir->src1 < -2048 || ph2_ir->src1 > 2047)
-            elf_offset += 16;
-        else
-            elf_offset += 4;
-        return;
-    case OP_read:
-    case OP_write:
-    case OP_jump:
-    case OP_call:
-    case OP_load_func:
-    case OP_indirect:
     case OP_add:
     case OP_sub:
     case OP_lshift:
     case OP_rshift:
-    case OP_gt:
-    case OP_lt:
     case OP_bit_and:
     case OP_bit_or:
     case OP_bit_xor:
+    case OP_bit_not:
     case OP_negate:
     case OP_log_and:
-    case OP_bit_not:
-        elf_offset += 4;
-        return;
+        return true;
     case OP_mul:
-        if (hard_mul_div)
-            elf_offset += 4;
-        else
-            elf_offset += 52;
-        return;
-    case OP_div:
-    case OP_mod:
-        if (hard_mul_div)
-            elf_offset += 4;
-        else
-            elf_offset += 104;
-        return;
-    case OP_load_data_address:
-    case OP_neq:
-    case OP_geq:
-    case OP_leq:
-    case OP_log_not:
-    case OP_log_or:
-        elf_offset += 8;
-        return;
-    case OP_address_of_func:
-    case OP_eq:
-        elf_offset += 12;
-        return;
-    case OP_branch:
-        elf_offset += 20;
-        return;
-    case OP_return:
-        elf_offset += 24;
-        return;
+        return hard_mul_div;
     default:
-        printf("Unknown opcode\n");
-        abort();
+        return false;
     }
 }
 
-void cfg_flatten()
+/* Result latencies of a small in-order core, in cycles. The multiplication
+ * without '+m' is a loop, done by the time its result is written.
+ */
+int insn_latency(ph2_ir_t *ph2_ir)
 {
-    func_t *func = find_func("__syscall");
-    func->fn->bbs->elf_offset = 48; /* offset of start + exit in codegen */
-
-    elf_offset = 84; /* offset of start + exit + syscall in codegen */
-    GLOBAL_FUNC.fn->bbs->elf_offset = elf_offset;
-
-    for (ph2_ir_t *ph2_ir = GLOBAL_FUNC.fn->bbs->ph2_ir_list.head; ph2_ir;
-         ph2_ir = ph2_ir->next) {
-        update_elf_offset(ph2_ir);
+    switch (ph2_ir->op) {
+    case OP_load:
+    case OP_global_load:
+    case OP_read:
+    case OP_read_inc:
+        return 3;
+    case OP_mul:
+        if (hard_mul_div)
+            return 3;
+        return 1;
+    default:
+        return 1;
     }
+}
 
-    /* prepare 'argc' and 'argv', then proceed to 'main' function */
-    elf_offset += 24;
-
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        /* reserve stack */
-        ph2_ir_t *flatten_ir = add_ph2_ir(OP_define);
-        flatten_ir->src0 = fn->func->stack_size;
-
-        for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
-            bb->elf_offset = elf_offset;
+void emit(int code)
+{
+    int c = 0;
+    if (rvc & !rvc_fixed)
+        c = rv_compress(code);
 
-            if (bb == fn->bbs) {
-                /* save ra, sp */
-                elf_offset += 16;
-            }
+    if (c)
+        elf_write_code_short(c);
+    else
+        elf_write_code_int(code);
+}
 
-            for (ph2_ir_t *insn = bb->ph2_ir_list.head; insn;
-                 insn = insn->next) {
-                flatten_ir = add_ph2_ir(OP_generic);
-                memcpy(flatten_ir, insn, sizeof(ph2_ir_t));
+/* Store 'rs' at 'ofs(base)'. In a branch merged by if-conversion, the word
+ * stored is selected with the mask set by OP_predicate in t6.
+ */
+void emit_store(ph2_ir_t *ph2_ir, rv_reg rs, rv_reg base, int ofs)
+{
+    if (ph2_ir->pred == NEXT) {
+        emit(__sw(rs, base, ofs));
+        return;
+    }
+    emit(__lw(__t1, base, ofs));
+    emit(__xor(__t2, rs, __t1));
+    emit(__and(__t2, __t2, __t6));
+    if (ph2_ir->pred == THEN)
+        emit(__xor(__t1, __t1, __t2));
+    else
+        emit(__xor(__t1, rs, __t2));
+    emit(__sw(__t1, base, ofs));
+}
 
-                if (insn->op == OP_return) {
-                    /* restore sp */
-                    flatten_ir->src1 = bb->belong_to->func->stack_size;
-                }
+/* Move sp by 'ofs', the size of a stack frame, negated to reserve it */
+void emit_move_sp(int ofs)
+{
+    if (!ofs)
+        return;
+    if (ofs < -2048 || ofs > 2047) {
+        emit(__lui(__t0, rv_hi(ofs)));
+        emit(__addi(__t0, __t0, rv_lo(ofs)));
+        emit(__add(__sp, __sp, __t0));
+    } else
+        emit(__addi(__sp, __sp, ofs));
+}
 
-                update_elf_offset(flatten_ir);
-            }
-        }
-    }
+/* Whether a conditional branch reaches 'ofs' bytes away, 4 KiB at most */
+bool rv_branch_reaches(int ofs)
+{
+    return (ofs >= -4096) & (ofs < 4096);
 }
 
-void emit(int code)
+/* Align the code to a word */
+void emit_align()
 {
-    elf_write_code_int(code);
+    if (elf_code_idx & 2)
+        emit(__nop());
 }
 
 void emit_ph2_ir(ph2_ir_t *ph2_ir)
@@ -164,10 +142,10 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
 
     switch (ph2_ir->op) {
     case OP_define:
-        emit(__lui(__t0, rv_hi(ph2_ir->src0 + 4)));
-        emit(__addi(__t0, __t0, rv_lo(ph2_ir->src0 + 4)));
-        emit(__sub(__sp, __sp, __t0));
-        emit(__sw(__ra, __sp, 0));
+        emit_move_sp(-ph2_ir->src0);
+        /* a leaf function keeps its return address in ra */
+        if (!ph2_ir->dest)
+            emit(__sw(__ra, __sp, 0));
         return;
     case OP_load_constant:
         if (ph2_ir->src0 < -2048 || ph2_ir->src0 > 2047) {
@@ -210,9 +188,9 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
             emit(__lui(__t0, rv_hi(ph2_ir->src1)));
             emit(__addi(__t0, __t0, rv_lo(ph2_ir->src1)));
             emit(__add(__t0, __sp, __t0));
-            emit(__sw(rs1, __t0, 0));
+            emit_store(ph2_ir, rs1, __t0, 0);
         } else
-            emit(__sw(rs1, __sp, ph2_ir->src1));
+            emit_store(ph2_ir, rs1, __sp, ph2_ir->src1);
         return;
     case OP_global_load:
         if (ph2_ir->src0 < -2048 || ph2_ir->src0 > 2047) {
@@ -228,9 +206,9 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
             emit(__lui(__t0, rv_hi(ph2_ir->src1)));
             emit(__addi(__t0, __t0, rv_lo(ph2_ir->src1)));
             emit(__add(__t0, __gp, __t0));
-            emit(__sw(rs1, __t0, 0));
+            emit_store(ph2_ir, rs1, __t0, 0);
         } else
-            emit(__sw(rs1, __gp, ph2_ir->src1));
+            emit_store(ph2_ir, rs1, __gp, ph2_ir->src1);
         return;
     case OP_read:
         if (ph2_ir->src1 == 1)
@@ -240,6 +218,15 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         else
             abort();
         return;
+    case OP_read_inc:
+        if (ph2_ir->src1 == 1)
+            emit(__lb(rd, rs1, 0));
+        else if (ph2_ir->src1 == 4)
+            emit(__lw(rd, rs1, 0));
+        else
+            abort();
+        emit(__addi(rs1, rs1, ph2_ir->src1));
+        return;
     case OP_write:
         if (ph2_ir->dest == 1)
             emit(__sb(rs2, rs1, 0));
@@ -249,30 +236,60 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
             abort();
         return;
     case OP_branch:
-        ofs = elf_code_start + ph2_ir->then_bb->elf_offset;
-        emit(__lui(__t0, rv_hi(ofs)));
-        emit(__addi(__t0, __t0, rv_lo(ofs)));
-        emit(__beq(rs1, __zero, 8));
-        emit(__jalr(__zero, __t0, 0));
-        emit(__jal(__zero, ph2_ir->else_bb->elf_offset - elf_code_idx));
+        rvc_fixed = true;
+        if (ph2_ir->is_far) {
+            /* skip the jump to 'then_bb' unless the branch is taken */
+            if (ph2_ir->is_branch_inverted)
+                emit(__bne(rs1, __zero, 8));
+            else
+                emit(__beq(rs1, __zero, 8));
+            emit(__jal(__zero, ph2_ir->then_bb->elf_offset - elf_code_idx));
+        } else {
+            /* 'then_bb' may not be laid out yet, see fn_emit() */
+            ofs = ph2_ir->then_bb->elf_offset - elf_code_idx;
+            if (!rv_branch_reaches(ofs))
+                ofs = 0;
+            if (ph2_ir->is_branch_inverted)
+                emit(__beq(rs1, __zero, ofs));
+            else
+                emit(__bne(rs1, __zero, ofs));
+        }
+        if (ph2_ir->is_branch_detached)
+            emit(__jal(__zero, ph2_ir->else_bb->elf_offset - elf_code_idx));
+        rvc_fixed = false;
         return;
     case OP_jump:
         emit(__jal(__zero, ph2_ir->next_bb->elf_offset - elf_code_idx));
         return;
+    case OP_predicate:
+        /* t6 = -1 if the condition holds, 0 otherwise */
+        emit(__sltu(__t6, __zero, rs1));
+        emit(__sub(__t6, __zero, __t6));
+        return;
     case OP_call:
+        /* the callee may not be laid out yet, see is_laid_out() */
         func = find_func(ph2_ir->func_name);
-        emit(__jal(__ra, func->fn->bbs->elf_offset - elf_code_idx));
+        ofs = 0;
+        if (func->fn)
+            ofs = func->fn->elf_offset;
+        emit(__jal(__ra, ofs - elf_code_idx));
         return;
     case OP_load_data_address:
+        rvc_fixed = true;
         emit(__lui(rd, rv_hi(elf_data_start + ph2_ir->src0)));
         emit(__addi(rd, rd, rv_lo(elf_data_start + ph2_ir->src0)));
+        rvc_fixed = false;
         return;
     case OP_address_of_func:
         func = find_func(ph2_ir->func_name);
-        ofs = elf_code_start + func->fn->bbs->elf_offset;
+        ofs = elf_code_start;
+        if (func->fn)
+            ofs += func->fn->elf_offset;
+        rvc_fixed = true;
         emit(__lui(__t0, rv_hi(ofs)));
         emit(__addi(__t0, __t0, rv_lo(ofs)));
         emit(__sw(__t0, rs1, 0));
+        rvc_fixed = false;
         return;
     case OP_load_func:
         emit(__addi(__t0, rs1, 0));
@@ -281,16 +298,23 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         emit(__jalr(__ra, __t0, 0));
         return;
     case OP_return:
-        if (ph2_ir->src0 == -1)
-            emit(__addi(__zero, __zero, 0));
-        else
+        if ((ph2_ir->src0 != -1) & (rs1 != __a0))
             emit(__addi(__a0, rs1, 0));
-        emit(__lw(__ra, __sp, 0));
-        emit(__lui(__t0, rv_hi(ph2_ir->src1 + 4)));
-        emit(__addi(__t0, __t0, rv_lo(ph2_ir->src1 + 4)));
-        emit(__add(__sp, __sp, __t0));
+        if (!ph2_ir->dest)
+            emit(__lw(__ra, __sp, 0));
+        emit_move_sp(ph2_ir->src1);
         emit(__jalr(__zero, __ra, 0));
         return;
+    case OP_tail_call:
+        if (!ph2_ir->dest)
+            emit(__lw(__ra, __sp, 0));
+        emit_move_sp(ph2_ir->src1);
+        func = find_func(ph2_ir->func_name);
+        ofs = 0;
+        if (func->fn)
+            ofs = func->fn->elf_offset;
+        emit(__jal(__zero, ofs - elf_code_idx));
+        return;
     case OP_add:
         emit(__add(rd, rs1, rs2));
         return;
@@ -301,6 +325,7 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         if (hard_mul_div)
             emit(__mul(rd, rs1, rs2));
         else {
+            rvc_fixed = true;
             emit(__addi(__t0, __zero, 0));
             emit(__addi(__t1, __zero, 0));
             emit(__addi(__t3, rs1, 0));
@@ -314,6 +339,7 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
             emit(__srli(__t4, __t4, 1));
             emit(__jal(__zero, -28));
             emit(__addi(rd, __t0, 0));
+            rvc_fixed = false;
         }
         return;
     case OP_div:
@@ -335,6 +361,7 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
             divisor_mask = __zero;
         }
         /* Obtain absolute values of the dividend and divisor */
+        rvc_fixed = true;
         emit(__addi(__t2, rs1, 0));
         emit(__addi(__t3, rs2, 0));
         emit(__srai(__t0, __t2, 31));
@@ -349,7 +376,7 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         emit(__addi(__t1, __zero, 1));
         emit(__beq(__t3, __zero, 48));
         emit(__beq(__t2, __zero, 44));
-        emit(__bltu(__t2, __t3, 16));
+        emit(__bgeu(__t3, __t2, 16));
         emit(__slli(__t3, __t3, 1));
         emit(__slli(__t1, __t1, 1));
         emit(__jal(__zero, -12));
@@ -363,6 +390,7 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
         /* Handle the correct sign for the quotient or remainder */
         emit(__beq(__t5, __zero, 8));
         emit(__sub(rd, __zero, rd));
+        rvc_fixed = false;
         return;
     case OP_lshift:
         emit(__sll(rd, rs1, rs2));
@@ -426,9 +454,13 @@ void emit_ph2_ir(ph2_ir_t *ph2_ir)
     }
 }
 
-void code_generate()
+/* The code preceding the functions, encoded again once the global
+ * initialization is laid out
+ */
+void emit_start()
 {
-    elf_data_start = elf_code_start + elf_offset;
+    func_t *func = find_func("__syscall");
+    rvc_fixed = true;
 
     /* start */
     emit(__lui(__t0, rv_hi(GLOBAL_FUNC.stack_size)));
@@ -447,6 +479,7 @@ void code_generate()
     emit(__ecall());
 
     /* syscall */
+    func->fn->elf_offset = elf_code_idx;
     emit(__addi(__a7, __a0, 0));
     emit(__addi(__a0, __a1, 0));
     emit(__addi(__a1, __a2, 0));
@@ -456,22 +489,97 @@ void code_generate()
     emit(__addi(__a5, __a6, 0));
     emit(__ecall());
     emit(__jalr(__zero, __ra, 0));
+    rvc_fixed = false;
+}
 
+void emit_global()
+{
+    func_t *func = find_func("main");
     ph2_ir_t *ph2_ir;
+    GLOBAL_FUNC.fn->bbs->elf_offset = elf_code_idx;
     for (ph2_ir = GLOBAL_FUNC.fn->bbs->ph2_ir_list.head; ph2_ir;
          ph2_ir = ph2_ir->next)
-        emit_ph2_ir(ph2_ir);
+        emit_insn(ph2_ir);
 
     /* prepare 'argc' and 'argv', then proceed to 'main' function */
+    rvc_fixed = true;
     emit(__lui(__t0, rv_hi(GLOBAL_FUNC.stack_size)));
     emit(__addi(__t0, __t0, rv_lo(GLOBAL_FUNC.stack_size)));
     emit(__add(__t0, __gp, __t0));
     emit(__lw(__a0, __t0, 0));
     emit(__addi(__a1, __t0, 4));
-    emit(__jal(__zero, MAIN_BB->elf_offset - elf_code_idx));
+    emit(__jal(__zero, func->fn->elf_offset - elf_code_idx));
+    rvc_fixed = false;
+
+    /* the data section follows, aligned to a word */
+    emit_align();
+}
+
+/* Lay out the blocks of 'fn', the conditional branches reaching 'then_bb'
+ * directly unless it was found out of their reach. Returns whether they all
+ * reach it, or have been turned into the long form to lay 'fn' out again.
+ */
+bool fn_layout(fn_t *fn)
+{
+    ph2_ir_t define_ir;
+    bool reached = true;
 
-    for (int i = 0; i < ph2_ir_idx; i++) {
-        ph2_ir = &PH2_IR[i];
-        emit_ph2_ir(ph2_ir);
+    /* reserve stack */
+    fn_define(fn, &define_ir);
+    emit_ph2_ir(&define_ir);
+
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        bb->elf_offset = elf_code_idx;
+
+        for (ph2_ir_t *insn = bb->ph2_ir_list.head; insn; insn = insn->next) {
+            if ((insn->op == OP_return) | (insn->op == OP_tail_call)) {
+                /* restore sp */
+                insn->src1 = frame_size(fn);
+                insn->dest = fn->is_leaf;
+            }
+
+            if (insn->op == OP_branch) {
+                /* branch to the block not following, if any, and jump to
+                 * 'else_bb' only if neither of them follows
+                 */
+                if (insn->then_bb == bb->rpo_next) {
+                    insn->then_bb = insn->else_bb;
+                    insn->else_bb = bb->rpo_next;
+                    insn->is_branch_inverted = !insn->is_branch_inverted;
+                }
+                insn->is_branch_detached = insn->else_bb != bb->rpo_next;
+            }
+            emit_insn(insn);
+        }
     }
+
+    for (fixup_t *fixup = BB_FIXUPS; fixup; fixup = fixup->next) {
+        ph2_ir_t *ph2_ir = fixup->ph2_ir;
+        if (ph2_ir->op != OP_branch)
+            continue;
+        if (ph2_ir->is_far)
+            continue;
+        if (rv_branch_reaches(ph2_ir->then_bb->elf_offset - fixup->code_idx))
+            continue;
+        ph2_ir->is_far = true;
+        reached = false;
+    }
+    return reached;
+}
+
+/* A conditional branch only reaches 4 KiB away, so a function is laid out
+ * again with the branches found out of reach in the long form, jumping to
+ * 'then_bb', until they all reach it. Each round turns at least one more
+ * branch into the long form, so that this ends.
+ */
+void fn_emit(fn_t *fn)
+{
+    int code_idx = elf_code_idx;
+    fixup_t *fixups = FIXUPS;
+
+    fn->elf_offset = elf_code_idx;
+    while (!fn_layout(fn))
+        emit_rewind(code_idx, fixups);
+
+    emit_bb_fixups();
 }
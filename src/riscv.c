@@ -403,3 +403,197 @@ int __mod(rv_reg rd, rv_reg rs1, rv_reg rs2)
 {
     return rv_encode_R(rv_mod, rd, rs1, rs2);
 }
+
+/* Compressed (RVC) encoding. An instruction is compressed from its 32-bit
+ * encoding, when its operands fit one of the 16-bit forms. The jumps and
+ * branches to an offset are left as they are.
+ */
+
+/* register among x8 to x15, which the 3-bit fields encode */
+bool rv_creg(rv_reg r)
+{
+    return (r >= 8) & (r < 16);
+}
+
+/* signed immediate of 'bits' bits. shecc does not negate a parenthesized
+ * expression, hence 'half'.
+ */
+bool rv_fits(int imm, int bits)
+{
+    int half = 1 << (bits - 1);
+    return (imm >= -half) & (imm < half);
+}
+
+int rv_encode_CI(int funct3, rv_reg rd, int imm, int op)
+{
+    return (funct3 << 13) + (((imm >> 5) & 1) << 12) + (rd << 7) +
+           ((imm & 31) << 2) + op;
+}
+
+int rv_encode_CR(int funct4, rv_reg rd, rv_reg rs2)
+{
+    return (funct4 << 12) + (rd << 7) + (rs2 << 2) + 2;
+}
+
+int rv_encode_CA(int funct2, rv_reg rd, rv_reg rs2)
+{
+    return 35841 /* (0b100011 << 10) + 1 */ + ((rd - 8) << 7) + (funct2 << 5) +
+           ((rs2 - 8) << 2);
+}
+
+int rv_encode_CB(int funct2, rv_reg rd, int imm)
+{
+    return 32769 /* (0b100 << 13) + 1 */ + (((imm >> 5) & 1) << 12) +
+           (funct2 << 10) + ((rd - 8) << 7) + ((imm & 31) << 2);
+}
+
+/* c.lw and c.sw, with 'r' the loaded or stored register */
+int rv_encode_CL(int funct3, rv_reg r, rv_reg rs1, int uimm)
+{
+    return (funct3 << 13) + (((uimm >> 3) & 7) << 10) + ((rs1 - 8) << 7) +
+           (((uimm >> 2) & 1) << 6) + (((uimm >> 6) & 1) << 5) +
+           ((r - 8) << 2);
+}
+
+int rv_compress_addi(rv_reg rd, rv_reg rs1, int imm)
+{
+    if (rd == __zero) {
+        if ((rs1 == __zero) & (imm == 0))
+            return 1; /* c.nop */
+        return 0;
+    }
+    if (rs1 == __zero) {
+        if (rv_fits(imm, 6))
+            return rv_encode_CI(2, rd, imm, 1); /* c.li */
+        return 0;
+    }
+    if (imm == 0)
+        return rv_encode_CR(8, rd, rs1); /* c.mv */
+    if (rd == rs1) {
+        if (rv_fits(imm, 6))
+            return rv_encode_CI(0, rd, imm, 1); /* c.addi */
+        if ((rd == __sp) & ((imm & 15) == 0) & rv_fits(imm, 10))
+            /* c.addi16sp */
+            return 24833 /* (0b011 << 13) + (2 << 7) + 1 */ +
+                   (((imm >> 9) & 1) << 12) + (((imm >> 4) & 1) << 6) +
+                   (((imm >> 6) & 1) << 5) + (((imm >> 7) & 3) << 3) +
+                   (((imm >> 5) & 1) << 2);
+        return 0;
+    }
+    if ((rs1 == __sp) & rv_creg(rd) & ((imm & 3) == 0) & (imm > 0) &
+        (imm < 1024))
+        /* c.addi4spn */
+        return (((imm >> 4) & 3) << 11) + (((imm >> 6) & 15) << 7) +
+               (((imm >> 2) & 1) << 6) + (((imm >> 3) & 1) << 5) +
+               ((rd - 8) << 2);
+    return 0;
+}
+
+/* Return the 16-bit form of the instruction 'code', or 0 if there is none */
+int rv_compress(int code)
+{
+    int opcode = code & 127;
+    int rd = (code >> 7) & 31;
+    int funct3 = (code >> 12) & 7;
+    int rs1 = (code >> 15) & 31;
+    int rs2 = (code >> 20) & 31;
+    int funct7 = (code >> 25) & 127;
+    int imm = code >> 20;
+    int simm = ((code >> 25) << 5) + rd;
+
+    /* register-immediate */
+    if (opcode == 19) {
+        if (funct3 == 0)
+            return rv_compress_addi(rd, rs1, imm);
+        if ((rd != rs1) | (rd == __zero))
+            return 0;
+        if ((funct3 == 1) & (rs2 != 0))
+            return rv_encode_CI(0, rd, rs2, 2); /* c.slli */
+        if (!rv_creg(rd))
+            return 0;
+        if ((funct3 == 5) & (rs2 != 0)) {
+            if (funct7 == 0)
+                return rv_encode_CB(0, rd, rs2); /* c.srli */
+            return rv_encode_CB(1, rd, rs2); /* c.srai */
+        }
+        if ((funct3 == 7) & rv_fits(imm, 6))
+            return rv_encode_CB(2, rd, imm); /* c.andi */
+        return 0;
+    }
+
+    if (opcode == 55) {
+        imm = code >> 12;
+        if ((rd != __zero) & (rd != __sp) & (imm != 0) & rv_fits(imm, 6))
+            return rv_encode_CI(3, rd, imm, 1); /* c.lui */
+        return 0;
+    }
+
+    /* register-register, without the M extension */
+    if ((opcode == 51) & ((funct7 == 0) | (funct7 == 32))) {
+        if (rd == __zero)
+            return 0;
+        if ((funct3 == 0) & (funct7 == 0)) {
+            if ((rs1 == __zero) & (rs2 != __zero))
+                return rv_encode_CR(8, rd, rs2); /* c.mv */
+            if ((rd == rs1) & (rs2 != __zero))
+                return rv_encode_CR(9, rd, rs2); /* c.add */
+            if ((rd == rs2) & (rs1 != __zero))
+                return rv_encode_CR(9, rd, rs1);
+            return 0;
+        }
+
+        int funct2 = -1;
+        if ((funct3 == 0) & (funct7 == 32))
+            funct2 = 0; /* c.sub */
+        if ((funct7 == 0) & (funct3 == 4))
+            funct2 = 1; /* c.xor */
+        if ((funct7 == 0) & (funct3 == 6))
+            funct2 = 2; /* c.or */
+        if ((funct7 == 0) & (funct3 == 7))
+            funct2 = 3; /* c.and */
+        if ((funct2 < 0) | !rv_creg(rd))
+            return 0;
+        if ((rd == rs1) & rv_creg(rs2))
+            return rv_encode_CA(funct2, rd, rs2);
+        /* the operations other than subtraction are commutative */
+        if ((funct2 > 0) & (rd == rs2) & rv_creg(rs1))
+            return rv_encode_CA(funct2, rd, rs1);
+        return 0;
+    }
+
+    /* lw */
+    if ((opcode == 3) & (funct3 == 2)) {
+        if ((imm & 3) | (imm < 0))
+            return 0;
+        if ((rs1 == __sp) & (rd != __zero) & (imm < 256))
+            /* c.lwsp */
+            return 16386 /* (0b010 << 13) + 2 */ + (((imm >> 5) & 1) << 12) +
+                   (rd << 7) + (((imm >> 2) & 7) << 4) +
+                   (((imm >> 6) & 3) << 2);
+        if (rv_creg(rd) & rv_creg(rs1) & (imm < 128))
+            return rv_encode_CL(2, rd, rs1, imm); /* c.lw */
+        return 0;
+    }
+
+    /* sw */
+    if ((opcode == 35) & (funct3 == 2)) {
+        if ((simm & 3) | (simm < 0))
+            return 0;
+        if ((rs1 == __sp) & (simm < 256))
+            /* c.swsp */
+            return 49154 /* (0b110 << 13) + 2 */ + (((simm >> 2) & 15) << 9) +
+                   (((simm >> 6) & 3) << 7) + (rs2 << 2);
+        if (rv_creg(rs2) & rv_creg(rs1) & (simm < 128))
+            return rv_encode_CL(6, rs2, rs1, simm); /* c.sw */
+        return 0;
+    }
+
+    /* jalr to a register, linking to ra or not at all */
+    if ((opcode == 103) & (imm == 0) & (rs1 != __zero)) {
+        if (rd == __zero)
+            return rv_encode_CR(8, rs1, __zero); /* c.jr */
+        if (rd == __ra)
+            return rv_encode_CR(9, rs1, __zero); /* c.jalr */
+    }
+    return 0;
+}
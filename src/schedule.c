@@ -0,0 +1,143 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* Instruction scheduling reorders the allocated instructions of each block,
+ * so that an in-order core does not wait for the result of a load or of a
+ * multiplication when the next instruction needs it. The register
+ * allocation emits them in the order of the IR, where a value is mostly
+ * consumed right after it is computed.
+ *
+ * The blocks are split at the instructions which must stay in place, like
+ * the calls and the branches, and the instructions in between are list
+ * scheduled: among those whose operands are ready, the one on the longest
+ * path to the end of the region goes first, as the latencies of the code
+ * generator count it. The registers are already allocated, so an
+ * instruction neither overwrites a register still to be read, nor reads one
+ * before it is written, in the new order.
+ */
+
+/* Cycles before the result of 'ph2_ir' can be used by the next instruction
+ * on the target.
+ */
+int insn_latency(ph2_ir_t *ph2_ir);
+
+/* Whether 'b', following 'a' in the block, must still follow it */
+bool sched_depends(ph2_ir_t *a, ph2_ir_t *b)
+{
+    if (ph2_defs(a) & (ph2_uses(b) | ph2_defs(b)))
+        return true;
+    if (ph2_uses(a) & ph2_defs(b))
+        return true;
+
+    if (!ph2_stores(a) && !ph2_stores(b))
+        return false;
+    if (!ph2_loads(a) && !ph2_stores(a))
+        return false;
+    if (!ph2_loads(b) && !ph2_stores(b))
+        return false;
+    return ph2_may_alias(a, b);
+}
+
+/* Append 'ph2_ir' to the instructions of 'bb' being rebuilt */
+void sched_append(basic_block_t *bb, ph2_ir_t *ph2_ir)
+{
+    ph2_ir->next = NULL;
+    if (!bb->ph2_ir_list.head)
+        bb->ph2_ir_list.head = ph2_ir;
+    else
+        bb->ph2_ir_list.tail->next = ph2_ir;
+    bb->ph2_ir_list.tail = ph2_ir;
+}
+
+/* Append the 'n' instructions of 'region' to 'bb' in a new order */
+void schedule_region(basic_block_t *bb, ph2_ir_t *region[], int n)
+{
+    int prio[MAX_SCHEDULED];  /* cycles from the start to the region end */
+    int preds[MAX_SCHEDULED]; /* instructions to be scheduled before */
+    int ready[MAX_SCHEDULED]; /* earliest cycle the operands are ready */
+    bool done[MAX_SCHEDULED];
+
+    for (int i = n - 1; i >= 0; i--) {
+        int path = 0;
+        preds[i] = 0;
+        ready[i] = 0;
+        done[i] = false;
+        for (int j = i + 1; j < n; j++) {
+            if (prio[j] > path)
+                if (sched_depends(region[i], region[j]))
+                    path = prio[j];
+        }
+        prio[i] = path + insn_latency(region[i]);
+        for (int j = 0; j < i; j++) {
+            if (sched_depends(region[j], region[i]))
+                preds[i]++;
+        }
+    }
+
+    int cycle = 0;
+    for (int k = 0; k < n; k++) {
+        /* the earliest to issue, the most critical, then the first one */
+        int best = -1;
+        int issue = 0;
+        for (int i = 0; i < n; i++) {
+            if (done[i] | (preds[i] > 0))
+                continue;
+            int at = ready[i];
+            if (at < cycle)
+                at = cycle;
+            if (best >= 0) {
+                if (at > issue)
+                    continue;
+                if (at == issue)
+                    if (prio[i] <= prio[best])
+                        continue;
+            }
+            best = i;
+            issue = at;
+        }
+
+        done[best] = true;
+        cycle = issue + 1;
+        int avail = issue + insn_latency(region[best]);
+        for (int j = best + 1; j < n; j++) {
+            if (!sched_depends(region[best], region[j]))
+                continue;
+            preds[j]--;
+            if (ready[j] < avail)
+                ready[j] = avail;
+        }
+        sched_append(bb, region[best]);
+    }
+}
+
+void fn_schedule(fn_t *fn)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        ph2_ir_t *region[MAX_SCHEDULED];
+        int n = 0;
+        ph2_ir_t *next;
+
+        ph2_ir_t *ph2_ir = bb->ph2_ir_list.head;
+        bb->ph2_ir_list.head = NULL;
+        bb->ph2_ir_list.tail = NULL;
+        for (; ph2_ir; ph2_ir = next) {
+            next = ph2_ir->next;
+            if (ph2_plain(ph2_ir)) {
+                region[n++] = ph2_ir;
+                if (n < MAX_SCHEDULED)
+                    continue;
+                schedule_region(bb, region, n);
+                n = 0;
+                continue;
+            }
+            schedule_region(bb, region, n);
+            n = 0;
+            sched_append(bb, ph2_ir);
+        }
+        schedule_region(bb, region, n);
+    }
+}
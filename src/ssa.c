@@ -96,28 +96,32 @@ void bb_build_rpo(fn_t *fn, basic_block_t *bb)
     prev->rpo_next = bb;
 }
 
-void build_rpo()
+void fn_build_rpo(fn_t *fn)
 {
     bb_traversal_args_t *args = calloc(1, sizeof(bb_traversal_args_t));
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        args->fn = fn;
-        args->bb = fn->bbs;
+    args->fn = fn;
+    args->bb = fn->bbs;
 
-        fn->visited++;
-        args->postorder_cb = bb_index_rpo;
-        bb_forward_traversal(args);
+    fn->visited++;
+    args->postorder_cb = bb_index_rpo;
+    bb_forward_traversal(args);
 
-        fn->visited++;
-        args->postorder_cb = bb_reverse_index;
-        bb_forward_traversal(args);
+    fn->visited++;
+    args->postorder_cb = bb_reverse_index;
+    bb_forward_traversal(args);
 
-        fn->visited++;
-        args->postorder_cb = bb_build_rpo;
-        bb_forward_traversal(args);
-    }
+    fn->visited++;
+    args->postorder_cb = bb_build_rpo;
+    bb_forward_traversal(args);
     free(args);
 }
 
+void build_rpo()
+{
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next)
+        fn_build_rpo(fn);
+}
+
 basic_block_t *intersect(basic_block_t *i, basic_block_t *j)
 {
     while (i != j) {
@@ -140,43 +144,47 @@ basic_block_t *intersect(basic_block_t *i, basic_block_t *j)
  *   Cooper, Keith D.; Harvey, Timothy J.; Kennedy, Ken (2001).
  *   "A Simple, Fast Dominance Algorithm"
  */
-void build_idom()
+void fn_build_idom(fn_t *fn)
 {
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        bool changed;
+    bool changed;
 
-        fn->bbs->idom = fn->bbs;
+    fn->bbs->idom = fn->bbs;
 
-        do {
-            changed = false;
+    do {
+        changed = false;
 
-            for (basic_block_t *bb = fn->bbs->rpo_next; bb; bb = bb->rpo_next) {
-                /* pick one predecessor */
-                basic_block_t *pred;
-                for (int i = 0; i < MAX_BB_PRED; i++) {
-                    if (!bb->prev[i].bb)
-                        continue;
-                    if (!bb->prev[i].bb->idom)
-                        continue;
-                    pred = bb->prev[i].bb;
-                    break;
-                }
+        for (basic_block_t *bb = fn->bbs->rpo_next; bb; bb = bb->rpo_next) {
+            /* pick one predecessor */
+            basic_block_t *pred;
+            for (int i = 0; i < MAX_BB_PRED; i++) {
+                if (!bb->prev[i].bb)
+                    continue;
+                if (!bb->prev[i].bb->idom)
+                    continue;
+                pred = bb->prev[i].bb;
+                break;
+            }
 
-                for (int i = 0; i < MAX_BB_PRED; i++) {
-                    if (!bb->prev[i].bb)
-                        continue;
-                    if (bb->prev[i].bb == pred)
-                        continue;
-                    if (bb->prev[i].bb->idom)
-                        pred = intersect(bb->prev[i].bb, pred);
-                }
-                if (bb->idom != pred) {
-                    bb->idom = pred;
-                    changed = true;
-                }
+            for (int i = 0; i < MAX_BB_PRED; i++) {
+                if (!bb->prev[i].bb)
+                    continue;
+                if (bb->prev[i].bb == pred)
+                    continue;
+                if (bb->prev[i].bb->idom)
+                    pred = intersect(bb->prev[i].bb, pred);
             }
-        } while (changed);
-    }
+            if (bb->idom != pred) {
+                bb->idom = pred;
+                changed = true;
+            }
+        }
+    } while (changed);
+}
+
+void build_idom()
+{
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next)
+        fn_build_idom(fn);
 }
 
 bool dom_connect(basic_block_t *pred, basic_block_t *succ)
@@ -212,20 +220,24 @@ void bb_build_dom(fn_t *fn, basic_block_t *bb)
     }
 }
 
-void build_dom()
+void fn_build_dom(fn_t *fn)
 {
     bb_traversal_args_t *args = calloc(1, sizeof(bb_traversal_args_t));
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        args->fn = fn;
-        args->bb = fn->bbs;
+    args->fn = fn;
+    args->bb = fn->bbs;
 
-        fn->visited++;
-        args->preorder_cb = bb_build_dom;
-        bb_forward_traversal(args);
-    }
+    fn->visited++;
+    args->preorder_cb = bb_build_dom;
+    bb_forward_traversal(args);
     free(args);
 }
 
+void build_dom()
+{
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next)
+        fn_build_dom(fn);
+}
+
 void bb_build_df(fn_t *fn, basic_block_t *bb)
 {
     UNUSED(fn);
@@ -247,20 +259,24 @@ void bb_build_df(fn_t *fn, basic_block_t *bb)
     }
 }
 
-void build_df()
+void fn_build_df(fn_t *fn)
 {
     bb_traversal_args_t *args = calloc(1, sizeof(bb_traversal_args_t));
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        args->fn = fn;
-        args->bb = fn->bbs;
+    args->fn = fn;
+    args->bb = fn->bbs;
 
-        fn->visited++;
-        args->postorder_cb = bb_build_df;
-        bb_forward_traversal(args);
-    }
+    fn->visited++;
+    args->postorder_cb = bb_build_df;
+    bb_forward_traversal(args);
     free(args);
 }
 
+void build_df()
+{
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next)
+        fn_build_df(fn);
+}
+
 bool var_check_killed(var_t *var, basic_block_t *bb)
 {
     for (int i = 0; i < bb->live_kill_idx; i++) {
@@ -352,28 +368,31 @@ void bb_solve_globals(fn_t *fn, basic_block_t *bb)
     }
 }
 
-void solve_globals()
+void fn_solve_globals(fn_t *fn)
 {
     bb_traversal_args_t *args = calloc(1, sizeof(bb_traversal_args_t));
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        args->fn = fn;
-        args->bb = fn->bbs;
+    args->fn = fn;
+    args->bb = fn->bbs;
 
-        fn->visited++;
-        args->postorder_cb = bb_solve_globals;
-        bb_forward_traversal(args);
-    }
+    fn->visited++;
+    args->postorder_cb = bb_solve_globals;
+    bb_forward_traversal(args);
     free(args);
 }
 
+void solve_globals()
+{
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next)
+        fn_solve_globals(fn);
+}
+
 bool var_check_in_scope(var_t *var, block_t *block)
 {
     func_t *fn = block->func;
 
     while (block) {
         for (int i = 0; i < block->next_local; i++) {
-            var_t *locals = block->locals;
-            if (var == &locals[i])
+            if (var == block_local(block, i))
                 return true;
         }
         block = block->parent;
@@ -415,69 +434,75 @@ bool insert_phi_insn(basic_block_t *bb, var_t *var)
     return true;
 }
 
-void solve_phi_insertion()
+void fn_solve_phi_insertion(fn_t *fn)
 {
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        for (symbol_t *sym = fn->global_sym_list.head; sym; sym = sym->next) {
-            var_t *var = sym->var;
+    for (symbol_t *sym = fn->global_sym_list.head; sym; sym = sym->next) {
+        var_t *var = sym->var;
 
-            basic_block_t *work_list[64];
-            int work_list_idx = 0;
+        /* Global variables never take phi nodes. Their blocks are collected
+         * over the whole program, including the ones of released functions.
+         */
+        if (var->is_global)
+            continue;
 
-            for (ref_block_t *ref = var->ref_block_list.head; ref;
-                 ref = ref->next)
-                work_list[work_list_idx++] = ref->bb;
+        basic_block_t *work_list[64];
+        int work_list_idx = 0;
 
-            for (int i = 0; i < work_list_idx; i++) {
-                basic_block_t *bb = work_list[i];
-                for (int j = 0; j < bb->df_idx; j++) {
-                    basic_block_t *df = bb->DF[j];
-                    if (!var_check_in_scope(var, df->scope))
-                        continue;
+        for (ref_block_t *ref = var->ref_block_list.head; ref; ref = ref->next)
+            work_list[work_list_idx++] = ref->bb;
 
-                    bool is_decl = false;
-                    for (symbol_t *s = df->symbol_list.head; s; s = s->next) {
-                        if (s->var == var) {
-                            is_decl = true;
-                            break;
-                        }
+        for (int i = 0; i < work_list_idx; i++) {
+            basic_block_t *bb = work_list[i];
+            for (int j = 0; j < bb->df_idx; j++) {
+                basic_block_t *df = bb->DF[j];
+                if (!var_check_in_scope(var, df->scope))
+                    continue;
+
+                bool is_decl = false;
+                for (symbol_t *s = df->symbol_list.head; s; s = s->next) {
+                    if (s->var == var) {
+                        is_decl = true;
+                        break;
                     }
+                }
 
-                    if (is_decl)
-                        continue;
+                if (is_decl)
+                    continue;
 
-                    if (df == fn->exit)
-                        continue;
+                if (df == fn->exit)
+                    continue;
+
+                if (insert_phi_insn(df, var)) {
+                    bool found = false;
 
-                    if (var->is_global)
+                    /* Restrict phi insertion of ternary operation.
+                     *
+                     * The ternary operation doesn't create new scope, so
+                     * prevent temporary variable from propagating through
+                     * the dominance tree.
+                     */
+                    if (var->is_ternary_ret)
                         continue;
 
-                    if (insert_phi_insn(df, var)) {
-                        bool found = false;
-
-                        /* Restrict phi insertion of ternary operation.
-                         *
-                         * The ternary operation doesn't create new scope, so
-                         * prevent temporary variable from propagating through
-                         * the dominance tree.
-                         */
-                        if (var->is_ternary_ret)
-                            continue;
-
-                        for (int l = 0; l < work_list_idx; l++)
-                            if (work_list[l] == df) {
-                                found = true;
-                                break;
-                            }
-                        if (!found)
-                            work_list[work_list_idx++] = df;
-                    }
+                    for (int l = 0; l < work_list_idx; l++)
+                        if (work_list[l] == df) {
+                            found = true;
+                            break;
+                        }
+                    if (!found)
+                        work_list[work_list_idx++] = df;
                 }
             }
         }
     }
 }
 
+void solve_phi_insertion()
+{
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next)
+        fn_solve_phi_insertion(fn);
+}
+
 var_t *require_var(block_t *blk);
 
 void new_name(block_t *block, var_t **var)
@@ -598,24 +623,27 @@ void bb_solve_phi_params(basic_block_t *bb)
     }
 }
 
-void solve_phi_params()
+void fn_solve_phi_params(fn_t *fn)
 {
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        for (int i = 0; i < fn->func->num_params; i++) {
-            /* FIXME: Rename arguments directly, might be not good here. */
-            var_t *var = require_var(fn->bbs->scope);
-            var_t *base = &fn->func->param_defs[i];
-            memcpy(var, base, sizeof(var_t));
-            var->base = base;
-            var->subscript = 0;
-
-            base->rename.stack[base->rename.stack_idx++] =
-                base->rename.counter++;
-            base->subscripts[base->subscripts_idx++] = var;
-        }
+    for (int i = 0; i < fn->func->num_params; i++) {
+        /* FIXME: Rename arguments directly, might be not good here. */
+        var_t *var = require_var(fn->bbs->scope);
+        var_t *base = &fn->func->param_defs[i];
+        memcpy(var, base, sizeof(var_t));
+        var->base = base;
+        var->subscript = 0;
 
-        bb_solve_phi_params(fn->bbs);
+        base->rename.stack[base->rename.stack_idx++] = base->rename.counter++;
+        base->subscripts[base->subscripts_idx++] = var;
     }
+
+    bb_solve_phi_params(fn->bbs);
+}
+
+void solve_phi_params()
+{
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next)
+        fn_solve_phi_params(fn);
 }
 
 void append_unwound_phi_insn(basic_block_t *bb, var_t *dest, var_t *rs)
@@ -642,6 +670,7 @@ void append_unwound_phi_insn(basic_block_t *bb, var_t *dest, var_t *rs)
             tail->prev = n;
         } else {
             tail->next = n;
+            n->prev = tail;
             bb->insn_list.tail = n;
         }
     }
@@ -663,24 +692,30 @@ void bb_unwind_phi(fn_t *fn, basic_block_t *bb)
     }
 
     bb->insn_list.head = insn;
-    if (!insn)
+    if (insn)
+        insn->prev = NULL;
+    else
         bb->insn_list.tail = NULL;
 }
 
-void unwind_phi()
+void fn_unwind_phi(fn_t *fn)
 {
     bb_traversal_args_t *args = calloc(1, sizeof(bb_traversal_args_t));
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        args->fn = fn;
-        args->bb = fn->bbs;
+    args->fn = fn;
+    args->bb = fn->bbs;
 
-        fn->visited++;
-        args->preorder_cb = bb_unwind_phi;
-        bb_forward_traversal(args);
-    }
+    fn->visited++;
+    args->preorder_cb = bb_unwind_phi;
+    bb_forward_traversal(args);
     free(args);
 }
 
+void unwind_phi()
+{
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next)
+        fn_unwind_phi(fn);
+}
+
 /*
  * The current cfonrt does not yet support string literal addressing, which
  * results in the omission of basic block visualization during the stage-1 and
@@ -1002,6 +1037,23 @@ void dump_dom(char name[])
 }
 #endif
 
+/* Build the SSA form of a single function, for the function-at-a-time mode.
+ * The control flow graphs are not dumped in this mode.
+ */
+void fn_ssa_build(fn_t *fn)
+{
+    fn_build_rpo(fn);
+    fn_build_idom(fn);
+    fn_build_dom(fn);
+    fn_build_df(fn);
+
+    fn_solve_globals(fn);
+    fn_solve_phi_insertion(fn);
+    fn_solve_phi_params(fn);
+
+    fn_unwind_phi(fn);
+}
+
 void ssa_build(int dump_ir)
 {
     build_rpo();
@@ -1166,21 +1218,19 @@ bool const_folding(insn_t *insn)
     return false;
 }
 
-void optimize()
+void fn_cse(fn_t *fn)
 {
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        /* basic block level (control flow) optimizations */
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next)
+            cse(insn, bb);
+    }
+}
 
-        for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
-            /* instruction level optimizations */
-            for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
-                if (cse(insn, bb))
-                    continue;
-                if (const_folding(insn))
-                    continue;
-                /* more optimizations */
-            }
-        }
+void fn_const_folding(fn_t *fn)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next)
+            const_folding(insn);
     }
 }
 
@@ -1215,29 +1265,33 @@ void bb_build_reversed_rpo(fn_t *fn, basic_block_t *bb)
     prev->rpo_r_next = bb;
 }
 
-void build_reversed_rpo()
+void fn_build_reversed_rpo(fn_t *fn)
 {
     bb_traversal_args_t *args = calloc(1, sizeof(bb_traversal_args_t));
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        fn->bb_cnt = 0;
-        args->fn = fn;
-        args->bb = fn->exit;
+    fn->bb_cnt = 0;
+    args->fn = fn;
+    args->bb = fn->exit;
 
-        fn->visited++;
-        args->postorder_cb = bb_index_reversed_rpo;
-        bb_backward_traversal(args);
+    fn->visited++;
+    args->postorder_cb = bb_index_reversed_rpo;
+    bb_backward_traversal(args);
 
-        fn->visited++;
-        args->postorder_cb = bb_reverse_reversed_index;
-        bb_backward_traversal(args);
+    fn->visited++;
+    args->postorder_cb = bb_reverse_reversed_index;
+    bb_backward_traversal(args);
 
-        fn->visited++;
-        args->postorder_cb = bb_build_reversed_rpo;
-        bb_backward_traversal(args);
-    }
+    fn->visited++;
+    args->postorder_cb = bb_build_reversed_rpo;
+    bb_backward_traversal(args);
     free(args);
 }
 
+void build_reversed_rpo()
+{
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next)
+        fn_build_reversed_rpo(fn);
+}
+
 void bb_reset_live_kill_idx(fn_t *fn, basic_block_t *bb)
 {
     UNUSED(fn);
@@ -1256,10 +1310,21 @@ void add_live_gen(basic_block_t *bb, var_t *var)
     bb->live_gen[bb->live_gen_idx++] = var;
 }
 
-void update_consumed(insn_t *insn, var_t *var)
+void update_consumed(int idx, var_t *var)
 {
-    if (insn->idx > var->consumed)
-        var->consumed = insn->idx;
+#ifdef __SHECC__
+#else
+    /* global variables are read by the functions of all '-j' threads */
+    if (var->is_global) {
+        pthread_mutex_lock(&shared_lock);
+        if (idx > var->consumed)
+            var->consumed = idx;
+        pthread_mutex_unlock(&shared_lock);
+        return;
+    }
+#endif
+    if (idx > var->consumed)
+        var->consumed = idx;
 }
 
 void bb_solve_locals(fn_t *fn, basic_block_t *bb)
@@ -1273,12 +1338,20 @@ void bb_solve_locals(fn_t *fn, basic_block_t *bb)
         if (insn->rs1) {
             if (!var_check_killed(insn->rs1, bb))
                 add_live_gen(bb, insn->rs1);
-            update_consumed(insn, insn->rs1);
+            update_consumed(insn->idx, insn->rs1);
+
+            /* A global variable is shared by all the functions, so its
+             * liveness is extended here for every argument pushed, rather
+             * than while the registers of one of them are allocated.
+             */
+            if (insn->opcode == OP_push)
+                if (insn->rs1->is_global)
+                    update_consumed(insn->idx + insn->sz, insn->rs1);
         }
         if (insn->rs2) {
             if (!var_check_killed(insn->rs2, bb))
                 add_live_gen(bb, insn->rs2);
-            update_consumed(insn, insn->rs2);
+            update_consumed(insn->idx, insn->rs2);
         }
         if (insn->rd)
             if (insn->opcode != OP_unwound_phi)
@@ -1365,36 +1438,42 @@ bool recompute_live_out(basic_block_t *bb)
     return false;
 }
 
-void liveness_analysis()
+void fn_liveness_analysis(fn_t *fn)
 {
-    build_reversed_rpo();
+    fn_build_reversed_rpo(fn);
 
     bb_traversal_args_t *args = calloc(1, sizeof(bb_traversal_args_t));
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        args->fn = fn;
-        args->bb = fn->bbs;
+    args->fn = fn;
+    args->bb = fn->bbs;
 
-        fn->visited++;
-        args->preorder_cb = bb_reset_live_kill_idx;
-        bb_forward_traversal(args);
+    fn->visited++;
+    args->preorder_cb = bb_reset_live_kill_idx;
+    bb_forward_traversal(args);
 
-        for (int i = 0; i < fn->func->num_params; i++)
-            bb_add_killed_var(fn->bbs, fn->func->param_defs[i].subscripts[0]);
+    for (int i = 0; i < fn->func->num_params; i++)
+        bb_add_killed_var(fn->bbs, fn->func->param_defs[i].subscripts[0]);
 
-        fn->visited++;
-        args->preorder_cb = bb_solve_locals;
-        bb_forward_traversal(args);
-    }
+    fn->visited++;
+    args->preorder_cb = bb_solve_locals;
+    bb_forward_traversal(args);
     free(args);
 
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        basic_block_t *bb = fn->exit;
-        bool changed;
-        do {
-            changed = false;
-            for (bb = fn->exit; bb; bb = bb->rpo_r_next)
-                changed |= recompute_live_out(bb);
-        } while (changed);
+    basic_block_t *bb = fn->exit;
+    bool changed;
+    do {
+        changed = false;
+        for (bb = fn->exit; bb; bb = bb->rpo_r_next)
+            changed |= recompute_live_out(bb);
+    } while (changed);
+}
+
+void bb_unlink_pred(basic_block_t *succ, basic_block_t *bb)
+{
+    if (!succ)
+        return;
+    for (int i = 0; i < MAX_BB_PRED; i++) {
+        if (succ->prev[i].bb == bb)
+            succ->prev[i].bb = NULL;
     }
 }
 
@@ -1402,6 +1481,14 @@ void bb_release(fn_t *fn, basic_block_t *bb)
 {
     UNUSED(fn);
 
+    /* Released successors have already cleared the edges pointing to them, so
+     * the remaining ones lead to blocks which are still alive, e.g. the header
+     * of a loop. Unlink from them to keep them away from freed memory.
+     */
+    bb_unlink_pred(bb->next, bb);
+    bb_unlink_pred(bb->then_, bb);
+    bb_unlink_pred(bb->else_, bb);
+
     insn_t *insn = bb->insn_list.head;
     insn_t *next_insn;
     while (insn) {
@@ -1433,16 +1520,27 @@ void bb_release(fn_t *fn, basic_block_t *bb)
     free(bb);
 }
 
-void ssa_release()
+void fn_ssa_release(fn_t *fn)
 {
+    /* already released in function-at-a-time mode */
+    if (!fn->bbs)
+        return;
+
     bb_traversal_args_t *args = calloc(1, sizeof(bb_traversal_args_t));
-    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next) {
-        args->fn = fn;
-        args->bb = fn->bbs;
+    args->fn = fn;
+    args->bb = fn->bbs;
 
-        fn->visited++;
-        args->postorder_cb = bb_release;
-        bb_forward_traversal(args);
-    }
+    fn->visited++;
+    args->postorder_cb = bb_release;
+    bb_forward_traversal(args);
     free(args);
+
+    fn->bbs = NULL;
+    fn->exit = NULL;
+}
+
+void ssa_release()
+{
+    for (fn_t *fn = FUNC_LIST.head; fn; fn = fn->next)
+        fn_ssa_release(fn);
 }
@@ -0,0 +1,282 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* Strength reduction replaces the addresses a loop computes from one of its
+ * induction variables, like those of the elements of an array, with
+ * pointers of their own, set before the loop and stepped along with the
+ * induction variables:
+ *
+ *   for (i = start; i < n; i++)        p = a + start * size;
+ *       s += a[i];                     for (i = start; i < n; i++) {
+ *                                          s += *p;
+ *                                          p += size;
+ *                                      }
+ *
+ * which saves the multiplication, a call on RISC-V without '+m', and the
+ * addition. The pointer is one more phi function of the header. It is
+ * stepped right after its last use when all of them are in a block run once
+ * per iteration of an innermost loop, so that the register allocation may
+ * turn a read followed by the step into a single post-indexed load.
+ */
+
+/* Whether 'insn' of 'loop' computes an address 'base + iv * k', of an
+ * invariant base and an induction variable, which are set with 'k'.
+ */
+bool reducible_address(fn_t *fn,
+                       loop_t *loop,
+                       insn_t *insn,
+                       var_t **iv,
+                       int *k)
+{
+    if (insn->opcode != OP_add)
+        return false;
+    var_t *base = insn->rs1, *ofs = insn->rs2;
+    if (insn->rd->is_global | base->is_global | ofs->is_global)
+        return false;
+    if (loop_var_def(fn, base))
+        return false;
+    if (var_address_taken(fn, base))
+        return false;
+
+    iv[0] = ofs;
+    k[0] = 1;
+    if (loop_phi(loop, ofs) < 0) {
+        insn_t *mul = loop_var_def(fn, ofs);
+        if (!mul)
+            return false;
+        if (mul->opcode != OP_mul)
+            return false;
+        if (mul->rs2->is_const & !mul->rs2->is_global) {
+            iv[0] = mul->rs1;
+            k[0] = mul->rs2->init_val;
+        } else if (mul->rs1->is_const & !mul->rs1->is_global) {
+            iv[0] = mul->rs2;
+            k[0] = mul->rs1->init_val;
+        } else
+            return false;
+    }
+
+    int phi = loop_phi(loop, iv[0]);
+    if (phi < 0)
+        return false;
+    if (!iv_step(fn, loop, phi))
+        return false;
+    if (!loop_entry_value(loop, iv[0]))
+        return false;
+    if (var_address_taken(fn, iv[0]))
+        return false;
+    if (k[0] != 1)
+        return true;
+
+    /* without a multiplication to save, only the addresses of the reads and
+     * writes are worth a pointer
+     */
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *i = bb->insn_list.head; i; i = i->next) {
+            if (i->rs2 == insn->rd)
+                return false;
+            if (i->rs1 != insn->rd)
+                continue;
+            if ((i->opcode != OP_read) & (i->opcode != OP_write))
+                return false;
+        }
+    }
+    return true;
+}
+
+/* Replace the uses of 'from' in 'fn' with 'to' */
+void replace_var(fn_t *fn, var_t *from, var_t *to)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (insn->rs1 == from)
+                insn->rs1 = to;
+            if (insn->rs2 == from)
+                insn->rs2 = to;
+        }
+    }
+}
+
+/* Remove the definition of 'var' from 'fn' */
+void remove_def(fn_t *fn, var_t *var)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (insn_t *insn = bb->insn_list.head; insn; insn = insn->next) {
+            if (insn->rd == var) {
+                remove_insn(bb, insn);
+                return;
+            }
+        }
+    }
+}
+
+/* Whether 'loop' holds no other loop */
+bool loop_innermost(fn_t *fn, loop_t *loop)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        if (bb->loop != fn->loops)
+            continue;
+        if (bb == loop->latch)
+            continue;
+        if (bb->next)
+            if (bb->next->rpo <= bb->rpo)
+                return false;
+        if (bb->then_)
+            if (bb->then_->rpo <= bb->rpo)
+                return false;
+        if (bb->else_)
+            if (bb->else_->rpo <= bb->rpo)
+                return false;
+    }
+    return true;
+}
+
+/* The last instruction of 'loop' reading 'var' if all of them are in a
+ * block run once per iteration, set with 'bb', or NULL.
+ */
+insn_t *last_use(fn_t *fn, loop_t *loop, var_t *var, basic_block_t **bb)
+{
+    insn_t *last = NULL;
+    for (basic_block_t *b = fn->bbs; b; b = b->rpo_next) {
+        if (b->loop != fn->loops)
+            continue;
+        for (insn_t *insn = b->insn_list.head; insn; insn = insn->next) {
+            if ((insn->rs1 != var) & (insn->rs2 != var))
+                continue;
+            if (last)
+                if (bb[0] != b)
+                    return NULL;
+            bb[0] = b;
+            last = insn;
+        }
+    }
+    if (!last)
+        return NULL;
+    if (last->opcode == OP_branch)
+        return NULL;
+
+    /* the block dominates the latch */
+    for (basic_block_t *b = loop->latch; b != bb[0]; b = b->idom) {
+        if (b == loop->header)
+            return NULL;
+    }
+    return last;
+}
+
+void reduce_loop(fn_t *fn, loop_t *loop)
+{
+    block_t *scope = loop->header->scope;
+    var_t *base[MAX_REDUCED];
+    var_t *iv[MAX_REDUCED];
+    int scale[MAX_REDUCED];
+    var_t *ptr[MAX_REDUCED];
+    int n = 0;
+
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        if (bb->loop != fn->loops)
+            continue;
+
+        insn_t *next;
+        for (insn_t *insn = bb->insn_list.head; insn; insn = next) {
+            next = insn->next;
+            var_t *v;
+            int k;
+            if (!reducible_address(fn, loop, insn, &v, &k))
+                continue;
+
+            int i = 0;
+            while (i < n) {
+                if ((base[i] == insn->rs1) & (iv[i] == v) & (scale[i] == k))
+                    break;
+                i++;
+            }
+            if (i == n) {
+                if (n == MAX_REDUCED)
+                    continue;
+                /* the pointer and the values computing it */
+                if (scope->next_local + 8 > MAX_LOCALS)
+                    continue;
+                base[n] = insn->rs1;
+                iv[n] = v;
+                scale[n] = k;
+                ptr[n++] = copy_var(scope, insn->rd);
+            }
+
+            var_t *ofs = insn->rs2;
+            replace_var(fn, insn->rd, ptr[i]);
+            remove_insn(bb, insn);
+            if (ofs != v)
+                if (!var_uses(fn, ofs))
+                    remove_def(fn, ofs);
+        }
+    }
+
+    bool innermost = loop_innermost(fn, loop);
+    for (int i = 0; i < n; i++) {
+        int phi = loop_phi(loop, iv[i]);
+        var_t *start = loop_entry_value(loop, iv[i]);
+
+        /* p = base + start * scale, before the loop */
+        basic_block_t *pre = loop->pre;
+        var_t *first = copy_var(scope, ptr[i]);
+        var_t *c = copy_var(scope, iv[i]);
+        c->is_const = true;
+        if (start->is_const & (start->init_val * scale[i] == 0))
+            add_insn(pre->scope, pre, OP_assign, first, base[i], NULL, 0,
+                     NULL);
+        else if (start->is_const) {
+            c->init_val = start->init_val * scale[i];
+            add_insn(pre->scope, pre, OP_load_constant, c, NULL, NULL, 0,
+                     NULL);
+            add_insn(pre->scope, pre, OP_add, first, base[i], c, 0, NULL);
+        } else if (scale[i] == 1)
+            add_insn(pre->scope, pre, OP_add, first, base[i], start, 0, NULL);
+        else {
+            var_t *ofs = copy_var(scope, iv[i]);
+            c->init_val = scale[i];
+            add_insn(pre->scope, pre, OP_load_constant, c, NULL, NULL, 0,
+                     NULL);
+            add_insn(pre->scope, pre, OP_mul, ofs, start, c, 0, NULL);
+            add_insn(pre->scope, pre, OP_add, first, base[i], ofs, 0, NULL);
+        }
+        add_insn(pre->scope, pre, OP_unwound_phi, ptr[i], first, NULL, 0,
+                 NULL);
+
+        /* p += step * scale, after its last use if it can be told */
+        var_t *step = copy_var(scope, iv[i]);
+        var_t *stepped = copy_var(scope, ptr[i]);
+        step->is_const = true;
+        step->init_val = iv_step(fn, loop, phi) * scale[i];
+        basic_block_t *bb = loop->latch;
+        insn_t *last = NULL;
+        if (innermost)
+            last = last_use(fn, loop, ptr[i], &bb);
+        if (!last) {
+            bb = loop->latch;
+            /* before the unwound phi functions, which may read 'p' */
+            last = bb->insn_list.tail;
+            while (last) {
+                if (last->opcode != OP_unwound_phi)
+                    break;
+                last = last->prev;
+            }
+        }
+        last = insert_insn(bb, last, OP_load_constant, step, NULL, NULL);
+        insert_insn(bb, last, OP_add, stepped, ptr[i], step);
+        add_insn(loop->latch->scope, loop->latch, OP_unwound_phi, ptr[i],
+                 stepped, NULL, 0, NULL);
+    }
+}
+
+void fn_strength_reduce(fn_t *fn)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        loop_t loop;
+        if (find_loop(fn, bb, &loop))
+            reduce_loop(fn, &loop);
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* A call whose value is returned at once, or the last one of a function
+ * returning nothing, becomes OP_tail_call: the function releases its stack
+ * frame and restores its return address, then branches to the callee, which
+ * returns to the caller of the function. Recursion in tail position then
+ * runs in constant stack.
+ *
+ * The arguments are all passed in registers, so they always fit, but the
+ * stack of the function is gone by the time the callee runs. The functions
+ * taking the address of their stack keep their calls.
+ */
+
+/* Whether 'fn' takes the address of a variable on its stack */
+bool fn_takes_stack_address(fn_t *fn)
+{
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (ph2_ir_t *ph2_ir = bb->ph2_ir_list.head; ph2_ir;
+             ph2_ir = ph2_ir->next) {
+            if (ph2_ir->op == OP_address_of)
+                return true;
+        }
+    }
+    return false;
+}
+
+void fn_tail_call(fn_t *fn)
+{
+    if (fn_takes_stack_address(fn))
+        return;
+
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (ph2_ir_t *call = bb->ph2_ir_list.head; call; call = call->next) {
+            if (call->op != OP_call)
+                continue;
+            /* Thumb code reaches the ARM system call stub with BLX only */
+            if (thumb & !strcmp(call->func_name, "__syscall"))
+                continue;
+
+            /* the returned value, if any, is the one of the call in r0 */
+            ph2_ir_t *ret = call->next;
+            int reg = 0;
+            if (!ret)
+                continue;
+            if (ret->op == OP_assign) {
+                if (ret->src0)
+                    continue;
+                reg = ret->dest;
+                ret = ret->next;
+                if (!ret)
+                    continue;
+            }
+            if (ret->op != OP_return)
+                continue;
+            if ((ret->src0 != -1) & (ret->src0 != reg))
+                continue;
+
+            call->op = OP_tail_call;
+            call->next = NULL;
+            bb->ph2_ir_list.tail = call;
+        }
+    }
+
+    /* a function left with tail calls only keeps its return address in lr */
+    fn->is_leaf = true;
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        for (ph2_ir_t *ph2_ir = bb->ph2_ir_list.head; ph2_ir;
+             ph2_ir = ph2_ir->next) {
+            if ((ph2_ir->op == OP_call) | (ph2_ir->op == OP_indirect))
+                fn->is_leaf = false;
+        }
+    }
+}
@@ -0,0 +1,282 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* Tail merging shrinks the code of a function in two ways. When it returns
+ * from several places and its epilogue takes more than the return itself,
+ * the returns move their value into the first register and jump to a single
+ * epilogue, held by the exit block of the function.
+ *
+ * Then cross-jumping looks for two blocks going on to the same block and
+ * ending with the same instructions. One of them keeps them, split off into
+ * a block of its own unless they are all its instructions, and the other
+ * one jumps there instead. The registers are already allocated, so that the
+ * same instructions compute the same values.
+ */
+
+/* The block 'bb' goes on to without branching, or NULL. 'last' is set to
+ * the jump ending 'bb', or to NULL if it falls through.
+ */
+basic_block_t *tail_succ(basic_block_t *bb, ph2_ir_t **last)
+{
+    ph2_ir_t *tail = bb->ph2_ir_list.tail;
+
+    last[0] = NULL;
+    if (!tail)
+        return bb->rpo_next;
+
+    switch (tail->op) {
+    case OP_jump:
+        last[0] = tail;
+        return tail->next_bb;
+    case OP_branch:
+    case OP_return:
+    case OP_tail_call:
+        return NULL;
+    default:
+        return bb->rpo_next;
+    }
+}
+
+/* The instruction preceding 'ph2_ir' in 'bb', or NULL */
+ph2_ir_t *ph2_prev(basic_block_t *bb, ph2_ir_t *ph2_ir)
+{
+    ph2_ir_t *prev = NULL;
+
+    for (ph2_ir_t *p = bb->ph2_ir_list.head; p != ph2_ir; p = p->next)
+        prev = p;
+    return prev;
+}
+
+/* The last instructions of 'bb' before 'last', at most MAX_TAIL of them, in
+ * 'insns'. Returns their number.
+ */
+int tail_insns(basic_block_t *bb, ph2_ir_t *last, ph2_ir_t *insns[])
+{
+    int n = 0;
+
+    for (ph2_ir_t *ph2_ir = bb->ph2_ir_list.head; ph2_ir != last;
+         ph2_ir = ph2_ir->next) {
+        if (n == MAX_TAIL) {
+            for (int i = 1; i < n; i++)
+                insns[i - 1] = insns[i];
+            n--;
+        }
+        insns[n++] = ph2_ir;
+    }
+    return n;
+}
+
+bool ph2_equal(ph2_ir_t *a, ph2_ir_t *b)
+{
+    if (a->op != b->op)
+        return false;
+    if ((a->src0 != b->src0) | (a->src1 != b->src1) | (a->dest != b->dest))
+        return false;
+    if (a->pred != b->pred)
+        return false;
+    return !strcmp(a->func_name, b->func_name);
+}
+
+/* Remove the instructions of 'bb' from 'first' on */
+void truncate_ph2_ir(basic_block_t *bb, ph2_ir_t *first)
+{
+    ph2_ir_t *prev = ph2_prev(bb, first);
+    ph2_ir_t *next;
+
+    if (prev)
+        prev->next = NULL;
+    else
+        bb->ph2_ir_list.head = NULL;
+    bb->ph2_ir_list.tail = prev;
+
+    for (; first; first = next) {
+        next = first->next;
+        free(first);
+    }
+}
+
+/* Split the instructions of 'bb' from 'first' on into a new block following
+ * it, which also takes its successors in the CFG, and return it.
+ */
+basic_block_t *split_tail(basic_block_t *bb, ph2_ir_t *first)
+{
+    basic_block_t *tail = bb_create(bb->scope);
+    ph2_ir_t *prev = ph2_prev(bb, first);
+
+    tail->visited = bb->visited;
+
+    tail->ph2_ir_list.head = first;
+    tail->ph2_ir_list.tail = bb->ph2_ir_list.tail;
+    prev->next = NULL;
+    bb->ph2_ir_list.tail = prev;
+
+    tail->rpo_next = bb->rpo_next;
+    bb->rpo_next = tail;
+
+    for (int i = 0; i < 3; i++) {
+        basic_block_t *succ = bb->next;
+        bb_connection_type_t type = NEXT;
+        if (i == 1) {
+            succ = bb->then_;
+            type = THEN;
+        }
+        if (i == 2) {
+            succ = bb->else_;
+            type = ELSE;
+        }
+        if (!succ)
+            continue;
+        bb_disconnect(bb, succ);
+        bb_connect(tail, succ, type);
+    }
+    bb_connect(bb, tail, NEXT);
+    return tail;
+}
+
+/* Have the returns of 'fn' jump to a single epilogue in its exit block */
+void share_epilogue(fn_t *fn)
+{
+    basic_block_t *exit = fn->exit;
+    int returns = 0;
+    int val = -1;
+
+    if (!exit)
+        return;
+    if (exit->ph2_ir_list.head)
+        return;
+    /* a leaf without a stack frame returns in a single instruction */
+    if (fn->is_leaf & !frame_size(fn))
+        return;
+
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        ph2_ir_t *ret = bb->ph2_ir_list.tail;
+        if (!ret)
+            continue;
+        if (ret->op != OP_return)
+            continue;
+        returns++;
+        if (ret->src0 != -1)
+            val = 0;
+    }
+    if (returns < 2)
+        return;
+
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+        ph2_ir_t *ret = bb->ph2_ir_list.tail;
+        if (!ret)
+            continue;
+        if (ret->op != OP_return)
+            continue;
+
+        if ((ret->src0 != -1) & (ret->src0 != 0)) {
+            ret->op = OP_assign;
+            ret->dest = 0;
+        } else
+            truncate_ph2_ir(bb, ret);
+        if (bb->rpo_next != exit) {
+            ph2_ir_t *jump = bb_add_ph2_ir(bb, OP_jump);
+            jump->next_bb = exit;
+        }
+    }
+
+    ph2_ir_t *ret = bb_add_ph2_ir(exit, OP_return);
+    ret->src0 = val;
+}
+
+/* Have 'bb' jump to 'to', ending with the instructions of 'bb' from 'first'
+ * on, instead of running them
+ */
+void cross_jump(basic_block_t *bb, ph2_ir_t *first, basic_block_t *to)
+{
+    truncate_ph2_ir(bb, first);
+    if (bb->rpo_next != to) {
+        ph2_ir_t *jump = bb_add_ph2_ir(bb, OP_jump);
+        jump->next_bb = to;
+    }
+}
+
+/* Merge the tail of 'bb' with the one of another block, if any, and return
+ * whether it was.
+ */
+bool merge_tail(fn_t *fn, basic_block_t *bb)
+{
+    ph2_ir_t *insns[MAX_TAIL];
+    ph2_ir_t *other_insns[MAX_TAIL];
+    ph2_ir_t *last;
+    ph2_ir_t *other_last;
+
+    basic_block_t *succ = tail_succ(bb, &last);
+    if (!succ)
+        return false;
+    int n = tail_insns(bb, last, insns);
+    if (!n)
+        return false;
+
+    for (basic_block_t *other = fn->bbs; other; other = other->rpo_next) {
+        if (other == bb)
+            continue;
+        if (other->visited == fn->visited)
+            continue;
+        if (tail_succ(other, &other_last) != succ)
+            continue;
+        int other_n = tail_insns(other, other_last, other_insns);
+
+        int k = 0;
+        while ((k < n) & (k < other_n)) {
+            if (!ph2_equal(insns[n - 1 - k], other_insns[other_n - 1 - k]))
+                break;
+            k++;
+        }
+
+        /* 'bb' jumps to the other block instead of the block following it,
+         * or needs a jump of its own if it fell through
+         */
+        if (!k)
+            continue;
+        if (!last)
+            if (k < 2)
+                continue;
+
+        ph2_ir_t *first = other_insns[other_n - k];
+        basic_block_t *to = other;
+        if (first != other->ph2_ir_list.head)
+            to = split_tail(other, first);
+        cross_jump(bb, insns[n - k], to);
+
+        bb->visited = fn->visited;
+        other->visited = fn->visited;
+        to->visited = fn->visited;
+        return true;
+    }
+    return false;
+}
+
+void fn_tail_merge(fn_t *fn)
+{
+    share_epilogue(fn);
+
+    /* Each merge removes instructions. The blocks involved are left alone
+     * until the next round.
+     */
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        fn->visited++;
+        for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next) {
+            if (bb->visited == fn->visited)
+                continue;
+            if (merge_tail(fn, bb))
+                merged = true;
+        }
+    }
+
+    /* the traversals of the CFG expect its blocks all left as visited */
+    for (basic_block_t *bb = fn->bbs; bb; bb = bb->rpo_next)
+        bb->visited = fn->visited;
+    if (fn->exit)
+        fn->exit->visited = fn->visited;
+}
@@ -0,0 +1,380 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* Translate IR to Thumb-2 code, with the option '-mthumb'.
+ *
+ * The code preceding the functions stays in ARM state: '_start' enters the
+ * global initialization with BLX, and the functions call '__syscall' with
+ * BLX too, while the other calls remain in Thumb state. The functions start
+ * on a word boundary.
+ */
+
+#include "thumb.c"
+
+void thumb_write(int code)
+{
+    if (thumb_size(code) == 4)
+        elf_write_code_short(code >> 16);
+    elf_write_code_short(code);
+}
+
+/* The instructions of the branches merged by if-conversion have an IT block
+ * each, which also keeps the 16-bit forms from updating the flags.
+ */
+void emit_thumb(int code)
+{
+    if (arm_pred != NEXT)
+        thumb_write(__t_it(arm_pred_cond()));
+    thumb_write(code);
+}
+
+/* Align the code of the next function to a word */
+void thumb_pad()
+{
+    if (thumb) {
+        if (elf_code_idx & 2)
+            emit_thumb(__t_nop());
+    }
+}
+
+void thumb_load_constant(arm_reg rd, int imm)
+{
+    if ((imm >= 0) & (imm < 256))
+        emit_thumb(__t_mov_i(rd, imm));
+    else if ((imm < 0) & (imm >= -256))
+        emit_thumb(__t_mvn_i(rd, ~imm));
+    else {
+        emit_thumb(__t_movw(rd, imm));
+        if (imm >> 16)
+            emit_thumb(__t_movt(rd, imm));
+    }
+}
+
+/* rd = rn + ofs, with 'ofs' non-negative */
+void thumb_add_ofs(arm_reg rd, arm_reg rn, int ofs)
+{
+    if (ofs < 0)
+        abort();
+    if (ofs < 4096)
+        emit_thumb(__t_add_i(rd, rn, ofs));
+    else {
+        thumb_load_constant(__r8, ofs);
+        emit_thumb(__t_add_r(rd, rn, __r8));
+    }
+}
+
+void thumb_load(arm_reg rt, arm_reg rn, int ofs)
+{
+    if (ofs < 0)
+        abort();
+    if (ofs < 4096)
+        emit_thumb(__t_lw(rt, rn, ofs));
+    else {
+        thumb_load_constant(__r8, ofs);
+        emit_thumb(__t_lw_r(rt, rn, __r8));
+    }
+}
+
+void thumb_store(arm_reg rt, arm_reg rn, int ofs)
+{
+    if (ofs < 0)
+        abort();
+    if (ofs < 4096)
+        emit_thumb(__t_sw(rt, rn, ofs));
+    else {
+        thumb_load_constant(__r8, ofs);
+        emit_thumb(__t_sw_r(rt, rn, __r8));
+    }
+}
+
+/* Unsigned integer division of 'rn' by 'rm', leaving the quotient in r9 and
+ * the remainder in 'rn'. The loops use 16-bit branches, whose offsets come
+ * from the sizes of the instructions in between.
+ */
+void thumb_udiv(arm_reg rn, arm_reg rm)
+{
+    int cmp_rn = __t_cmp_i(rn, 0);
+    int cmp_up = __t_cmp_r(rm, rn);
+    int shift_rm = __t_shift_i(0, logic_ls, rm, rm, 1);
+    int shift_r8 = __t_shift_i(0, logic_ls, __r8, __r8, 1);
+    int cmp_down = __t_cmp_r(rn, rm);
+    int sub = __t_sub_r(rn, rn, rm);
+    int add = __t_add_r(__r9, __r9, __r8);
+    int unshift_r8 = __t_shift_i(1, logic_rs, __r8, __r8, 1);
+    int unshift_rm = __t_shift_i(0, logic_rs, rm, rm, 1);
+    int up = thumb_size(cmp_up) + 2 + thumb_size(shift_rm) +
+             thumb_size(shift_r8);
+    int down = thumb_size(cmp_down) + 2 + thumb_size(sub) + thumb_size(add) +
+               thumb_size(unshift_r8) + 2 + thumb_size(unshift_rm);
+    int loops = up + 2 + down + 2;
+
+    emit_thumb(__t_mov_i(__r9, 0));
+    emit_thumb(__t_mov_i(__r8, 1));
+    emit_thumb(__t_cmp_i(rm, 0));
+    emit_thumb(__t_b_cond_n(__EQ, 2 + thumb_size(cmp_rn) + 2 + loops));
+    emit_thumb(cmp_rn);
+    emit_thumb(__t_b_cond_n(__EQ, 2 + loops));
+    emit_thumb(cmp_up);
+    emit_thumb(__t_itt(__CC));
+    emit_thumb(shift_rm);
+    emit_thumb(shift_r8);
+    emit_thumb(__t_b_cond_n(__CC, -up));
+    emit_thumb(cmp_down);
+    emit_thumb(__t_itt(__CS));
+    emit_thumb(sub);
+    emit_thumb(add);
+    emit_thumb(unshift_r8);
+    emit_thumb(__t_it(__CC));
+    emit_thumb(unshift_rm);
+    emit_thumb(__t_b_cond_n(__CC, -down));
+}
+
+void thumb_emit_ph2_ir(ph2_ir_t *ph2_ir)
+{
+    func_t *func;
+    int rd = ph2_ir->dest;
+    int rn = ph2_ir->src0;
+    int rm = ph2_ir->src1;
+    int ofs;
+
+    switch (ph2_ir->op) {
+    case OP_define:
+        /* a leaf function keeps its return address in lr */
+        ofs = ph2_ir->src0;
+        if (!ph2_ir->dest) {
+            emit_thumb(__t_push(1 << __lr));
+            ofs -= 4;
+        }
+        if (!ofs)
+            return;
+        if (ofs < 4096)
+            emit_thumb(__t_sub_i(__sp, __sp, ofs));
+        else {
+            thumb_load_constant(__r8, ofs);
+            emit_thumb(__t_sub_r(__sp, __sp, __r8));
+        }
+        return;
+    case OP_load_constant:
+        thumb_load_constant(rd, ph2_ir->src0);
+        return;
+    case OP_address_of:
+        thumb_add_ofs(rd, __sp, ph2_ir->src0);
+        return;
+    case OP_global_address_of:
+        thumb_add_ofs(rd, __r12, ph2_ir->src0);
+        return;
+    case OP_assign:
+        if (rd != rn)
+            emit_thumb(__t_mov_r(rd, rn));
+        return;
+    case OP_load:
+        thumb_load(rd, __sp, ph2_ir->src0);
+        return;
+    case OP_store:
+        thumb_store(rn, __sp, ph2_ir->src1);
+        return;
+    case OP_global_load:
+        thumb_load(rd, __r12, ph2_ir->src0);
+        return;
+    case OP_global_store:
+        thumb_store(rn, __r12, ph2_ir->src1);
+        return;
+    case OP_read:
+        if (ph2_ir->src1 == 1)
+            emit_thumb(__t_lb(rd, rn, 0));
+        else if (ph2_ir->src1 == 4)
+            emit_thumb(__t_lw(rd, rn, 0));
+        else
+            abort();
+        return;
+    case OP_read_inc:
+        emit_thumb(thumb_load_post(ph2_ir->src1, rd, rn, ph2_ir->src1));
+        return;
+    case OP_write:
+        if (ph2_ir->dest == 1)
+            emit_thumb(__t_sb(rm, rn, 0));
+        else if (ph2_ir->dest == 4)
+            emit_thumb(__t_sw(rm, rn, 0));
+        else
+            abort();
+        return;
+    case OP_branch:
+        emit_thumb(__t_cmp_i(rn, 0));
+        emit_thumb(__t_b_cond(arm_branch_cond(ph2_ir),
+                              ph2_ir->then_bb->elf_offset - elf_code_idx));
+        if (ph2_ir->is_branch_detached)
+            emit_thumb(__t_b(ph2_ir->else_bb->elf_offset - elf_code_idx));
+        return;
+    case OP_jump:
+        emit_thumb(__t_b(ph2_ir->next_bb->elf_offset - elf_code_idx));
+        return;
+    case OP_predicate:
+        emit_thumb(__t_cmp_i(rn, 0));
+        return;
+    case OP_call:
+        /* the callee may not be laid out yet, see is_laid_out() */
+        func = find_func(ph2_ir->func_name);
+        ofs = 0;
+        if (func->fn)
+            ofs = func->fn->elf_offset;
+        if (strcmp(ph2_ir->func_name, "__syscall"))
+            emit_thumb(__t_bl(ofs - elf_code_idx));
+        else
+            emit_thumb(__t_blx(ofs - (elf_code_idx & ~3)));
+        return;
+    case OP_load_data_address:
+        emit_thumb(__t_movw(rd, ph2_ir->src0 + elf_data_start));
+        emit_thumb(__t_movt(rd, ph2_ir->src0 + elf_data_start));
+        return;
+    case OP_address_of_func:
+        /* the lowest bit of the address selects Thumb state for BLX */
+        func = find_func(ph2_ir->func_name);
+        ofs = elf_code_start;
+        if (func->fn)
+            ofs += func->fn->elf_offset;
+        if (strcmp(ph2_ir->func_name, "__syscall"))
+            ofs += 1;
+        emit_thumb(__t_movw(__r8, ofs));
+        emit_thumb(__t_movt(__r8, ofs));
+        emit_thumb(__t_sw(__r8, rn, 0));
+        return;
+    case OP_load_func:
+        emit_thumb(__t_mov_r(__r8, rn));
+        return;
+    case OP_indirect:
+        emit_thumb(__t_blx_r(__r8));
+        return;
+    case OP_return:
+        if ((ph2_ir->src0 != -1) & (rn != __r0))
+            emit_thumb(__t_mov_r(__r0, rn));
+        if (ph2_ir->dest) {
+            if (ph2_ir->src1)
+                thumb_add_ofs(__sp, __sp, ph2_ir->src1);
+            emit_thumb(__t_bx(__lr));
+        } else {
+            if (ph2_ir->src1 > 4)
+                thumb_add_ofs(__sp, __sp, ph2_ir->src1 - 4);
+            emit_thumb(__t_pop(1 << __pc));
+        }
+        return;
+    case OP_tail_call:
+        if (ph2_ir->dest) {
+            if (ph2_ir->src1)
+                thumb_add_ofs(__sp, __sp, ph2_ir->src1);
+        } else {
+            if (ph2_ir->src1 > 4)
+                thumb_add_ofs(__sp, __sp, ph2_ir->src1 - 4);
+            emit_thumb(__t_pop(1 << __lr));
+        }
+        func = find_func(ph2_ir->func_name);
+        ofs = 0;
+        if (func->fn)
+            ofs = func->fn->elf_offset;
+        emit_thumb(__t_b(ofs - elf_code_idx));
+        return;
+    case OP_add:
+        emit_thumb(__t_add_r(rd, rn, rm));
+        return;
+    case OP_sub:
+        emit_thumb(__t_sub_r(rd, rn, rm));
+        return;
+    case OP_mul:
+        emit_thumb(__t_mul(rd, rn, rm));
+        return;
+    case OP_div:
+    case OP_mod:
+        if (hard_mul_div) {
+            if (ph2_ir->op == OP_div)
+                emit_thumb(__t_sdiv(rd, rn, rm));
+            else {
+                emit_thumb(__t_sdiv(__r8, rn, rm));
+                emit_thumb(__t_mls(rd, __r8, rm, rn));
+            }
+            return;
+        }
+        /* Obtain absolute values of dividend and divisor */
+        emit_thumb(__t_shift_i(0, arith_rs, __r8, rn, 31));
+        emit_thumb(__t_add_r(rn, rn, __r8));
+        emit_thumb(__t_eor_r(rn, rn, __r8));
+        emit_thumb(__t_shift_i(0, arith_rs, __r9, rm, 31));
+        emit_thumb(__t_add_r(rm, rm, __r9));
+        emit_thumb(__t_eor_r(rm, rm, __r9));
+        if (ph2_ir->op == OP_div)
+            emit_thumb(__t_eor_r(__r10, __r8, __r9));
+        else
+            emit_thumb(__t_mov_r(__r10, __r8));
+        thumb_udiv(rn, rm);
+        if (ph2_ir->op == OP_div)
+            emit_thumb(__t_mov_r(rd, __r9));
+        else
+            emit_thumb(__t_mov_r(rd, rn));
+        /* Handle the correct sign for quotient or remainder */
+        emit_thumb(__t_cmp_i(__r10, 0));
+        emit_thumb(__t_it(__NE));
+        emit_thumb(__t_neg(rd, rd));
+        return;
+    case OP_lshift:
+        emit_thumb(__t_sll(rd, rn, rm));
+        return;
+    case OP_rshift:
+        emit_thumb(__t_srl(rd, rn, rm));
+        return;
+    case OP_eq:
+    case OP_neq:
+    case OP_gt:
+    case OP_lt:
+    case OP_geq:
+    case OP_leq:
+        emit_thumb(__t_cmp_r(rn, rm));
+        emit_thumb(__t_ite(arm_get_cond(ph2_ir->op)));
+        emit_thumb(__t_mov_i(rd, 1));
+        emit_thumb(__t_mov_i(rd, 0));
+        return;
+    case OP_negate:
+        emit_thumb(__t_neg(rd, rn));
+        return;
+    case OP_bit_not:
+        emit_thumb(__t_mvn_r(rd, rn));
+        return;
+    case OP_bit_and:
+    case OP_log_and:
+        emit_thumb(__t_and_r(rd, rn, rm));
+        return;
+    case OP_bit_or:
+        emit_thumb(__t_or_r(rd, rn, rm));
+        return;
+    case OP_bit_xor:
+        emit_thumb(__t_eor_r(rd, rn, rm));
+        return;
+    case OP_log_not:
+        emit_thumb(__t_cmp_i(rn, 0));
+        emit_thumb(__t_ite(__EQ));
+        emit_thumb(__t_mov_i(rd, 1));
+        emit_thumb(__t_mov_i(rd, 0));
+        return;
+    case OP_log_or:
+        emit_thumb(__t_or_r(rd, rn, rm));
+        emit_thumb(__t_cmp_i(rd, 0));
+        emit_thumb(__t_it(__NE));
+        emit_thumb(__t_mov_i(rd, 1));
+        return;
+    default:
+        printf("Unknown opcode\n");
+        abort();
+    }
+}
+
+/* prepare 'argc' and 'argv', then proceed to 'main' function */
+void thumb_call_main()
+{
+    func_t *func = find_func("main");
+    thumb_load_constant(__r8, GLOBAL_FUNC.stack_size);
+    emit_thumb(__t_add_r(__r8, __r12, __r8));
+    emit_thumb(__t_lw(__r0, __r8, 0));
+    emit_thumb(__t_add_i(__r1, __r8, 4));
+    emit_thumb(__t_b(func->fn->elf_offset - elf_code_idx));
+}
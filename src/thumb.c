@@ -0,0 +1,403 @@
+/*
+ * shecc - Self-Hosting and Educational C Compiler.
+ *
+ * shecc is freely redistributable under the BSD 2 clause license. See the
+ * file "LICENSE" for information on usage and redistribution of this file.
+ */
+
+/* Thumb-2 instruction encoding, for ARMv7-A in Thumb state */
+
+/* Identifier naming conventions
+ *   - prefix thumb_ : Thumb instruction encoding.
+ *   - prefix __t_ : mnemonic symbols for Thumb instructions. The registers
+ *                   and condition codes are those of src/arm.c.
+ *
+ * Each mnemonic returns its shortest encoding for the given operands: a
+ * 16-bit instruction in the lower half of the result, or a 32-bit one with
+ * its first halfword in the upper half. The 16-bit data processing forms
+ * update the flags outside of an IT block, so the flags are only meant to
+ * be used right after a comparison.
+ *
+ * The offsets of the branches are relative to the address of the branch
+ * instruction itself.
+ */
+
+int thumb32(int hw1, int hw2)
+{
+    return (hw1 << 16) + hw2;
+}
+
+/* size of an encoding, in bytes */
+int thumb_size(int code)
+{
+    if (code >> 16)
+        return 4;
+    return 2;
+}
+
+bool thumb_low(int r)
+{
+    return r < 8;
+}
+
+bool thumb_low3(int r1, int r2, int r3)
+{
+    return (r1 < 8) & (r2 < 8) & (r3 < 8);
+}
+
+/* immediate of 16 bits, split as in MOVW, MOVT, ADDW and SUBW */
+int thumb_imm16_hw1(int imm)
+{
+    return (((imm >> 11) & 1) << 10) + ((imm >> 12) & 15);
+}
+
+int thumb_imm16_hw2(int imm)
+{
+    return (((imm >> 8) & 7) << 12) + (imm & 255);
+}
+
+int __t_nop()
+{
+    return 0xBF00;
+}
+
+/* IT, ITT and ITE blocks, making the next instructions conditional */
+int __t_it(arm_cond_t cond)
+{
+    return 0xBF00 + (cond << 4) + 8;
+}
+
+int __t_itt(arm_cond_t cond)
+{
+    return 0xBF00 + (cond << 4) + ((cond & 1) << 3) + 4;
+}
+
+int __t_ite(arm_cond_t cond)
+{
+    return 0xBF00 + (cond << 4) + (((cond & 1) ^ 1) << 3) + 4;
+}
+
+int __t_mov_r(arm_reg rd, arm_reg rm)
+{
+    return 0x4600 + ((rd & 8) << 4) + (rm << 3) + (rd & 7);
+}
+
+/* 'imm' must be within 0 and 255 */
+int __t_mov_i(arm_reg rd, int imm)
+{
+    if (thumb_low(rd))
+        return 0x2000 + (rd << 8) + imm;
+    return thumb32(0xF04F, (rd << 8) + imm);
+}
+
+/* move the complement of 'imm', which must be within 0 and 255 */
+int __t_mvn_i(arm_reg rd, int imm)
+{
+    return thumb32(0xF06F, (rd << 8) + imm);
+}
+
+int __t_movw(arm_reg rd, int imm)
+{
+    return thumb32(0xF240 + thumb_imm16_hw1(imm),
+                   thumb_imm16_hw2(imm) + (rd << 8));
+}
+
+int __t_movt(arm_reg rd, int imm)
+{
+    imm = imm >> 16;
+    return thumb32(0xF2C0 + thumb_imm16_hw1(imm),
+                   thumb_imm16_hw2(imm) + (rd << 8));
+}
+
+int __t_add_r(arm_reg rd, arm_reg rn, arm_reg rm)
+{
+    if (thumb_low3(rd, rn, rm))
+        return 0x1800 + (rm << 6) + (rn << 3) + rd;
+    if (rd == rn)
+        return 0x4400 + ((rd & 8) << 4) + (rm << 3) + (rd & 7);
+    if (rd == rm)
+        return 0x4400 + ((rd & 8) << 4) + (rn << 3) + (rd & 7);
+    return thumb32(0xEB00 + rn, (rd << 8) + rm);
+}
+
+int __t_sub_r(arm_reg rd, arm_reg rn, arm_reg rm)
+{
+    if (thumb_low3(rd, rn, rm))
+        return 0x1A00 + (rm << 6) + (rn << 3) + rd;
+    return thumb32(0xEBA0 + rn, (rd << 8) + rm);
+}
+
+/* 'imm' must be within 0 and 4095 */
+int __t_sub_i(arm_reg rd, arm_reg rn, int imm)
+{
+    if (thumb_low(rd) & thumb_low(rn) & (imm < 8))
+        return 0x1E00 + (imm << 6) + (rn << 3) + rd;
+    if (thumb_low(rd) & (rd == rn) & (imm < 256))
+        return 0x3800 + (rd << 8) + imm;
+    if ((rd == __sp) & (rn == __sp) & ((imm & 3) == 0) & (imm < 512))
+        return 0xB080 + (imm >> 2);
+    return thumb32(0xF2A0 + thumb_imm16_hw1(imm) + rn,
+                   thumb_imm16_hw2(imm) + (rd << 8));
+}
+
+/* 'imm' must be within -4095 and 4095 */
+int __t_add_i(arm_reg rd, arm_reg rn, int imm)
+{
+    if (imm < 0)
+        return __t_sub_i(rd, rn, -imm);
+    if (thumb_low(rd) & thumb_low(rn) & (imm < 8))
+        return 0x1C00 + (imm << 6) + (rn << 3) + rd;
+    if (thumb_low(rd) & (rd == rn) & (imm < 256))
+        return 0x3000 + (rd << 8) + imm;
+    if (thumb_low(rd) & (rn == __sp) & ((imm & 3) == 0) & (imm < 1024))
+        return 0xA800 + (rd << 8) + (imm >> 2);
+    if ((rd == __sp) & (rn == __sp) & ((imm & 3) == 0) & (imm < 512))
+        return 0xB000 + (imm >> 2);
+    return thumb32(0xF200 + thumb_imm16_hw1(imm) + rn,
+                   thumb_imm16_hw2(imm) + (rd << 8));
+}
+
+/* 'rd = rn op rm', with a 16-bit form 'rdn = rdn op rm' for low registers */
+int thumb_alu(int op16,
+              int hw1,
+              int hw2,
+              bool commutative,
+              arm_reg rd,
+              arm_reg rn,
+              arm_reg rm)
+{
+    if (thumb_low3(rd, rn, rm)) {
+        if (rd == rn)
+            return op16 + (rm << 3) + rd;
+        if (commutative & (rd == rm))
+            return op16 + (rn << 3) + rd;
+    }
+    return thumb32(hw1 + rn, hw2 + (rd << 8) + rm);
+}
+
+int __t_and_r(arm_reg rd, arm_reg rn, arm_reg rm)
+{
+    return thumb_alu(0x4000, 0xEA00, 0, true, rd, rn, rm);
+}
+
+int __t_eor_r(arm_reg rd, arm_reg rn, arm_reg rm)
+{
+    return thumb_alu(0x4040, 0xEA80, 0, true, rd, rn, rm);
+}
+
+int __t_or_r(arm_reg rd, arm_reg rn, arm_reg rm)
+{
+    return thumb_alu(0x4300, 0xEA40, 0, true, rd, rn, rm);
+}
+
+int __t_mul(arm_reg rd, arm_reg rn, arm_reg rm)
+{
+    return thumb_alu(0x4340, 0xFB00, 0xF000, true, rd, rn, rm);
+}
+
+int __t_sll(arm_reg rd, arm_reg rn, arm_reg rm)
+{
+    return thumb_alu(0x4080, 0xFA00, 0xF000, false, rd, rn, rm);
+}
+
+int __t_srl(arm_reg rd, arm_reg rn, arm_reg rm)
+{
+    return thumb_alu(0x40C0, 0xFA20, 0xF000, false, rd, rn, rm);
+}
+
+int __t_mvn_r(arm_reg rd, arm_reg rm)
+{
+    if (thumb_low(rd) & thumb_low(rm))
+        return 0x43C0 + (rm << 3) + rd;
+    return thumb32(0xEA6F, (rd << 8) + rm);
+}
+
+/* rd = -rn */
+int __t_neg(arm_reg rd, arm_reg rn)
+{
+    if (thumb_low(rd) & thumb_low(rn))
+        return 0x4240 + (rn << 3) + rd;
+    return thumb32(0xF1C0 + rn, rd << 8);
+}
+
+/* Shift by 'amt', within 1 and 31. The flags are updated if 's' is set, and
+ * may be by the 16-bit forms anyway outside of an IT block.
+ */
+int __t_shift_i(int s, shift_type shift, arm_reg rd, arm_reg rm, int amt)
+{
+    if (thumb_low(rd) & thumb_low(rm))
+        return (shift << 11) + (amt << 6) + (rm << 3) + rd;
+    return thumb32(0xEA4F + (s << 4), ((amt >> 2) << 12) + (rd << 8) +
+                                          ((amt & 3) << 6) + (shift << 4) + rm);
+}
+
+int __t_cmp_r(arm_reg rn, arm_reg rm)
+{
+    if (thumb_low(rn) & thumb_low(rm))
+        return 0x4280 + (rm << 3) + rn;
+    return 0x4500 + ((rn & 8) << 4) + (rm << 3) + (rn & 7);
+}
+
+/* 'imm' must be within 0 and 255 */
+int __t_cmp_i(arm_reg rn, int imm)
+{
+    if (thumb_low(rn))
+        return 0x2800 + (rn << 8) + imm;
+    return thumb32(0xF1B0 + rn, 0x0F00 + imm);
+}
+
+int __t_sdiv(arm_reg rd, arm_reg rn, arm_reg rm)
+{
+    return thumb32(0xFB90 + rn, 0xF0F0 + (rd << 8) + rm);
+}
+
+/* rd = ra - rn * rm */
+int __t_mls(arm_reg rd, arm_reg rn, arm_reg rm, arm_reg ra)
+{
+    return thumb32(0xFB00 + rn, (ra << 12) + (rd << 8) + 0x10 + rm);
+}
+
+/* Load or store a word ('size' 4) or a byte ('size' 1) at 'rn' + 'ofs',
+ * which must be within -255 and 4095.
+ */
+int thumb_transfer(int l, int size, arm_reg rt, arm_reg rn, int ofs)
+{
+    if ((size == 4) & thumb_low(rt) & thumb_low(rn) & ((ofs & 3) == 0) &
+        (ofs >= 0) & (ofs < 128))
+        return 0x6000 + (l << 11) + ((ofs >> 2) << 6) + (rn << 3) + rt;
+    if ((size == 4) & thumb_low(rt) & (rn == __sp) & ((ofs & 3) == 0) &
+        (ofs >= 0) & (ofs < 1024))
+        return 0x9000 + (l << 11) + (rt << 8) + (ofs >> 2);
+    if ((size == 1) & thumb_low(rt) & thumb_low(rn) & (ofs >= 0) & (ofs < 32))
+        return 0x7000 + (l << 11) + (ofs << 6) + (rn << 3) + rt;
+
+    int hw1 = 0xF800 + (l << 4) + rn;
+    if (size == 4)
+        hw1 += 0x40;
+    if (ofs < 0)
+        return thumb32(hw1, (rt << 12) + 0xC00 - ofs);
+    return thumb32(hw1 + 0x80, (rt << 12) + ofs);
+}
+
+int __t_lw(arm_reg rt, arm_reg rn, int ofs)
+{
+    return thumb_transfer(1, 4, rt, rn, ofs);
+}
+
+int __t_lb(arm_reg rt, arm_reg rn, int ofs)
+{
+    return thumb_transfer(1, 1, rt, rn, ofs);
+}
+
+int __t_sw(arm_reg rt, arm_reg rn, int ofs)
+{
+    return thumb_transfer(0, 4, rt, rn, ofs);
+}
+
+int __t_sb(arm_reg rt, arm_reg rn, int ofs)
+{
+    return thumb_transfer(0, 1, rt, rn, ofs);
+}
+
+/* Load a word ('size' 4) or a byte ('size' 1) at 'rn', then add 'ofs' to
+ * 'rn', which must be within 0 and 255. A word of the low registers is
+ * loaded by a 16-bit LDM writing the address back.
+ */
+int thumb_load_post(int size, arm_reg rt, arm_reg rn, int ofs)
+{
+    if ((size == 4) & (ofs == 4) & thumb_low(rt) & thumb_low(rn))
+        return 0xC800 + (rn << 8) + (1 << rt);
+
+    int hw1 = 0xF810 + rn;
+    if (size == 4)
+        hw1 += 0x40;
+    return thumb32(hw1, (rt << 12) + 0xB00 + ofs);
+}
+
+/* Load or store the word at 'rn' + 'rm' */
+int thumb_transfer_r(int l, arm_reg rt, arm_reg rn, arm_reg rm)
+{
+    if (thumb_low3(rt, rn, rm))
+        return 0x5000 + (l << 11) + (rm << 6) + (rn << 3) + rt;
+    return thumb32(0xF840 + (l << 4) + rn, (rt << 12) + rm);
+}
+
+int __t_lw_r(arm_reg rt, arm_reg rn, arm_reg rm)
+{
+    return thumb_transfer_r(1, rt, rn, rm);
+}
+
+int __t_sw_r(arm_reg rt, arm_reg rn, arm_reg rm)
+{
+    return thumb_transfer_r(0, rt, rn, rm);
+}
+
+/* push and pop of the registers r0-r7 in the bit mask 'list' and of lr,
+ * respectively pc, in 16 bits. Popping lr takes the 32-bit form.
+ */
+int __t_push(int list)
+{
+    return 0xB400 + (((list >> 14) & 1) << 8) + (list & 255);
+}
+
+int __t_pop(int list)
+{
+    if ((list >> 14) & 1)
+        return thumb32(0xE8BD, list);
+    return 0xBC00 + (((list >> 15) & 1) << 8) + (list & 255);
+}
+
+/* 32-bit branches reaching 16 MiB away, the link ones setting 'lr' */
+int thumb_branch(int hw2, int ofs)
+{
+    int imm = ofs - 4;
+    int s = (imm >> 24) & 1;
+    int j1 = ((imm >> 23) & 1) ^ s ^ 1;
+    int j2 = ((imm >> 22) & 1) ^ s ^ 1;
+    return thumb32(0xF000 + (s << 10) + ((imm >> 12) & 1023),
+                   hw2 + (j1 << 13) + (j2 << 11) + ((imm >> 1) & 2047));
+}
+
+int __t_b(int ofs)
+{
+    return thumb_branch(0x9000, ofs);
+}
+
+int __t_bl(int ofs)
+{
+    return thumb_branch(0xD000, ofs);
+}
+
+/* Call ARM code. The offset is relative to the address of the instruction
+ * aligned down to a word, as the target is.
+ */
+int __t_blx(int ofs)
+{
+    return thumb_branch(0xC000, ofs);
+}
+
+/* conditional branch reaching 1 MiB away */
+int __t_b_cond(arm_cond_t cond, int ofs)
+{
+    int imm = ofs - 4;
+    return thumb32(
+        0xF000 + (((imm >> 20) & 1) << 10) + (cond << 6) + ((imm >> 12) & 63),
+        0x8000 + (((imm >> 18) & 1) << 13) + (((imm >> 19) & 1) << 11) +
+            ((imm >> 1) & 2047));
+}
+
+/* conditional branch reaching 256 bytes away */
+int __t_b_cond_n(arm_cond_t cond, int ofs)
+{
+    return 0xD000 + (cond << 8) + (((ofs - 4) >> 1) & 255);
+}
+
+int __t_bx(arm_reg rm)
+{
+    return 0x4700 + (rm << 3);
+}
+
+int __t_blx_r(arm_reg rm)
+{
+    return 0x4780 + (rm << 3);
+}
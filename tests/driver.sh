@@ -4,6 +4,9 @@ set -u
 
 readonly SHECC="$PWD/out/shecc"
 
+# extra options passed to shecc by 'try'
+SHECC_FLAGS=""
+
 # try - test shecc with given code
 # Usage:
 # - try exit_code input_code
@@ -25,7 +28,7 @@ function try() {
     local tmp_in="$(mktemp --suffix .c)"
     local tmp_exe="$(mktemp)"
     echo "$input" > "$tmp_in"
-    "$SHECC" -o "$tmp_exe" "$tmp_in"
+    "$SHECC" $SHECC_FLAGS -o "$tmp_exe" "$tmp_in"
     chmod +x $tmp_exe
 
     local output=''
@@ -160,6 +163,7 @@ items 10 "for(;;) break; return 10;"
 items 0 "int x; for(x = 10; x > 0; x--); return x;"
 items 30 "int i; int acc; i = 0; acc = 0; do { i = i + 1; if (i - 1 < 5) continue; acc = acc + i; if (i == 9) break; } while (i < 10); return acc;"
 items 26 "int acc; acc = 0; int i; for (i = 0; i < 100; i++) { if (i < 5) continue; if (i == 9) break; acc = acc + i; } return acc;"
+items 3 "int j; for (j = 0; j < 10; j++) { if (j < 3) continue; return j; } return 0;"
 
 # functions
 try_ 55 << EOF
@@ -403,6 +407,86 @@ int main()
 }
 EOF
 
+# include guards and #pragma once
+guarded_h="$(mktemp --suffix .h)"
+once_h="$(mktemp --suffix .h)"
+cat > "$guarded_h" << EOF
+/* guarded header */
+#ifndef GUARDED_H
+#define GUARDED_H
+#ifdef NOT_DEFINED
+#error "NOT_DEFINED is defined"
+#endif
+int guarded = 3;
+#endif
+EOF
+cat > "$once_h" << EOF
+#pragma once
+int once = 4;
+EOF
+try_ 7 << EOF
+#include "$(basename "$guarded_h")"
+#include "$(basename "$once_h")"
+#include "$(basename "$guarded_h")"
+#include "$(basename "$once_h")"
+#ifndef GUARDED_H
+#error "GUARDED_H is not defined"
+#endif
+int main()
+{
+    return guarded + once;
+}
+EOF
+rm -f "$guarded_h" "$once_h"
+
+# functions whose names share a long prefix
+try_ 6 << EOF
+int long_function_name_prefix_1() { return 1; }
+int long_function_name_prefix_2() { return 2; }
+int long_function_name_prefix_3();
+int main()
+{
+    return long_function_name_prefix_1() + long_function_name_prefix_2() +
+           long_function_name_prefix_3();
+}
+int long_function_name_prefix_3() { return 3; }
+EOF
+
+# forward declared structure sharing its name with the typedef
+try_ 7 << EOF
+typedef struct node node;
+struct node {
+    int value;
+    node *next;
+};
+typedef enum { RED, GREEN = 3, BLUE } color_t;
+int main()
+{
+    node a;
+    node b;
+    a.value = GREEN;
+    b.value = BLUE;
+    a.next = &b;
+    return a.value + a.next->value;
+}
+EOF
+
+# identifiers sharing length and first letter with keywords
+try_ 36 << EOF
+int main()
+{
+    int it = 1;
+    int fun = 2;
+    int elem = 3;
+    int cast = 4;
+    int width = 5;
+    int stride = 6;
+    int typeset = 7;
+    int contents = 8;
+    return it + fun + elem + cast + width + stride + typeset + contents;
+}
+EOF
+
 # format
 try_output 0 "2147483647" << EOF
 int main() {
@@ -533,6 +617,34 @@ int main()
 }
 EOF
 
+# nested function-like macros, with parentheses and commas in the arguments
+try_ 25 << EOF
+#define SQ(x) ((x) * (x))
+#define SUM_SQ(a, b) (SQ(a) + SQ(b))
+#define FIRST(a, b) a
+int add(int a, int b)
+{
+    return a + b;
+}
+int main()
+{
+    return SUM_SQ(FIRST(add(1, 2), 0), SQ(2));
+}
+EOF
+
+# a macro is not expanded again within its own expansion
+try_ 7 << EOF
+int f(int x)
+{
+    return x + 1;
+}
+#define f(x) f((x) * 2)
+int main()
+{
+    return f(3);
+}
+EOF
+
 try_ 0 << EOF
 #if 1 || 0
 #define A 0
@@ -835,4 +947,936 @@ int main()
 }
 EOF
 
+# function-at-a-time mode: calls and addresses of functions defined later,
+# globals declared between functions, and string literals
+SHECC_FLAGS="--fn-at-a-time"
+try_output 42 "fn-at-a-time" << EOF
+typedef struct {
+    int (*op)(int);
+} ops_t;
+int twice(int x);
+int bump(int n);
+int count = 1;
+int apply(ops_t *ops, int x)
+{
+    int r;
+    count = count + 1;
+    r = ops->op(x);
+    return r;
+}
+int arr[4];
+int main()
+{
+    ops_t ops;
+    ops_t *p = &ops;
+    p->op = twice;
+    int a = apply(p, 20);
+    printf("%s", "fn-at-a-time");
+    return a + bump(count) - arr[2];
+}
+int twice(int x)
+{
+    arr[count] = x;
+    return x * 2;
+}
+int bump(int n)
+{
+    return n + 20;
+}
+EOF
+SHECC_FLAGS=""
+
+# functions spread over several threads
+SHECC_FLAGS="-j 4"
+try_ 55 << EOF
+int total;
+int add(int a, int b)
+{
+    return a + b;
+}
+int fib(int n)
+{
+    if (n < 2)
+        return n;
+    return add(fib(n - 1), fib(n - 2));
+}
+void accumulate(int n)
+{
+    for (int i = 0; i < n; i++)
+        total = add(total, i);
+}
+int main()
+{
+    accumulate(11);
+    return fib(10) + total - 55;
+}
+EOF
+SHECC_FLAGS=""
+
+# optimization levels and single passes, checked after each pass
+for flags in "-O0" "-O2" "-O1 -fno-cse -fno-peephole" "-O0 -fconst-fold"; do
+    SHECC_FLAGS="$flags --verify-ir"
+    try_ 36 << EOF
+int square(int n)
+{
+    return n * n;
+}
+int main()
+{
+    int a[4];
+    int sum = 0;
+    for (int i = 0; i < 4; i++)
+        a[i] = i + 1;
+    for (int i = 0; i < 4; i++)
+        sum += a[i] * a[i] - square(i);
+    return sum + 2 * 3 - 4 + 18;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# peephole rules: forwarding the stores to the loads, reloading, threading
+# the jumps and inverting the branches
+for flags in "-O0" "" "+m" "-O2" "--fn-at-a-time"; do
+    SHECC_FLAGS="$flags --verify-ir"
+    try_output 0 "29 12 17 12 3 1 -1 -1 0 1 5" << EOF
+int g;
+int h;
+int spill(int *p, int a, int b)
+{
+    int x = a * 3;
+    int y = b - a;
+    p[0] = x;
+    g = y;
+    h = g + x;
+    p[1] = h;
+    g = h - y;
+    return x + y + g;
+}
+int search(int *a, int n, int v)
+{
+    int found = -1;
+    for (int i = 0; i < n; i++) {
+        if (a[i] < 0)
+            continue;
+        for (int j = i; j < n; j++) {
+            if (a[j] == v) {
+                found = j;
+                break;
+            }
+        }
+        if (found >= 0)
+            break;
+    }
+    return found;
+}
+int sign(int x)
+{
+    if (x) {
+        if (x > 0)
+            return 1;
+        return -1;
+    }
+    return 0;
+}
+int count(char *s)
+{
+    int n = 0;
+    while (*s) {
+        if (*s != ' ')
+            n++;
+        s++;
+    }
+    return n;
+}
+int main()
+{
+    int a[6];
+    int q[2];
+    for (int i = 0; i < 6; i++)
+        a[i] = 5 - i * 3;
+    printf("%d %d %d %d ", spill(q, 4, 9), q[0], q[1], g);
+    printf("%d %d %d ", search(a, 6, -4), search(a, 6, 2), search(a, 6, 7));
+    printf("%d %d %d %d", sign(-7), sign(0), sign(3), count("a b  cd e"));
+    return 0;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# if-conversion of small branches, which store to the stack, far from the
+# stack pointer, to globals and through pointers
+arch_flags="+c"
+if grep -q __arm__ config; then
+    arch_flags="-mthumb"
+fi
+for flags in "-O2" "-O2 +m --fn-at-a-time" "-O2 $arch_flags"; do
+    SHECC_FLAGS="$flags --verify-ir"
+    try_output 0 "8 8 0 10 7 28 9 -1 12 5" << EOF
+int g;
+int max(int a, int b)
+{
+    return a > b ? a : b;
+}
+int clamp(int x, int lo, int hi)
+{
+    if (x < lo)
+        x = lo;
+    else if (x > hi)
+        x = hi;
+    return x;
+}
+void set(int *p, int c)
+{
+    if (c)
+        p[0] = c;
+    else
+        g = g - 1;
+    g = g + 10;
+}
+int get(int *p, int c)
+{
+    int v = -1;
+    if (c)
+        v = p[0];
+    return v;
+}
+int far(int x)
+{
+    char buf[5000];
+    int y = 0;
+    buf[0] = 1;
+    if (x > 0)
+        y = x * 3;
+    if (x < 0)
+        y = buf[0] - x;
+    return y;
+}
+int main()
+{
+    int v = 5;
+    set(&v, 0);
+    set(&v, 9);
+    printf("%d %d %d %d ", max(3, 8), max(8, -3), clamp(-5, 0, 10),
+           clamp(50, 0, 10));
+    printf("%d %d %d %d ", clamp(7, 0, 10), v + g, get(&v, 1), get(0, 0));
+    printf("%d %d", far(4), far(-4));
+    return 0;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# leaf functions: no return address saved, and no stack frame when they keep
+# no variable on the stack, next to functions calling others
+for flags in "" "-O2" "$arch_flags"; do
+    SHECC_FLAGS="$flags"
+    try_output 0 "3 42 12 7 20 120 6" << EOF
+typedef struct {
+    int (*op)(int, int);
+} ops_t;
+int g = 3;
+int get()
+{
+    return g;
+}
+int answer()
+{
+    return 42;
+}
+int big(int x)
+{
+    char buf[3000];
+    buf[2999] = x;
+    return buf[2999] * 2;
+}
+int add(int a, int b)
+{
+    return a + b;
+}
+int twice(int x)
+{
+    ops_t ops;
+    ops.op = add;
+    return ops.op(x, x);
+}
+int fact(int n)
+{
+    if (n < 2)
+        return 1;
+    return n * fact(n - 1);
+}
+int main()
+{
+    printf("%d %d %d %d ", get(), answer(), big(6), add(3, 4));
+    printf("%d %d %d", twice(10), fact(5), add(get(), get()));
+    return 0;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# values spilled to adjacent stack slots around calls, stored and loaded
+# together on ARM
+for flags in "" "-O2" "$arch_flags"; do
+    SHECC_FLAGS="$flags"
+    try_output 0 "3020 21 120" << EOF
+int id(int x)
+{
+    return x;
+}
+int spill(int a, int b, int c, int d)
+{
+    int x = a + 1, y = b + 2, z = c + 3, w = d + 4;
+    int s = id(x);
+    int t = id(y + z);
+    return s * 1000 + t * 100 + x + y + z + w;
+}
+int many(int a)
+{
+    int v0 = a, v1 = a * 2, v2 = a * 3, v3 = a * 4, v4 = a * 5, v5 = a * 6;
+    if (a > 2)
+        v0 = id(v1 + v2) + v3 + v4 + v5;
+    return v0 + v1 + v2 + v3 + v4 + v5;
+}
+int main()
+{
+    printf("%d %d %d", spill(1, 2, 3, 4), many(1), many(3));
+    return 0;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# tail calls, running deep recursion in constant stack, but not when the
+# callee may refer to the stack of the caller
+for flags in "" "-O2" "$arch_flags" "--fn-at-a-time"; do
+    SHECC_FLAGS="$flags"
+    try_output 0 "0 1 1784293664 1000000 42" << EOF
+int count;
+int even(int n);
+int odd(int n)
+{
+    if (n == 0)
+        return 0;
+    return even(n - 1);
+}
+int even(int n)
+{
+    if (n == 0)
+        return 1;
+    return odd(n - 1);
+}
+int sum(int n, int acc)
+{
+    if (n == 0)
+        return acc;
+    return sum(n - 1, acc + n);
+}
+void tick(int n)
+{
+    if (n == 0)
+        return;
+    count = count + 1;
+    tick(n - 1);
+}
+int read(int *p)
+{
+    return p[0];
+}
+int local(int x)
+{
+    int y = x * 2;
+    return read(&y);
+}
+int main()
+{
+    tick(1000000);
+    printf("%d %d %d %d %d", even(1000001), odd(1000001), sum(1000000, 0),
+           count, local(21));
+    return 0;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# loop unrolling, with a remainder loop for the runtime trip counts, and no
+# unrolled iteration where the induction variable would wrap around
+for flags in "-O2" "-O2 --unroll 2" "-O2 --unroll 8 $arch_flags" "-O2 --fn-at-a-time"; do
+    SHECC_FLAGS="$flags"
+    try_output 0 "0,0,0 0,1,1 1,2,1 5,10,1 14,14,6 30,55,6 55,68,6 91,244,19 140,284,19 204,973,19 285,1094,48 385,3646,48 147483667 999999999" << EOF
+int sum(int *a, int n)
+{
+    int s = 0;
+    for (int i = 0; i < n; i++)
+        s += a[i];
+    return s;
+}
+int down(int n)
+{
+    int x = 0;
+    while (n > 0) {
+        x = x * 3 + n;
+        n = n - 2;
+    }
+    return x;
+}
+int steps(int n)
+{
+    int x = 0;
+    for (int i = 1; i <= n; i += 3)
+        x = x * 2 + i;
+    return x;
+}
+int billions(int val)
+{
+    int n = 0;
+    while (val >= 1000000000) {
+        val -= 1000000000;
+        n++;
+    }
+    return n * 10 + val;
+}
+int main()
+{
+    int a[12];
+    for (int i = 0; i < 12; i++)
+        a[i] = i * i;
+    for (int n = 0; n < 12; n++)
+        printf("%d,%d,%d ", sum(a, n), down(n), steps(n));
+    printf("%d %d", billions(2147483647), billions(999999999));
+    return 0;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# strength reduction, walking the arrays with pointers read post-indexed
+for flags in "-O2" "-O2 -fno-loop-unroll" "-O2 $arch_flags" "-O2 +m --fn-at-a-time"; do
+    SHECC_FLAGS="$flags --verify-ir"
+    try_output 0 "730 870993 -9347 0 1207872897 540 499 15 8 5 0" << EOF
+int sum(int *a, int n)
+{
+    int s = 0;
+    for (int i = 0; i < n; i++)
+        s = s + a[i];
+    return s;
+}
+int down(int *a, int n)
+{
+    int s = 0;
+    for (int i = n - 1; i >= 0; i--)
+        s = s * 3 + a[i];
+    return s;
+}
+int odd(int *a, int k, int n)
+{
+    int s = 0;
+    for (int i = k; i < n; i += 2)
+        s = s * 2 + a[i];
+    return s;
+}
+int hash(char *str, int n)
+{
+    int h = 7;
+    for (int i = 0; i < n; i++)
+        h = h * 31 + str[i];
+    return h;
+}
+void copy(int *d, int *s, int n)
+{
+    for (int i = 0; i < n; i++) {
+        int v = s[i];
+        d[i] = v - i;
+    }
+}
+int skip(int *a, int n)
+{
+    int s = 0;
+    for (int i = 0; i < n; i++) {
+        if (a[i] % 3 == 0)
+            continue;
+        s = s + a[i];
+    }
+    return s;
+}
+int find(int *a, int n, int v)
+{
+    int i = 0;
+    while (i < n) {
+        if (a[i] == v)
+            break;
+        i++;
+    }
+    return i;
+}
+int len(char *s)
+{
+    int i = 0;
+    while (s[i])
+        i++;
+    return i;
+}
+int main()
+{
+    int a[20];
+    int b[20];
+    char str[16];
+    for (int i = 0; i < 20; i++)
+        a[i] = i * 7 - 30;
+    for (int i = 0; i < 15; i++)
+        str[i] = 'a' + i;
+    str[15] = 0;
+    copy(b, a, 20);
+    printf("%d %d %d %d ", sum(a, 20), down(a, 10), odd(a, 1, 20), odd(a, 4, 4));
+    printf("%d %d %d %d ", hash(str, 15), sum(b, 20), skip(a, 20), len(str));
+    printf("%d %d %d", find(a, 20, 26), find(a, 20, 5), sum(a + 3, 0));
+    return 0;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# instruction scheduling, keeping the transfers to the same memory in order
+for flags in "-O2" "-O2 -fno-schedule" "-O2 +m" "-O2 $arch_flags"; do
+    SHECC_FLAGS="$flags --verify-ir"
+    try_output 0 "-51 34 18 12 16 -837" << EOF
+int g;
+int h[4];
+int mac(int *a, int *b, int n)
+{
+    int s = 0;
+    for (int i = 0; i < n; i++)
+        s = s + a[i] * b[i];
+    return s;
+}
+int alias(int *p, int x)
+{
+    int v = x;
+    int *q = &v;
+    int t = p[0];
+    q[0] = t + 1;
+    p[0] = v * 3;
+    t = p[0];
+    g = t - v;
+    h[1] = g;
+    t = h[1];
+    h[2] = t + x;
+    t = h[2];
+    return v + g + t;
+}
+int spill(int a, int b, int c)
+{
+    int d = a * b;
+    int e = b - c;
+    int f = c * 7;
+    int x = d ^ e;
+    int y = e * f;
+    int z = f + a;
+    int u = x - y;
+    int v = y | z;
+    int w = z * 5;
+    return (a + b + c + d + e + f) * 3 + x + y + z + u + v + w;
+}
+int main()
+{
+    int a[6];
+    int b[6];
+    int w = 5;
+    for (int i = 0; i < 6; i++) {
+        a[i] = i * i - 4;
+        b[i] = 9 - i * 2;
+    }
+    printf("%d ", mac(a, b, 6));
+    printf("%d ", alias(&w, 4));
+    printf("%d %d %d %d", w, g, h[2], spill(3, -8, 11));
+    return 0;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# Thumb-2 code, calling the ARM system call stub and functions by address
+if grep -q __arm__ config; then
+    for flags in "-mthumb" "-mthumb +m" "-mthumb --fn-at-a-time"; do
+        SHECC_FLAGS="$flags"
+        try_output 7 "-14 4096 2 1 0 -25 yes" << EOF
+typedef struct {
+    int (*op)(int, int);
+} ops_t;
+int div(int a, int b)
+{
+    return a / b;
+}
+int big()
+{
+    char buf[5000];
+    buf[4999] = 16;
+    return buf[4999] << 8;
+}
+int main()
+{
+    ops_t ops;
+    ops_t *p = &ops;
+    int x = -100;
+    p->op = div;
+    printf("%d %d ", p->op(x, 7), big());
+    printf("%d %d %d %d %s", -x % 7, x < 3, !x, x / 4, x != 0 ? "yes" : "no");
+    return 1000007 % 10;
+}
+EOF
+    done
+    SHECC_FLAGS=""
+fi
+
+# compressed RISC-V instructions, mixed with the fixed-size sequences
+if grep -q __riscv config; then
+    for flags in "+c" "+c +m" "+c --fn-at-a-time"; do
+        SHECC_FLAGS="$flags"
+        try_output 7 "-14 4096 2 1 0 -25 yes" << EOF
+typedef struct {
+    int (*op)(int, int);
+} ops_t;
+int div(int a, int b)
+{
+    return a / b;
+}
+int big()
+{
+    char buf[5000];
+    buf[4999] = 16;
+    return buf[4999] << 8;
+}
+int main()
+{
+    ops_t ops;
+    ops_t *p = &ops;
+    int x = -100;
+    p->op = div;
+    printf("%d %d ", p->op(x, 7), big());
+    printf("%d %d %d %d %s", -x % 7, x < 3, !x, x / 4, x != 0 ? "yes" : "no");
+    return 1000007 % 10;
+}
+EOF
+    done
+    SHECC_FLAGS=""
+fi
+
+# code encoded before the locations it refers to are laid out: branches down
+# the function, calls and addresses of the functions defined later, and the
+# string literals of the data section following the code
+for flags in "" "-O2" "$arch_flags" "$arch_flags --fn-at-a-time"; do
+    SHECC_FLAGS="$flags"
+    try_output 46 "late 46 15 87" << EOF
+typedef struct {
+    int (*op)(int);
+} ops_t;
+int later(int x);
+int table[3];
+int early(int n)
+{
+    if (n > 10)
+        return later(n - 1);
+    return n;
+}
+int main()
+{
+    ops_t ops;
+    ops_t *p = &ops;
+    char *msg = "late";
+    int s = 0;
+    p->op = later;
+    for (int i = 0; i < 3; i++)
+        table[i] = early(i * 7);
+    for (int i = 0; i < 3; i++)
+        s = s + table[i];
+    printf("%s %d %d %d", msg, s, p->op(5), early(30));
+    return s;
+}
+int later(int x)
+{
+    if (x & 1)
+        return x * 3;
+    return early(x / 2);
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# branches farther than a short conditional branch reaches, around a body
+# of several KiB
+body=""
+for i in $(seq 40); do
+    body="$body
+            { if (v[$((i % 8))] & 1)
+                v[$((i % 8))] = (v[$(((i + 3) % 8))] * 3 + $i) & 65535;
+            else
+                v[$((i % 8))] = v[$((i % 8))] >> 1; }"
+done
+for flags in "" "-O2" "$arch_flags -O2"; do
+    SHECC_FLAGS="$flags"
+    try_output 39 "1891 8617" << EOF
+int v[8];
+int main()
+{
+    int n = 0;
+    for (int i = 0; i < 8; i++)
+        v[i] = i * 7 + 1;
+    do {
+        if (n != 1) {$body
+        }
+        n++;
+    } while (n < 3);
+    printf("%d %d", v[0], v[5]);
+    return v[7] & 63;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# constants fitting a rotated immediate, a mvn or a movw, and the others,
+# which ARM loads from a literal pool following the function, but builds in
+# place if the pool is out of reach, at the start of the large body above
+for flags in "" "-O2" "$arch_flags -O2"; do
+    SHECC_FLAGS="$flags"
+    try_output 47 "31519 -16777215 -256 305418705 -268369936 864458633 5100" << EOF
+int v[8];
+int hash(char *s)
+{
+    int h = -2128831035;
+    while (*s) {
+        h = h ^ *s;
+        h = h * 16777619;
+        s++;
+    }
+    return h;
+}
+int pick(int c)
+{
+    return c ? 305419896 : -559038737;
+}
+int main()
+{
+    int k = 305419896;
+    int n = 0;
+    for (int i = 0; i < 8; i++)
+        v[i] = (i * 7 + 1) ^ k;
+    do {
+        if (n != 1) {$body
+        }
+        n++;
+    } while (n < 3);
+    k = v[3] ^ 305419896;
+    printf("%d %d %d %d ", hash("shecc") & 65535, -16777216 ^ 1, -256, k);
+    printf("%d %d %d", 65535 ^ -268435441, pick(1) - pick(0), 1020 + 4080);
+    return pick(0) & 63;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# tail merging: the returns of a function with a stack frame jump to a single
+# epilogue, and the blocks ending alike go on to a single copy of their tails
+for flags in "-O2" "-O2 -fno-tail-merge" "-O2 $arch_flags"; do
+    SHECC_FLAGS="$flags --verify-ir"
+    try_output 12 "2518 -136 2542 -108" << EOF
+int g;
+int twice(int x)
+{
+    return x * 2;
+}
+int classify(int x)
+{
+    if (x < 0)
+        return twice(x) - 1;
+    if (x == 0)
+        return 0;
+    if (x > 100)
+        return twice(x) + x;
+    return twice(twice(x));
+}
+void note(int x)
+{
+    if (x & 1) {
+        g = g + twice(x);
+        return;
+    }
+    if (x > 6)
+        return;
+    g = g * 3 + x;
+}
+int mix(int a, int b, int c)
+{
+    int r;
+    switch (c) {
+    case 0:
+        r = a + 1;
+        g = g ^ r;
+        r = r * b + twice(a);
+        break;
+    case 1:
+        r = a - 1;
+        g = g ^ r;
+        r = r * b + twice(a);
+        break;
+    case 2:
+        r = a * 5;
+        g = g + r;
+        r = r * b + twice(a);
+        break;
+    default:
+        r = b;
+        g = g + r;
+        r = r * b + twice(a);
+    }
+    if (r > 50)
+        r = twice(r) - g;
+    else
+        r = twice(r) + g;
+    return r;
+}
+int main()
+{
+    int s = 0;
+    for (int i = -2; i < 8; i++) {
+        s = s + classify(i * 30);
+        note(i);
+    }
+    printf("%d %d ", s, g);
+    for (int i = 0; i < 5; i++)
+        s = s + mix(i + 2, 7 - i, i);
+    printf("%d %d", s, g);
+    return classify(3);
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# layout of the code: the functions follow their first callers, and the blocks
+# and functions which do not return, down to exit(), are moved to the end
+for flags in "" "-O2" "-O2 -fno-cold-split" "-O2 $arch_flags" "-O2 --fn-at-a-time"; do
+    SHECC_FLAGS="$flags --verify-ir"
+    try_output 2 "35 17 32 14 6 out of range" << EOF
+int checks;
+void die(char *msg, int code)
+{
+    printf("%s", msg);
+    exit(code);
+}
+void fail(int code)
+{
+    die(" failed", code);
+}
+int get(int *a, int n, int i)
+{
+    checks++;
+    if (i < 0)
+        fail(1);
+    if (i >= n)
+        die(" out of range", 2);
+    return a[i];
+}
+int sum(int *a, int n)
+{
+    int s = 0;
+    for (int i = 0; i < n; i++) {
+        int v = get(a, n, i);
+        if (v < 0)
+            fail(3);
+        s = s + v;
+    }
+    return s;
+}
+int kinds(int *a, int n)
+{
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        switch (a[i] % 3) {
+        case 1:
+            k = k + 1;
+            break;
+        case 2:
+            k = k + 10;
+            break;
+        default:
+            fail(4);
+        }
+    }
+    return k;
+}
+int limit(int k)
+{
+    if (k > 2) {
+        if (k < 9)
+            return k * 3;
+        fail(6);
+    } else
+        k = k + 1;
+    return k;
+}
+int main()
+{
+    int a[5];
+    for (int i = 0; i < 5; i++)
+        a[i] = i * i + 1;
+    printf("%d %d", sum(a, 5), get(a, 5, 4));
+    printf(" %d %d %d", kinds(a, 5), limit(4) + limit(1), checks);
+    if (checks == 6)
+        get(a, 5, 7);
+    return 0;
+}
+EOF
+done
+SHECC_FLAGS=""
+
+# batch mode: several programs compiled by one process, named on the command
+# line or in a list file
+tmp_dir="$(mktemp -d)"
+echo 'int main() { return 3; }' > "$tmp_dir/three.c"
+echo 'int main() { printf("batch"); return 4; }' > "$tmp_dir/four.c"
+echo "$tmp_dir/four.c" > "$tmp_dir/list"
+"$SHECC" -o "$tmp_dir" "$tmp_dir/three.c" "@$tmp_dir/list"
+chmod +x "$tmp_dir/three" "$tmp_dir/four"
+$TARGET_EXEC "$tmp_dir/three"
+if [ "$?" != 3 ]; then
+    echo "batch mode: three => 3 expected"
+    exit 1
+fi
+output=$($TARGET_EXEC "$tmp_dir/four")
+if [ "$?" != 4 ] || [ "$output" != "batch" ]; then
+    echo "batch mode: four => 4 and batch expected"
+    exit 1
+fi
+rm -rf "$tmp_dir"
+
+# compile server: the programs are compiled by a resident process, on behalf
+# of the clients
+tmp_dir="$(mktemp -d)"
+"$SHECC" --server "$tmp_dir/socket" &
+server_pid=$!
+for i in $(seq 50); do
+    [ -S "$tmp_dir/socket" ] && break
+    sleep 0.1
+done
+echo 'int main() { printf("server"); return 5; }' > "$tmp_dir/five.c"
+echo 'int main() { return undefined; }' > "$tmp_dir/error.c"
+(cd "$tmp_dir" && "$SHECC" --client socket -o five five.c)
+server_status=$?
+(cd "$tmp_dir" && "$SHECC" --client socket -o error error.c > /dev/null)
+error_status=$?
+kill $server_pid
+chmod +x "$tmp_dir/five"
+output=$($TARGET_EXEC "$tmp_dir/five")
+five_status=$?
+if [ "$server_status" != 0 ] || [ "$five_status" != 5 ] ||
+    [ "$output" != "server" ]; then
+    echo "compile server: five => 5 and server expected"
+    exit 1
+fi
+if [ "$error_status" == 0 ]; then
+    echo "compile server: error => failure expected"
+    exit 1
+fi
+rm -rf "$tmp_dir"
+
 echo OK